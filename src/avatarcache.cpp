@@ -0,0 +1,166 @@
+#include "avatarcache.h"
+
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QQuickTextureFactory>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QFile>
+#include <QDir>
+
+// Image handed to QML, finished from whichever thread has it
+class AvatarResponse : public QQuickImageResponse
+{
+public:
+    QQuickTextureFactory *textureFactory() const override
+    {
+        return QQuickTextureFactory::textureFactoryForImage(mImage);
+    }
+
+    void finish(const QImage &image)
+    {
+        mImage = image;
+        emit finished();
+    }
+
+private:
+    QImage mImage;
+};
+
+AvatarCache::AvatarCache() :
+    QQuickAsyncImageProvider(), mMemory(MAX_MEMORY)
+{
+    mFolder = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/avatars";
+    QDir().mkpath(mFolder);
+    mPool.setMaxThreadCount(2);
+    mNetwork = new QNetworkAccessManager(this);
+    mPool.start([this]() { prune(); });
+}
+
+AvatarCache::~AvatarCache()
+{
+    mPool.waitForDone();
+}
+
+// Id is "<hash>/<address>/<port>", "-" as hash if unknown
+QQuickImageResponse *AvatarCache::requestImageResponse(const QString &id, const QSize &)
+{
+    AvatarResponse *response = new AvatarResponse();
+    QStringList parts = id.split('/');
+    if (parts.size() != 3)
+    {
+        mPool.start([response]() { response->finish(QImage()); });
+        return response;
+    }
+
+    bool content = (parts.at(0) != "-");
+    QString key = content ? parts.at(0) : parts.at(1) + "/" + parts.at(2);
+    QString host = parts.at(1).contains(':') ? "[" + parts.at(1) + "]" : parts.at(1);
+    QString url = "http://" + host + ":" + parts.at(2) + "/dukto/avatar";
+
+    QMutexLocker locker(&mMutex);
+
+    // Decoded already, or failed not long ago
+    QImage *image = mMemory.object(key);
+    if (image || (mFailed.value(key, -RETRY_DELAY) + RETRY_DELAY > QDateTime::currentMSecsSinceEpoch()))
+    {
+        QImage copy = image ? *image : QImage();
+        mPool.start([response, copy]() { response->finish(copy); });
+        return response;
+    }
+
+    // A single load per avatar, whatever the number of tiles showing it
+    bool first = !mWaiting.contains(key);
+    mWaiting[key].append(response);
+    locker.unlock();
+    if (first) mPool.start([this, key, url, content]() { load(key, url, content); });
+    return response;
+}
+
+// Pool thread: from disk if possible, otherwise from the peer
+void AvatarCache::load(const QString &key, const QString &url, bool content)
+{
+    if (content)
+    {
+        QFile file(mFolder + "/" + key + ".png");
+        if (file.open(QIODevice::ReadOnly))
+        {
+            QImage image = QImage::fromData(file.readAll(), "PNG");
+            if (!image.isNull())
+            {
+                deliver(key, image, true);
+                return;
+            }
+        }
+    }
+    QMetaObject::invokeMethod(this, "fetch", Qt::QueuedConnection, Q_ARG(QString, key), Q_ARG(QString, url));
+}
+
+void AvatarCache::fetch(const QString &key, const QString &url)
+{
+    QNetworkRequest request((QUrl(url)));
+    request.setTransferTimeout(FETCH_TIMEOUT);
+    QNetworkReply *reply = mNetwork->get(request);
+    reply->setProperty("key", key);
+    connect(reply, SIGNAL(finished()), this, SLOT(fetchFinished()));
+}
+
+void AvatarCache::fetchFinished()
+{
+    QNetworkReply *reply = (QNetworkReply*)sender();
+    reply->deleteLater();
+    QString key = reply->property("key").toString();
+    QByteArray data = (reply->error() == QNetworkReply::NoError) ? reply->readAll() : QByteArray();
+    mPool.start([this, key, data]() { store(key, data); });
+}
+
+// Pool thread: decodes a fetched avatar, and keeps it under its own hash
+void AvatarCache::store(const QString &key, const QByteArray &data)
+{
+    QImage image = QImage::fromData(data);
+    if (image.isNull())
+    {
+        deliver(key, image, false);
+        return;
+    }
+
+    // Keys of older peers are addresses, with a slash
+    QString hash = QString::fromLatin1(QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex());
+    QSaveFile file(mFolder + "/" + hash + ".png");
+    if (file.open(QIODevice::WriteOnly))
+    {
+        file.write(data);
+        file.commit();
+    }
+
+    // The peer may have changed avatar since its hello, not kept under the old hash then
+    deliver(key, image, (key == hash) || key.contains('/'));
+}
+
+void AvatarCache::deliver(const QString &key, const QImage &image, bool keep)
+{
+    QMutexLocker locker(&mMutex);
+    if (image.isNull())
+        mFailed.insert(key, QDateTime::currentMSecsSinceEpoch());
+    else
+    {
+        mFailed.remove(key);
+        if (keep) mMemory.insert(key, new QImage(image), qMax<qsizetype>(1, image.sizeInBytes() / 1024));
+    }
+    QList<AvatarResponse*> waiting = mWaiting.take(key);
+    locker.unlock();
+
+    foreach (AvatarResponse *response, waiting)
+        response->finish(image);
+}
+
+// Oldest files beyond MAX_FILES are removed
+void AvatarCache::prune()
+{
+    QFileInfoList files = QDir(mFolder).entryInfoList(QStringList("*.png"), QDir::Files, QDir::Time);
+    for (int i = MAX_FILES; i < files.size(); i++)
+        QFile::remove(files.at(i).absoluteFilePath());
+}
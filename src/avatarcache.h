@@ -0,0 +1,58 @@
+#ifndef AVATARCACHE_H
+#define AVATARCACHE_H
+
+#include <QQuickAsyncImageProvider>
+#include <QCache>
+#include <QHash>
+#include <QMutex>
+#include <QThreadPool>
+#include <QImage>
+
+class QNetworkAccessManager;
+class AvatarResponse;
+
+// Avatars of the buddies for QML, "image://avatars/<hash>/<address>/<port>"
+// with "-" as hash for peers that don't advertise it.
+//
+// Avatars advertised with a hash (HELLO v2) are stored on disk under that
+// hash and kept decoded in memory, so they're fetched once, and again only
+// when a peer advertises a different hash (which is a different URL).
+// Avatars of older peers are keyed by address and fetched once per
+// session. Files are read and decoded on a thread pool, the fetches run on
+// the GUI thread. requestImageResponse() is called from the QML image
+// loading threads.
+class AvatarCache : public QQuickAsyncImageProvider
+{
+    Q_OBJECT
+
+public:
+    static const int MAX_MEMORY = 16384;        // KB of decoded images
+    static const int MAX_FILES = 512;           // Kept on disk
+    static const int RETRY_DELAY = 60000;       // ms before a failed avatar is fetched again
+    static const int FETCH_TIMEOUT = 5000;
+
+    AvatarCache();
+    ~AvatarCache();
+
+    QQuickImageResponse *requestImageResponse(const QString &id, const QSize &requestedSize) override;
+
+private slots:
+    void fetch(const QString &key, const QString &url);
+    void fetchFinished();
+
+private:
+    void load(const QString &key, const QString &url, bool content);
+    void store(const QString &key, const QByteArray &data);
+    void deliver(const QString &key, const QImage &image, bool keep);
+    void prune();
+
+    QString mFolder;
+    QMutex mMutex;
+    QCache<QString, QImage> mMemory;
+    QHash<QString, QList<AvatarResponse*> > mWaiting;
+    QHash<QString, qint64> mFailed;
+    QThreadPool mPool;
+    QNetworkAccessManager *mNetwork;
+};
+
+#endif // AVATARCACHE_H
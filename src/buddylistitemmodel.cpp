@@ -1,13 +1,21 @@
 #include "buddylistitemmodel.h"
 
-#include <QUrl>
-#include <QRegularExpression> // changed from QRegExp
-
 #include "platform.h"
 #include "peer.h"
 
+// Avatar served by AvatarCache, "-" as hash if it isn't known
+static QUrl avatarUrl(const QByteArray &hash, const QString &address, quint16 port)
+{
+    return QUrl("image://avatars/" + (hash.isEmpty() ? QString("-") : QString::fromLatin1(hash.toHex()))
+                + "/" + address + "/" + QString::number(port));
+}
+
 BuddyListItemModel::BuddyListItemModel() :
-    QStandardItemModel(NULL)
+    QAbstractListModel(NULL), mShowBackRow(-1)
+{
+}
+
+QHash<int, QByteArray> BuddyListItemModel::roleNames() const
 {
     QHash<int, QByteArray> roleNames;
     roleNames[Ip] = "ip";
@@ -19,7 +27,83 @@ BuddyListItemModel::BuddyListItemModel() :
     roleNames[Avatar] = "avatar";
     roleNames[OsLogo] = "oslogo";
     roleNames[ShowBack] = "showback";
-    setItemRoleNames(roleNames);
+    return roleNames;
+}
+
+int BuddyListItemModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : mBuddies.size();
+}
+
+QVariant BuddyListItemModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || (index.row() >= mBuddies.size())) return QVariant();
+    const Buddy &b = mBuddies.at(index.row());
+    switch (role)
+    {
+    case Ip: return b.ip;
+    case Port: return b.port;
+    case Username: return b.username;
+    case System: return b.system;
+    case Platform: return b.platform;
+    case GenericAvatar: return genericAvatar(b.os);
+    case Avatar: return b.avatar;
+    case OsLogo: return osLogo(b.os);
+    case ShowBack: return b.showBack;
+    }
+    return QVariant();
+}
+
+BuddyListItemModel::Os BuddyListItemModel::osFromPlatform(const QString &platform)
+{
+    QString p = platform.toLower();
+    if (p == "windows") return Windows;
+    if (p == "macintosh") return Macintosh;
+    if (p == "linux") return Linux;
+    if (p == "symbian") return Symbian;
+    if (p == "ios") return Ios;
+    if (p == "windowsphone") return WindowsPhone;
+    if (p == "blackberry") return Blackberry;
+    if (p == "android") return Android;
+    if (p == "ip") return IpConnection;
+    return UnknownOs;
+}
+
+const QString& BuddyListItemModel::genericAvatar(Os os)
+{
+    static const QString smartphone("qrc:/src/assets/SmartphoneLogo.png");
+    static const QString ip("qrc:/src/assets/IpLogo.png");
+    static const QString pc("qrc:/src/assets/PcLogo.png");
+    switch (os)
+    {
+    case Symbian:
+    case Android:
+    case Ios:
+    case Blackberry:
+    case WindowsPhone:
+        return smartphone;
+    case IpConnection:
+        return ip;
+    default:
+        return pc;
+    }
+}
+
+const QString& BuddyListItemModel::osLogo(Os os)
+{
+    static const QString logos[] = {
+        "qrc:/src/assets/UnknownLogo.png",
+        "qrc:/src/assets/WindowsLogo.png",
+        "qrc:/src/assets/AppleLogo.png",
+        "qrc:/src/assets/LinuxLogo.png",
+        "qrc:/src/assets/SymbianLogo.png",
+        "qrc:/src/assets/IosLogo.png",
+        "qrc:/src/assets/WindowsPhoneLogo.png",
+        "qrc:/src/assets/BlackberryLogo.png",
+        "qrc:/src/assets/AndroidLogo.png",
+        "qrc:/src/assets/UnknownLogo.png"
+    };
+    return logos[os];
 }
 
 void BuddyListItemModel::addMeElement()
@@ -44,130 +128,124 @@ void BuddyListItemModel::addIpElement()
 
 void BuddyListItemModel::addBuddy(QString ip, qint16 port, QString username, QString system, QString platform, QUrl avatarPath)
 {
-    QStandardItem* it = NULL;
-    bool add = true;
-    // qDebug() << "Adding buddy with IP:" << ip.mid(7);
-    // Check if the same IP is alreay in the buddy list
-    if (mItemsMap.contains(ip)) {
-        it = mItemsMap[ip];
-        add = false;
-    }
-    else
-        it = new QStandardItem();
-    it->setData(ip, BuddyListItemModel::Ip);
-    it->setData(port, BuddyListItemModel::Port);
-    it->setData(false, BuddyListItemModel::ShowBack);
-
-    // Set (or update) data
-    it->setData(username, BuddyListItemModel::Username);
-    if (ip != "IP")
-        it->setData("at " + system, BuddyListItemModel::System);
-    else
-        it->setData(system, BuddyListItemModel::System);
-    it->setData(platform, BuddyListItemModel::Platform);
-    it->setData(avatarPath, BuddyListItemModel::Avatar);
-
-    // Update generic avatar
-    if ((platform.toLower() == "symbian") || (platform.toLower() == "android") || (platform.toLower() == "ios") || (platform.toLower() == "blackberry") || (platform.toLower() == "windowsphone"))
-        it->setData("qrc:/src/assets/SmartphoneLogo.png", BuddyListItemModel::GenericAvatar);
-    else if (platform.toLower() == "ip")
-        it->setData("qrc:/src/assets/IpLogo.png", BuddyListItemModel::GenericAvatar);
-    else
-        it->setData("qrc:/src/assets/PcLogo.png", BuddyListItemModel::GenericAvatar);
-
-    // Update logo
-    if (platform.toLower() == "windows")
-        it->setData("qrc:/src/assets/WindowsLogo.png", BuddyListItemModel::OsLogo);
-    else if (platform.toLower() == "macintosh")
-        it->setData("qrc:/src/assets/AppleLogo.png", BuddyListItemModel::OsLogo);
-    else if (platform.toLower() == "linux")
-        it->setData("qrc:/src/assets/LinuxLogo.png", BuddyListItemModel::OsLogo);
-    else if (platform.toLower() == "symbian")
-        it->setData("qrc:/src/assets/SymbianLogo.png", BuddyListItemModel::OsLogo);
-    else if (platform.toLower() == "ios")
-        it->setData("qrc:/src/assets/IosLogo.png", BuddyListItemModel::OsLogo);
-    else if (platform.toLower() == "windowsphone")
-        it->setData("qrc:/src/assets/WindowsPhoneLogo.png", BuddyListItemModel::OsLogo);
-    else if (platform.toLower() == "blackberry")
-        it->setData("qrc:/src/assets/BlackberryLogo.png", BuddyListItemModel::OsLogo);
-    else if (platform.toLower() == "android")
-        it->setData("qrc:/src/assets/AndroidLogo.png", BuddyListItemModel::OsLogo);
-    else
-        it->setData("qrc:/src/assets/UnknownLogo.png", BuddyListItemModel::OsLogo);
-
-    // Add elemento to the list
-    if (add) {
-        appendRow(it);
-        if (ip != "")
-            mItemsMap.insert(ip, it);
-        else
-            mMeItem = it;
+    Buddy b;
+    b.ip = ip;
+    b.port = port;
+    b.username = username;
+    b.system = (ip != "IP") ? "at " + system : system;
+    b.platform = platform;
+    b.os = osFromPlatform(platform);
+    b.avatar = avatarPath;
+    b.showBack = false;
+
+    // New element
+    int row = mRows.value(ip, -1);
+    if (row < 0)
+    {
+        row = mBuddies.size();
+        beginInsertRows(QModelIndex(), row, row);
+        mBuddies.append(b);
+        mRows.insert(ip, row);
+        endInsertRows();
+        return;
     }
+
+    // Same element again (a hello), only what changed is updated
+    Buddy &old = mBuddies[row];
+    QList<int> roles;
+    if (old.port != b.port) roles << Port;
+    if (old.username != b.username) roles << Username;
+    if (old.system != b.system) roles << System;
+    if (old.platform != b.platform) roles << Platform;
+    if (old.os != b.os) roles << GenericAvatar << OsLogo;
+    if (old.avatar != b.avatar) roles << Avatar;
+    if (roles.isEmpty()) return;
+    b.showBack = old.showBack;
+    old = b;
+    changed(row, roles);
 }
 
 void BuddyListItemModel::addBuddy(Peer &peer)
 {
-    static const QRegularExpression rx("^(.*)\\sat\\s(.*)\\s\\((.*)\\)$"); // Use static
-    QRegularExpressionMatch match = rx.match(peer.name);
-    QString username, system, platform;
-    if (match.hasMatch()) {
-        username = match.captured(1);
-        system = match.captured(2);
-        platform = match.captured(3);
-    } else {
-        username = peer.name;
-        system = "";
-        platform = "";
-    }
-    QUrl avatarPath = QUrl("http://" + peer.address.toString() + ":" + QString::number(peer.port + 1) + "/dukto/avatar");
+    // The name has already been split by the peer registry
+    QUrl avatarPath = avatarUrl(QByteArray(), peer.address.toString(), peer.port + 1);
+
+    // HELLO v2 peers tell their ports, if they have an avatar at all, and
+    // its hash, which is the cache key (a new hash is a new URL)
+    if (!peer.instanceId.isEmpty())
+        avatarPath = (peer.avatarPort == 0) ? QUrl() :
+            avatarUrl(peer.avatarHash, peer.address.toString(), peer.avatarPort);
 
     addBuddy(peer.address.toString(),
-             peer.port,
-             username,
-             system,
-             platform,
+             (peer.tcpPort != 0) ? peer.tcpPort : peer.port,
+             peer.username,
+             peer.system,
+             peer.platform,
              avatarPath);
 }
 
 void BuddyListItemModel::removeBuddy(QString ip)
 {
-    // Check for element
-    if (!mItemsMap.contains(ip)) return;
-
-    // Get element
-    QStandardItem* it = mItemsMap[ip];
-
-    // Remove element
-    mItemsMap.remove(ip);
-    this->removeRow(this->indexFromItem(it).row());
+    // Check for element, "Me" stays
+    int row = mRows.value(ip, -1);
+    if ((row < 0) || ip.isEmpty()) return;
+
+    // Remove element, the following ones move up
+    beginRemoveRows(QModelIndex(), row, row);
+    mBuddies.removeAt(row);
+    mRows.remove(ip);
+    for (int i = row; i < mBuddies.size(); i++)
+        mRows[mBuddies.at(i).ip] = i;
+    if (mShowBackRow == row) mShowBackRow = -1;
+    else if (mShowBackRow > row) mShowBackRow--;
+    endRemoveRows();
 }
 
+// Only the element showing its back and the new one are touched
 void BuddyListItemModel::showSingleBack(int idx)
 {
-    for (int i = 0; i < rowCount(); i++)
-        itemFromIndex(index(i, 0))->setData(false, BuddyListItemModel::ShowBack);
-    itemFromIndex(index(idx, 0))->setData(true, BuddyListItemModel::ShowBack);
+    if ((idx < 0) || (idx >= mBuddies.size()) || (idx == mShowBackRow)) return;
+    if (mShowBackRow >= 0)
+    {
+        mBuddies[mShowBackRow].showBack = false;
+        changed(mShowBackRow, QList<int>() << ShowBack);
+    }
+    mShowBackRow = idx;
+    mBuddies[idx].showBack = true;
+    changed(idx, QList<int>() << ShowBack);
 }
 
 QString BuddyListItemModel::buddyNameByIp(QString ip)
 {
-    if (!mItemsMap.contains(ip)) return "";
-    return mItemsMap.value(ip)->data(BuddyListItemModel::Username).toString();
+    const Buddy *b = buddyByIp(ip);
+    return b ? b->username : "";
 }
 
-QStandardItem* BuddyListItemModel::buddyByIp(QString ip)
+const BuddyListItemModel::Buddy* BuddyListItemModel::buddyByIp(QString ip)
 {
-    if (!mItemsMap.contains(ip)) return NULL;
-    return mItemsMap.value(ip);
+    int row = mRows.value(ip, -1);
+    if ((row < 0) || ip.isEmpty()) return NULL;
+    return &mBuddies.at(row);
 }
 
 QString BuddyListItemModel::fistBuddyIp()
 {
-    if (this->rowCount() < 3) return "";
-    return this->index(2, 0).data(BuddyListItemModel::Ip).toString();
+    if (mBuddies.size() < 3) return "";
+    return mBuddies.at(2).ip;
 }
 
 void BuddyListItemModel::updateMeElement()
 {
-    mMeItem->setData(Platform::getSystemUsername(), BuddyListItemModel::Username);
+    int row = mRows.value("", -1);
+    if (row < 0) return;
+    QString username = Platform::getSystemUsername();
+    if (mBuddies.at(row).username == username) return;
+    mBuddies[row].username = username;
+    changed(row, QList<int>() << Username);
+}
+
+void BuddyListItemModel::changed(int row, const QList<int> &roles)
+{
+    QModelIndex i = index(row);
+    emit dataChanged(i, i, roles);
 }
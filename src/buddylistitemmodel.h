@@ -1,26 +1,20 @@
 #ifndef BUDDYLISTITEMMODEL_H
 #define BUDDYLISTITEMMODEL_H
 
-#include <QStandardItemModel>
+#include <QAbstractListModel>
+#include <QList>
+#include <QHash>
+#include <QUrl>
 
 class Peer;
-class QUrl;
 
-class BuddyListItemModel : public QStandardItemModel
+// Buddies shown by the buddy list, "Me" and "IP connection" first. Rows
+// are compact structs in a contiguous list with the platform resolved
+// once, found by address through an index, so that a hello costs a hash
+// lookup and a dataChanged() for the roles that really changed, if any.
+class BuddyListItemModel : public QAbstractListModel
 {
 public:
-    BuddyListItemModel();
-    void addMeElement();
-    void addIpElement();
-    void addBuddy(QString ip, qint16 port, QString username, QString system, QString platform, QUrl avatarPath);
-    void addBuddy(Peer& peer);
-    void removeBuddy(QString ip);
-    void showSingleBack(int idx);
-    void updateMeElement();
-    QString buddyNameByIp(QString ip);
-    QStandardItem* buddyByIp(QString ip);
-    QString fistBuddyIp();
-
     enum BuddyRoles {
         Ip = Qt::UserRole + 1,
         Port,
@@ -33,9 +27,56 @@ public:
         ShowBack
     };
 
+    enum Os {
+        UnknownOs,
+        Windows,
+        Macintosh,
+        Linux,
+        Symbian,
+        Ios,
+        WindowsPhone,
+        Blackberry,
+        Android,
+        IpConnection
+    };
+
+    struct Buddy {
+        QString ip;
+        qint16 port;
+        QString username;
+        QString system;         // As shown ("at <system>")
+        QString platform;
+        Os os;
+        QUrl avatar;
+        bool showBack;
+    };
+
+    BuddyListItemModel();
+    void addMeElement();
+    void addIpElement();
+    void addBuddy(QString ip, qint16 port, QString username, QString system, QString platform, QUrl avatarPath);
+    void addBuddy(Peer& peer);
+    void removeBuddy(QString ip);
+    void showSingleBack(int idx);
+    void updateMeElement();
+    QString buddyNameByIp(QString ip);
+    const Buddy* buddyByIp(QString ip);     // Valid until the next change
+    QString fistBuddyIp();
+
+    static Os osFromPlatform(const QString &platform);
+    static const QString& genericAvatar(Os os);
+    static const QString& osLogo(Os os);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
 private:
-    QHash<QString, QStandardItem*> mItemsMap;
-    QStandardItem* mMeItem;
+    void changed(int row, const QList<int> &roles);
+
+    QList<Buddy> mBuddies;
+    QHash<QString, int> mRows;  // By address, "" for "Me"
+    int mShowBackRow;           // -1 if none
 };
 
 #endif // BUDDYLISTITEMMODEL_H
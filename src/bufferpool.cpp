@@ -0,0 +1,48 @@
+#include "bufferpool.h"
+
+#include <QtGlobal>
+
+#define BLOCK_ALIGNMENT 64
+
+BufferPool::BufferPool() :
+    mAllocations(0), mReuses(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    foreach (char *block, mFreeBlocks)
+        qFreeAligned(block);
+}
+
+char* BufferPool::acquire()
+{
+    // Reuse an idle block if possible
+    if (!mFreeBlocks.isEmpty()) {
+        mReuses++;
+        return mFreeBlocks.takeLast();
+    }
+
+    mAllocations++;
+    char *block = static_cast<char*>(qMallocAligned(BLOCK_SIZE, BLOCK_ALIGNMENT));
+    Q_CHECK_PTR(block);
+    return block;
+}
+
+void BufferPool::release(char *block)
+{
+    if (block == NULL) return;
+
+    // Keep the pool bounded
+    if (mFreeBlocks.size() >= MAX_IDLE_BLOCKS) {
+        qFreeAligned(block);
+        return;
+    }
+    mFreeBlocks.append(block);
+}
+
+void BufferPool::resetCounters()
+{
+    mAllocations = 0;
+    mReuses = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QList>
+
+// Pool of fixed-size, aligned memory blocks shared by the send, receive
+// and discovery paths, so that the hot loops don't go through the heap
+// for every chunk or datagram. Used from the GUI thread only.
+class BufferPool
+{
+public:
+    static const int BLOCK_SIZE = 65536;    // Also the max size of a UDP datagram
+    static const int MAX_IDLE_BLOCKS = 16;  // Blocks kept for reuse
+
+    static BufferPool& instance() {
+        static BufferPool instance;
+        return instance;
+    }
+
+    char* acquire();
+    void release(char *block);
+
+    // Counters, useful to check that a transfer doesn't allocate
+    inline qint64 allocations() const { return mAllocations; }
+    inline qint64 reuses() const { return mReuses; }
+    inline int idleBlocks() const { return mFreeBlocks.size(); }
+    void resetCounters();
+
+private:
+    BufferPool();
+    ~BufferPool();
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    QList<char*> mFreeBlocks;
+    qint64 mAllocations;
+    qint64 mReuses;
+};
+
+// Block borrowed from the pool for the lifetime of the object
+class PooledBuffer
+{
+public:
+    inline PooledBuffer() : mData(BufferPool::instance().acquire()) { }
+    inline ~PooledBuffer() { BufferPool::instance().release(mData); }
+    inline char* data() { return mData; }
+    inline int size() const { return BufferPool::BLOCK_SIZE; }
+
+private:
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    char *mData;
+};
+
+#endif // BUFFERPOOL_H
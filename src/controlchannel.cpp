@@ -0,0 +1,502 @@
+#include "controlchannel.h"
+
+#include <QRandomGenerator>
+#include <QtEndian>
+#include <algorithm>
+#include <functional>
+
+#define SESSION_VERSION 1
+#define FRAME_HEADER_SIZE 9         // Type, ID, length
+#define FRAME_DATA_SIZE 16384       // Data of a message per frame
+#define FRAME_MAX_SIZE 65536        // Larger frames are a protocol error
+#define WRITE_HIGH_WATER 262144     // Bytes queued in the socket before waiting
+#define PROGRESS_STEP 262144        // Bytes received between two progress frames
+#define MAX_RETRIES 3               // Reconnections before the pending messages fail
+#define RETRY_DELAY 250             // ms before the first reconnection, doubled each time
+#define IDLE_TIMEOUT 600000         // ms an unused connection is kept
+#define DELIVERED_MEMORY 256        // Messages remembered to drop resent duplicates
+#define MAX_INCOMING 2              // Messages received at the same time on a connection
+#define MAX_ACCEPTED_PER_PEER 4     // Connections accepted from the same address
+#define MAX_ACCEPTED 32             // Connections accepted in all
+
+static QByteArray sessionHeader()
+{
+    QByteArray header(8, '\xff');
+    header.append("DKCTRL");
+    quint16 version = qToLittleEndian<quint16>(SESSION_VERSION);
+    header.append((const char*) &version, sizeof(version));
+    return header;
+}
+
+ControlChannel::ControlChannel(QObject *parent) :
+    QObject(parent)
+{
+    // Random first ID, so that the IDs of a restarted peer don't look resent
+    mNextId = QRandomGenerator::global()->generate() | 1;
+    mClock.start();
+    mIdleTimer.setInterval(60000);
+    connect(&mIdleTimer, &QTimer::timeout, this, &ControlChannel::checkIdle);
+}
+
+ControlChannel::~ControlChannel()
+{
+    qDeleteAll(mOutgoing);
+    qDeleteAll(mIncoming);
+}
+
+bool ControlChannel::isSessionHeader(const QByteArray &header)
+{
+    return (header.size() >= 16) && header.startsWith(sessionHeader().left(14));
+}
+
+void ControlChannel::accept(QTcpSocket *socket)
+{
+    // Each one may hold messages being received: a few per peer, and in all
+    QHostAddress address = socket->peerAddress();
+    int fromPeer = 0;
+    for (const Connection *other : std::as_const(mIncoming))
+        if (other->socket && (other->socket->peerAddress() == address)) fromPeer++;
+    if ((fromPeer >= MAX_ACCEPTED_PER_PEER) || (mIncoming.size() >= MAX_ACCEPTED))
+    {
+        socket->abort();
+        socket->deleteLater();
+        return;
+    }
+
+    Connection *c = new Connection();
+    c->ip = socket->peerAddress().toString();
+    c->port = 0;
+    c->socket = socket;
+    c->retries = 0;
+    c->idle.start();
+    socket->setParent(this);
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    socket->read(16);
+    mIncoming.append(c);
+    if (!mIdleTimer.isActive()) mIdleTimer.start();
+    attach(c);
+    if (socket->bytesAvailable() > 0) readFrames(c);
+}
+
+quint32 ControlChannel::sendText(const QString &ip, qint16 port, const QString &text)
+{
+    Message m;
+    m.type = FrameText;
+    m.data = text.toUtf8();
+    quint64 size = qToLittleEndian<quint64>(m.data.size());
+    m.head = QByteArray((const char*) &size, sizeof(size));
+    enqueue(ip, port, m);
+    return m.id;
+}
+
+quint32 ControlChannel::sendFile(const QString &ip, qint16 port, const QString &name, const QByteArray &data)
+{
+    Message m;
+    m.type = FrameFile;
+    m.data = data;
+    quint64 size = qToLittleEndian<quint64>(m.data.size());
+    m.head = QByteArray((const char*) &size, sizeof(size));
+    m.head.append(name.toUtf8());
+    enqueue(ip, port, m);
+    return m.id;
+}
+
+// Round trip on the connection, answered with pingReply()
+quint32 ControlChannel::ping(const QString &ip, qint16 port)
+{
+    Message m;
+    m.type = FramePing;
+    enqueue(ip, port, m);
+    return m.id;
+}
+
+void ControlChannel::cancel(quint32 id)
+{
+    for (Connection *c : std::as_const(mOutgoing))
+    {
+        bool started = c->sent.remove(id);
+        bool found = started;
+        for (int i = 0; !found && (i < c->queue.size()); i++)
+            if (c->queue.at(i).id == id)
+            {
+                started = c->queue.at(i).started;
+                c->queue.removeAt(i);
+                found = true;
+            }
+        if (!found) continue;
+
+        // The receiver only knows about the messages already started
+        if (started && c->socket && (c->socket->state() == QAbstractSocket::ConnectedState))
+            writeFrame(c->socket, FrameCancel, id, QByteArray());
+        return;
+    }
+}
+
+ControlChannel::Connection* ControlChannel::outgoing(const QString &ip, qint16 port)
+{
+    QString key = ip + ":" + QString::number(port);
+    Connection *c = mOutgoing.value(key);
+    if (c) return c;
+
+    c = new Connection();
+    c->key = key;
+    c->ip = ip;
+    c->port = port;
+    c->socket = NULL;
+    c->retries = 0;
+    c->idle.start();
+    mOutgoing.insert(key, c);
+    if (!mIdleTimer.isActive()) mIdleTimer.start();
+    openSocket(c);
+    return c;
+}
+
+void ControlChannel::enqueue(const QString &ip, qint16 port, Message m)
+{
+    m.id = mNextId++;
+    if (m.id == 0) m.id = mNextId++;
+    m.offset = 0;
+    m.started = false;
+
+    Connection *c = outgoing(ip, port);
+
+    // Pings go first, they measure the connection and not the queue
+    if (m.type == FramePing)
+        c->queue.prepend(m);
+    else
+        c->queue.append(m);
+    pump(c);
+}
+
+void ControlChannel::openSocket(Connection *c)
+{
+    c->socket = new QTcpSocket(this);
+    c->socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    c->socket->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+    attach(c);
+    connect(c->socket, &QTcpSocket::connected, this, [this, c]() {
+        c->socket->write(sessionHeader());
+        pump(c);
+    });
+    c->socket->connectToHost(c->ip, c->port);
+}
+
+void ControlChannel::attach(Connection *c)
+{
+    connect(c->socket, &QTcpSocket::readyRead, this, [this, c]() { readFrames(c); });
+    connect(c->socket, &QTcpSocket::bytesWritten, this, [this, c]() { pump(c); });
+    connect(c->socket, &QTcpSocket::disconnected, this, [this, c]() { connectionLost(c); });
+    connect(c->socket, &QTcpSocket::errorOccurred, this, [this, c]() { connectionLost(c); });
+}
+
+// Frames as much of the queued messages as the socket takes, one frame
+// per message in turn
+void ControlChannel::pump(Connection *c)
+{
+    if (!c->socket || (c->socket->state() != QAbstractSocket::ConnectedState)) return;
+
+    int active = 0;
+    for (const Message &q : std::as_const(c->queue))
+        if (q.started) active++;
+
+    while (!c->queue.isEmpty() && (c->socket->bytesToWrite() < WRITE_HIGH_WATER))
+    {
+        // The receiver takes MAX_INCOMING messages at a time, the next ones wait
+        qsizetype i = 0;
+        if (active >= MAX_INCOMING)
+            while ((i < c->queue.size()) && !c->queue.at(i).started && (c->queue.at(i).type != FramePing)) i++;
+        if (i == c->queue.size()) break;
+        Message m = c->queue.takeAt(i);
+        c->idle.restart();
+
+        if (m.type == FramePing)
+        {
+            qint64 now = qToLittleEndian<qint64>(mClock.nsecsElapsed() / 1000);
+            writeFrame(c->socket, FramePing, m.id, QByteArray((const char*) &now, sizeof(now)));
+            c->sent.insert(m.id, m);
+            continue;
+        }
+
+        if (!m.started)
+        {
+            writeFrame(c->socket, m.type, m.id, m.head);
+            m.started = true;
+            active++;
+        }
+
+        qint64 n = qMin<qint64>(FRAME_DATA_SIZE, m.data.size() - m.offset);
+        if (n > 0)
+        {
+            writeFrame(c->socket, FrameData, m.id, QByteArray::fromRawData(m.data.constData() + m.offset, n));
+            m.offset += n;
+        }
+
+        if (m.offset < m.data.size())
+        {
+            c->queue.append(m);
+            continue;
+        }
+        writeFrame(c->socket, FrameEnd, m.id, QByteArray());
+        c->sent.insert(m.id, m);
+        active--;
+    }
+}
+
+void ControlChannel::writeFrame(QTcpSocket *socket, quint8 type, quint32 id, const QByteArray &payload)
+{
+    char header[FRAME_HEADER_SIZE];
+    header[0] = type;
+    qToLittleEndian<quint32>(id, header + 1);
+    qToLittleEndian<quint32>(payload.size(), header + 5);
+    socket->write(header, sizeof(header));
+    if (!payload.isEmpty()) socket->write(payload);
+}
+
+void ControlChannel::readFrames(Connection *c)
+{
+    c->input.append(c->socket->readAll());
+    c->idle.restart();
+
+    qsizetype pos = 0;
+    while (c->input.size() - pos >= FRAME_HEADER_SIZE)
+    {
+        const char *h = c->input.constData() + pos;
+        quint8 type = h[0];
+        quint32 id = qFromLittleEndian<quint32>(h + 1);
+        quint32 length = qFromLittleEndian<quint32>(h + 5);
+        if (length > FRAME_MAX_SIZE)
+        {
+            connectionLost(c);
+            return;
+        }
+        if (c->input.size() - pos < FRAME_HEADER_SIZE + length) break;
+
+        QByteArray payload = c->input.mid(pos + FRAME_HEADER_SIZE, length);
+        pos += FRAME_HEADER_SIZE + length;
+        handleFrame(c, type, id, payload);
+    }
+    c->input.remove(0, pos);
+}
+
+void ControlChannel::handleFrame(Connection *c, quint8 type, quint32 id, const QByteArray &payload)
+{
+    switch (type)
+    {
+    case FrameText:
+    case FrameFile:
+    {
+        if (payload.size() < 8) break;
+        Incoming in;
+        in.type = type;
+        in.size = qFromLittleEndian<quint64>(payload.constData());
+        in.acked = 0;
+        if (type == FrameFile) in.name = QString::fromUtf8(payload.mid(8));
+        // Too large, or more messages at once than the sender should start
+        if ((in.size < 0) || (in.size > MAX_MESSAGE_SIZE) || (c->incoming.size() >= MAX_INCOMING))
+        {
+            writeFrame(c->socket, FrameCancel, id, QByteArray());
+            break;
+        }
+        c->incoming.insert(id, in);
+        break;
+    }
+
+    case FrameData:
+    {
+        auto it = c->incoming.find(id);
+        if (it == c->incoming.end()) break;
+        it->data.append(payload);
+        if (it->data.size() > it->size)
+        {
+            c->incoming.erase(it);
+            writeFrame(c->socket, FrameCancel, id, QByteArray());
+            break;
+        }
+
+        // Progress for the sender, now and then
+        if (it->data.size() - it->acked >= PROGRESS_STEP)
+        {
+            it->acked = it->data.size();
+            qint64 received = qToLittleEndian<qint64>(it->acked);
+            writeFrame(c->socket, FrameProgress, id, QByteArray((const char*) &received, sizeof(received)));
+        }
+        break;
+    }
+
+    case FrameEnd:
+    {
+        // Never started (or already cancelled): nothing to deliver
+        auto it = c->incoming.find(id);
+        if (it == c->incoming.end())
+        {
+            writeFrame(c->socket, FrameCancel, id, QByteArray());
+            break;
+        }
+        Incoming in = *it;
+        c->incoming.erase(it);
+        if (in.data.size() != in.size)
+        {
+            writeFrame(c->socket, FrameCancel, id, QByteArray());
+            break;
+        }
+
+        // Delivered, also when resent after the ack got lost
+        qint64 received = qToLittleEndian<qint64>(in.size);
+        writeFrame(c->socket, FrameProgress, id, QByteArray((const char*) &received, sizeof(received)));
+        QString key = c->ip + "/" + QString::number(id);
+        if (mDelivered.contains(key)) break;
+        mDelivered.append(key);
+        if (mDelivered.size() > DELIVERED_MEMORY) mDelivered.removeFirst();
+
+        if (in.type == FrameText)
+            emit textReceived(c->ip, QString::fromUtf8(in.data));
+        else
+            emit fileReceived(c->ip, in.name, in.data);
+        break;
+    }
+
+    case FrameCancel:
+    {
+        // Dropped by the sender
+        if (c->incoming.remove(id)) break;
+
+        // Refused by the receiver
+        bool found = c->sent.remove(id);
+        for (int i = 0; !found && (i < c->queue.size()); i++)
+            if (c->queue.at(i).id == id)
+            {
+                c->queue.removeAt(i);
+                found = true;
+            }
+        if (found) emit messageFailed(id);
+        break;
+    }
+
+    case FrameProgress:
+    {
+        if (payload.size() < 8) break;
+        qint64 delivered = qFromLittleEndian<qint64>(payload.constData());
+        auto it = c->sent.find(id);
+        if (it != c->sent.end())
+        {
+            qint64 total = it->data.size();
+            emit messageProgress(id, total, delivered);
+            if (delivered < total) break;
+            c->sent.erase(it);
+            c->retries = 0;
+            emit messageDelivered(id);
+            break;
+        }
+        for (const Message &m : std::as_const(c->queue))
+            if (m.id == id)
+            {
+                emit messageProgress(id, m.data.size(), delivered);
+                break;
+            }
+        break;
+    }
+
+    case FramePing:
+        writeFrame(c->socket, FramePong, id, payload);
+        break;
+
+    case FramePong:
+    {
+        if (!c->sent.remove(id) || (payload.size() < 8)) break;
+        c->retries = 0;
+        qint64 sent = qFromLittleEndian<qint64>(payload.constData());
+        emit pingReply(id, mClock.nsecsElapsed() / 1000 - sent);
+        break;
+    }
+    }
+}
+
+// The messages not acknowledged yet are sent again on a new connection;
+// they fail only after a few attempts
+void ControlChannel::connectionLost(Connection *c)
+{
+    if (c->socket)
+    {
+        disconnect(c->socket, nullptr, this, nullptr);
+        c->socket->abort();
+        c->socket->deleteLater();
+        c->socket = NULL;
+    }
+    c->input.clear();
+    c->incoming.clear();
+
+    // Accepted connection, the peer opens a new one if needed
+    if (c->key.isEmpty())
+    {
+        mIncoming.removeOne(c);
+        delete c;
+        return;
+    }
+
+    QList<quint32> ids = c->sent.keys();
+    std::sort(ids.begin(), ids.end(), std::greater<quint32>());
+    for (quint32 id : ids)
+    {
+        Message m = c->sent.take(id);
+        m.offset = 0;
+        m.started = false;
+        c->queue.prepend(m);
+    }
+    for (Message &m : c->queue)
+    {
+        m.offset = 0;
+        m.started = false;
+    }
+
+    // Nothing pending, no need to reconnect now
+    if (c->queue.isEmpty())
+    {
+        mOutgoing.remove(c->key);
+        delete c;
+        return;
+    }
+
+    if (++c->retries > MAX_RETRIES)
+    {
+        QList<Message> failed = c->queue;
+        mOutgoing.remove(c->key);
+        delete c;
+        for (const Message &m : std::as_const(failed))
+            emit messageFailed(m.id);
+        return;
+    }
+
+    QString key = c->key;
+    QTimer::singleShot(RETRY_DELAY << (c->retries - 1), this, [this, key]() {
+        Connection *c = mOutgoing.value(key);
+        if (c && !c->socket) openSocket(c);
+    });
+}
+
+void ControlChannel::closeConnection(Connection *c)
+{
+    if (c->socket)
+    {
+        disconnect(c->socket, nullptr, this, nullptr);
+        c->socket->disconnectFromHost();
+        c->socket->deleteLater();
+    }
+    if (c->key.isEmpty())
+        mIncoming.removeOne(c);
+    else
+        mOutgoing.remove(c->key);
+    delete c;
+}
+
+// Closes the connections unused for a while, the next message opens
+// them again. Accepted ones too, when nothing is being received on them.
+void ControlChannel::checkIdle()
+{
+    for (Connection *c : mOutgoing.values())
+        if (c->queue.isEmpty() && c->sent.isEmpty() && (c->idle.elapsed() > IDLE_TIMEOUT))
+            closeConnection(c);
+    for (Connection *c : QList<Connection*>(mIncoming))
+        if (c->incoming.isEmpty() && (c->idle.elapsed() > IDLE_TIMEOUT))
+            closeConnection(c);
+    if (mOutgoing.isEmpty() && mIncoming.isEmpty()) mIdleTimer.stop();
+}
@@ -0,0 +1,117 @@
+#ifndef CONTROLCHANNEL_H
+#define CONTROLCHANNEL_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QtNetwork/QTcpSocket>
+
+// Long-lived connections to the peers supporting them
+// (DuktoProtocol::FeatureControlChannel). Text snippets and small files
+// are sent as messages over them, without a new connection and session
+// header each time. Messages are split in frames, so that a large one
+// doesn't hold back the small ones sent after it. Two messages at most
+// are received at the same time on a connection, the others wait.
+//
+// Session header (16 bytes, where a transfer has its header):
+//  - 0xFF x 8 (never a valid element count), "DKCTRL", version (quint16 LE)
+// Frame:
+//  - type (quint8), message ID (quint32 LE), payload length (quint32 LE), payload
+//
+// Each side sends its messages on the connections it opens, and only
+// acknowledges the ones received on the connections it accepts.
+class ControlChannel : public QObject
+{
+    Q_OBJECT
+
+public:
+    static const int MAX_MESSAGE_SIZE = 4194304;    // Larger data goes through a normal transfer
+
+    explicit ControlChannel(QObject *parent = NULL);
+    ~ControlChannel();
+
+    static bool isSessionHeader(const QByteArray &header);
+
+    // Incoming connection, its session header still unread
+    void accept(QTcpSocket *socket);
+
+    // Queue a message, returns its ID
+    quint32 sendText(const QString &ip, qint16 port, const QString &text);
+    quint32 sendFile(const QString &ip, qint16 port, const QString &name, const QByteArray &data);
+    quint32 ping(const QString &ip, qint16 port);
+    void cancel(quint32 id);
+
+signals:
+    void textReceived(QString ip, QString text);
+    void fileReceived(QString ip, QString name, QByteArray data);
+    void messageProgress(quint32 id, qint64 total, qint64 delivered);
+    void messageDelivered(quint32 id);
+    void messageFailed(quint32 id);
+    void pingReply(quint32 id, qint64 usecs);
+
+private:
+    enum FrameType {
+        FrameText = 1,      // Start of a text message: total size (quint64 LE)
+        FrameFile,          // Start of a file: total size (quint64 LE), name (UTF-8)
+        FrameData,          // Part of the message
+        FrameEnd,           // Message complete
+        FrameCancel,        // Message dropped (either side)
+        FrameProgress,      // Received bytes (quint64 LE), all of them for a delivered message
+        FramePing,          // Echoed back as a pong
+        FramePong
+    };
+
+    struct Message {
+        quint32 id;
+        quint8 type;
+        QByteArray head;        // Payload of the first frame
+        QByteArray data;
+        qint64 offset;          // Data already framed
+        bool started;
+    };
+
+    struct Incoming {
+        quint8 type;
+        qint64 size;
+        QString name;
+        QByteArray data;
+        qint64 acked;
+    };
+
+    struct Connection {
+        QString key;            // "ip:port" for the connections we open, empty for the others
+        QString ip;
+        qint16 port;
+        QTcpSocket *socket;
+        QByteArray input;
+        QList<Message> queue;               // To send, served round-robin
+        QHash<quint32, Message> sent;       // Waiting for the delivery ack
+        QHash<quint32, Incoming> incoming;  // Being received
+        int retries;
+        QElapsedTimer idle;
+    };
+
+    Connection* outgoing(const QString &ip, qint16 port);
+    void enqueue(const QString &ip, qint16 port, Message m);
+    void openSocket(Connection *c);
+    void attach(Connection *c);
+    void pump(Connection *c);
+    void readFrames(Connection *c);
+    void handleFrame(Connection *c, quint8 type, quint32 id, const QByteArray &payload);
+    void connectionLost(Connection *c);
+    void closeConnection(Connection *c);
+    void checkIdle();
+    static void writeFrame(QTcpSocket *socket, quint8 type, quint32 id, const QByteArray &payload);
+
+    QHash<QString, Connection*> mOutgoing;
+    QList<Connection*> mIncoming;
+    QStringList mDelivered;         // "ip/id" of the last messages received
+    quint32 mNextId;
+    QElapsedTimer mClock;
+    QTimer mIdleTimer;
+};
+
+#endif // CONTROLCHANNEL_H
@@ -2,24 +2,22 @@
 
 #include "buddylistitemmodel.h"
 
-#include <QStandardItem>
-
 DestinationBuddy::DestinationBuddy(QObject *parent) :
     QObject(parent)
 {
 }
 
-void DestinationBuddy::fillFromItem(QStandardItem *item)
+void DestinationBuddy::fillFromItem(const BuddyListItemModel::Buddy *item)
 {
-    mIp = item->data(BuddyListItemModel::Ip).toString();
-    mPort = item->data(BuddyListItemModel::Port).toInt();
-    mUsername = item->data(BuddyListItemModel::Username).toString();
-    mSystem = item->data(BuddyListItemModel::System).toString();
-    mPlatform = item->data(BuddyListItemModel::Platform).toString();
-    mGenericAvatar = item->data(BuddyListItemModel::GenericAvatar).toString();
-    mAvatar = item->data(BuddyListItemModel::Avatar).toString();
-    mOsLogo = item->data(BuddyListItemModel::OsLogo).toString();
-    mShowBack = item->data(BuddyListItemModel::ShowBack).toString();
+    mIp = item->ip;
+    mPort = item->port;
+    mUsername = item->username;
+    mSystem = item->system;
+    mPlatform = item->platform;
+    mGenericAvatar = BuddyListItemModel::genericAvatar(item->os);
+    mAvatar = item->avatar.toString();
+    mOsLogo = BuddyListItemModel::osLogo(item->os);
+    mShowBack = item->showBack ? "true" : "false";
     emit ipChanged();
     emit portChanged();
     emit usernameChanged();
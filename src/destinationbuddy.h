@@ -3,7 +3,7 @@
 
 #include <QObject>
 
-class QStandardItem;
+#include "buddylistitemmodel.h"
 
 class DestinationBuddy : public QObject
 {
@@ -29,7 +29,7 @@ public:
     inline QString avatar() { return mAvatar; }
     inline QString osLogo() { return mOsLogo; }
     inline QString showBack() { return mShowBack; }
-    void fillFromItem(QStandardItem *item);
+    void fillFromItem(const BuddyListItemModel::Buddy *item);
     // void setAsRemoteBuddy(QString ip);
 
 signals:
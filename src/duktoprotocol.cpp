@@ -4,52 +4,264 @@
 #include <windows.h>
 #endif
 
+#if defined(Q_OS_UNIX)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(Q_OS_LINUX)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <string.h>
+
 #include <QStringList>
+#include <QStringEncoder>
 #include <QFileInfo>
 #include <QDir>
-#include <QNetworkInterface>
 #include <QTimer>
+#include <QtEndian>
+#include <QDebug>
+#include <QRandomGenerator>
+#include <QNetworkInterface>
 
 #include "platform.h"
+#include "bufferpool.h"
+#include "networkmonitor.h"
+#include "pipesource.h"
 
 #define DEFAULT_UDP_PORT 4644
 #define DEFAULT_TCP_PORT 4644
 
+#define SEND_CHUNK_SIZE 10000       // Data read from a large file for each write
+#define SEND_BATCH_SIZE 57344       // Max size of a write packing several small elements
+                                    // (leaves room in the pool block for one more header)
+#define TEXT_SPILL_SIZE 1048576     // Received text kept in memory, beyond that it goes to a file
+
+#define RECV_BATCH 8                // Datagrams read with a single recvmmsg() (Linux)
+#define RECV_SLOT_SIZE (BufferPool::BLOCK_SIZE / RECV_BATCH)   // 8 KB each, more than any valid discovery message
+
+#define CHUNKED_ELEMENT_SIZE -2     // Element size of a chunked element (FeatureChunkedElements)
+#define CHUNKED_GROWTH_WAIT 500     // ms a chunked regular file must stay the same size to be over
+#define SYMLINK_ELEMENT_SIZE -3     // Element size of a symbolic link (FeatureLinkElements)
+#define HARDLINK_ELEMENT_SIZE -4    // Element size of a hard link (FeatureLinkElements)
+#define SPARSE_ELEMENT_SIZE -5      // Element size of a sparse file (FeatureSparseElements)
+
+#define HELLO_EXT_FEATURES 0x01     // HELLO extension field: features bitmap (quint32)
+#define HELLO_EXT_KNOWN_PEERS 0x02  // HELLO extension field: digests of the known peers (quint16 each, no longer sent)
+#define HELLO_EXT_VERSION 0x03      // HELLO v2 fields: version (quint8, 2)
+#define HELLO_EXT_INSTANCE 0x04     //  - instance ID (16 bytes)
+#define HELLO_EXT_USER 0x05         //  - user name (UTF-8)
+#define HELLO_EXT_HOST 0x06         //  - host name (UTF-8)
+#define HELLO_EXT_PLATFORM 0x07     //  - platform (UTF-8)
+#define HELLO_EXT_PORTS 0x08        //  - UDP, TCP and avatar ports (3 x quint16, 0 for no avatar)
+#define HELLO_EXT_AVATAR_HASH 0x09  //  - SHA-1 of the avatar image
+#define HELLO_EXT_KNOWN_IDS 0x0A    // HELLO extension field: digests of the known peers (quint32 each)
+#define HELLO_EXT_PROBE 0x0B        // HELLO extension field: the hello is a probe, to answer at once (empty)
+
+#define KNOWN_PEERS_MAX 256         // Digests sent at most in a broadcast HELLO extension
+#define REPLY_MIN_INTERVAL 5000     // ms between two replies to the same peer
+#define REPLY_JITTER_MAX 3000       // ms, upper bound of the random delay of the replies
+#define MULTICAST_GROUP_IPV4 "239.255.46.44"  // Discovery groups (MulticastDiscovery)
+#define MULTICAST_GROUP_IPV6 "ff02::4644"       // Link-local, used on IPv6-only networks
+
+#define PROBE_ROUNDS 3              // Unicast probes sent to each cached peer
+#define PROBE_INTERVAL 300          // ms between two probe rounds
+#define PROBE_TIMEOUT 4000          // ms, cached peers not answering by then are dropped
+
+#define HEADER_TIMEOUT 30000        // ms an incoming connection may stay idle before its header
+#define PRECONNECT_IDLE 15000       // ms a connection opened in advance is kept, below HEADER_TIMEOUT
+#define PENDING_PER_PEER 3          // Connections waiting for their header from the same address
+#define PENDING_MAX 16              // Connections waiting for their header in all
+
+#define HELLO_INTERVAL 60000        // ms between periodic hellos on small networks
+#define HELLO_INTERVAL_MAX 900000   // ms between periodic hellos on huge networks
+
 DuktoProtocol::DuktoProtocol()
-    : mSocket(NULL), mTcpServer(NULL), mCurrentSocket(NULL),
-    mCurrentFile(NULL), mFilesToSend(NULL)
+    : mSocket(NULL), mSocket6(NULL), mTcpServer(NULL), mCurrentSocket(NULL), mWarmSocket(NULL),
+    mCurrentFile(NULL), mFilesToSend(NULL), mTextFile(NULL)
 {
     mLocalUdpPort = DEFAULT_UDP_PORT;
     mLocalTcpPort = DEFAULT_TCP_PORT;
+    mDiscoveryMode = BroadcastDiscovery;
+    mAvatarPort = 0;
+    mProbeRound = 0;
+    mWarmPort = 0;
+    mWarmConnected = false;
+    mControlMessage = 0;
+    mControlTotal = 0;
+    mControlDelivered = 0;
+    mBroadcastProbe = true;
+    mDatagrams = 0;
+    mSignature = getSystemSignature().toUtf8();
 
     mIsSending = false;
     mIsReceiving = false;
     mSendingScreen = false;
+    mTextSent = 0;
+    mRemoteFeatures = 0;
+    mTotalSizeKnown = true;
+    mFileRemaining = 0;
+    mSendBatching = true;
+    mStreamSource = NULL;
+    mChunkedSource = NULL;
+    mChunkedSourceEnded = false;
+    mChunkedSourceSize = -1;
+    mPipeSource = NULL;
+    mWaitingForSource = false;
+    mElementChunked = false;
+    mLinkPolicy = LinksAsElements;
+    mSendSparse = false;
+    mElementSparse = false;
+
+    // Replies to broadcast hellos are sent together after a random delay
+    mClock.start();
+    mLastBroadcastHello = -1;
+    mReplyTimer.setSingleShot(true);
+    connect(&mReplyTimer, SIGNAL(timeout()), this, SLOT(sendPendingReplies()));
+    mProbeTimer.setSingleShot(true);
+    connect(&mProbeTimer, SIGNAL(timeout()), this, SLOT(probeCachedPeers()));
+    mWarmTimer.setSingleShot(true);
+    mWarmTimer.setInterval(PRECONNECT_IDLE);
+    connect(&mWarmTimer, SIGNAL(timeout()), this, SLOT(dropPreconnection()));
+
+    // Messages on the control channel look like transfers to the GUI
+    connect(&mControl, SIGNAL(textReceived(QString,QString)), this, SLOT(controlTextReceived(QString,QString)));
+    connect(&mControl, SIGNAL(fileReceived(QString,QString,QByteArray)), this, SLOT(controlFileReceived(QString,QString,QByteArray)));
+    connect(&mControl, SIGNAL(messageProgress(quint32,qint64,qint64)), this, SLOT(controlMessageProgress(quint32,qint64,qint64)));
+    connect(&mControl, SIGNAL(messageDelivered(quint32)), this, SLOT(controlMessageDelivered(quint32)));
+    connect(&mControl, SIGNAL(messageFailed(quint32)), this, SLOT(controlMessageFailed(quint32)));
+
+    // Peer list notifications
+    connect(&mPeers, SIGNAL(peerAdded(Peer)), this, SIGNAL(peerListAdded(Peer)));
+    connect(&mPeers, SIGNAL(peerChanged(Peer)), this, SIGNAL(peerListChanged(Peer)));
+    connect(&mPeers, SIGNAL(peerRemoved(Peer)), this, SIGNAL(peerListRemoved(Peer)));
 }
 
 DuktoProtocol::~DuktoProtocol()
 {
     if (mCurrentSocket) delete mCurrentSocket;
     if (mSocket) delete mSocket;
+    if (mSocket6) delete mSocket6;
     if (mTcpServer) delete mTcpServer;
     if (mCurrentFile) delete mCurrentFile;
 }
 
 void DuktoProtocol::initialize()
 {
-    mSocket = new QUdpSocket(this);
-    mSocket->bind(QHostAddress::Any, mLocalUdpPort);
-    connect(mSocket, SIGNAL(readyRead()), this, SLOT(newUdpData()));
+    openUdpSockets();
 
     mTcpServer = new QTcpServer(this);
     mTcpServer->listen(QHostAddress::Any, mLocalTcpPort);
     connect(mTcpServer, SIGNAL(newConnection()), this, SLOT(newIncomingConnection()));
+
+    // Say hello as soon as a new network shows up
+    connect(NetworkMonitor::instance(), SIGNAL(broadcastAddressAdded(QHostAddress)), this, SLOT(newBroadcastAddress(QHostAddress)));
+    connect(NetworkMonitor::instance(), SIGNAL(activeInterfacesChanged()), this, SLOT(joinMulticastGroups()));
+}
+
+// Creates the discovery sockets for the current mode. In multicast mode
+// IPv4 and IPv6 use separate sockets, joined to the discovery groups on
+// every interface; broadcasts from legacy peers are still received.
+void DuktoProtocol::openUdpSockets()
+{
+    delete mSocket;
+    delete mSocket6;
+    mSocket6 = NULL;
+    mMulticastInterfaces.clear();
+    mJoinedIPv4.clear();
+    mBroadcastProbe = true;
+
+    mSocket = new QUdpSocket(this);
+    if (mDiscoveryMode == BroadcastDiscovery)
+    {
+        mSocket->bind(QHostAddress::Any, mLocalUdpPort);
+        connect(mSocket, SIGNAL(readyRead()), this, SLOT(newUdpData()));
+        return;
+    }
+
+    mSocket->bind(QHostAddress::AnyIPv4, mLocalUdpPort, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint);
+    connect(mSocket, SIGNAL(readyRead()), this, SLOT(newUdpData()));
+    mSocket6 = new QUdpSocket(this);
+    mSocket6->bind(QHostAddress::AnyIPv6, mLocalUdpPort, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint);
+    connect(mSocket6, SIGNAL(readyRead()), this, SLOT(newUdpData()));
+    joinMulticastGroups();
+}
+
+void DuktoProtocol::setDiscoveryMode(DiscoveryMode mode)
+{
+    if (mode == mDiscoveryMode) return;
+    mDiscoveryMode = mode;
+
+    // Already running, switch now
+    if (mSocket)
+    {
+        openUdpSockets();
+        sayHello(QHostAddress::Broadcast);
+    }
+}
+
+// Joins the discovery groups on the interfaces that are new (or that
+// got an IPv4 address), and says hello there
+void DuktoProtocol::joinMulticastGroups()
+{
+    if (!mSocket6) return;
+
+    NetworkMonitor *monitor = NetworkMonitor::instance();
+    const QStringList &names = monitor->activeInterfaces();
+    QHash<QString, QNetworkInterface> joined;
+    QList<QNetworkInterface> added;
+
+    for (int i = 0; i < names.size(); i++)
+    {
+        const QString &name = names.at(i);
+        QNetworkInterface iface = mMulticastInterfaces.value(name);
+        bool isNew = !iface.isValid();
+        if (isNew)
+        {
+            iface = QNetworkInterface::interfaceFromName(name);
+            if (!iface.isValid() || !(iface.flags() & QNetworkInterface::CanMulticast)) continue;
+            mSocket6->joinMulticastGroup(QHostAddress(MULTICAST_GROUP_IPV6), iface);
+        }
+        if (monitor->hasIPv4Address(name) && !mJoinedIPv4.contains(name))
+        {
+            mSocket->joinMulticastGroup(QHostAddress(MULTICAST_GROUP_IPV4), iface);
+            mJoinedIPv4.insert(name);
+            isNew = true;
+        }
+        joined.insert(name, iface);
+        if (isNew) added.append(iface);
+    }
+
+    // Memberships go away with their interfaces
+    for (auto it = mJoinedIPv4.begin(); it != mJoinedIPv4.end(); )
+        if (!joined.contains(*it)) it = mJoinedIPv4.erase(it); else ++it;
+    mMulticastInterfaces = joined;
+
+    // Hello on the new networks
+    if (added.isEmpty()) return;
+    QByteArray extension = helloExtension(true);
+    QByteArray packet = helloMessage(true, mLocalUdpPort);
+    for (int i = 0; i < added.size(); i++)
+    {
+        sendToMulticast(&extension, mLocalUdpPort, added.at(i));
+        sendToMulticast(&packet, mLocalUdpPort, added.at(i));
+    }
+}
+
+// Socket to use to reach an address
+QUdpSocket* DuktoProtocol::udpSocketFor(const QHostAddress &dest)
+{
+    if (mSocket6 && (dest.protocol() == QAbstractSocket::IPv6Protocol)) return mSocket6;
+    return mSocket;
 }
 
 void DuktoProtocol::setPorts(qint16 udp, qint16 tcp)
 {
     mLocalUdpPort = udp;
     mLocalTcpPort = tcp;
+    updateHelloIdentity();
 }
 
 QString DuktoProtocol::getSystemSignature()
@@ -70,36 +282,385 @@ void DuktoProtocol::sayHello(QHostAddress dest)
 
 void DuktoProtocol::sayHello(QHostAddress dest, qint16 port)
 {
+    // Extension packet, sent before the hello so that the features
+    // are already known when the peer gets added (only where it's understood)
+    QByteArray extension;
+    if (extensionWanted(dest)) extension = helloExtension(dest == QHostAddress::Broadcast);
+
     // Packet preparation
-    QByteArray *packet = new QByteArray();
+    QByteArray *packet = new QByteArray(helloMessage(dest == QHostAddress::Broadcast, port));
+
+    // Send packet
+    if (dest == QHostAddress::Broadcast) {
+        mLastBroadcastHello = mClock.elapsed();
+        bool broadcast = useBroadcast();
+        if (!extension.isEmpty()) sendToAll(&extension, port, broadcast);
+        sendToAll(packet, port, broadcast);
+        if (port != DEFAULT_UDP_PORT) {
+            if (!extension.isEmpty()) sendToAll(&extension, DEFAULT_UDP_PORT, broadcast);
+            sendToAll(packet, DEFAULT_UDP_PORT, broadcast);
+        }
+    }
+    else {
+        QUdpSocket *socket = udpSocketFor(dest);
+        if (!extension.isEmpty()) socket->writeDatagram(extension.data(), extension.length(), dest, port);
+        socket->writeDatagram(packet->data(), packet->length(), dest, port);
+    }
+
+    delete packet;
+}
+
+// Says hello (broadcast type, asking for replies) on a network which
+// has just become available
+void DuktoProtocol::newBroadcastAddress(QHostAddress broadcast)
+{
+    QByteArray extension;
+    if (extensionWanted(QHostAddress::Broadcast)) extension = helloExtension(true);
+    QList<qint16> ports;
+    ports.append(mLocalUdpPort);
+    if (mLocalUdpPort != DEFAULT_UDP_PORT) ports.append(DEFAULT_UDP_PORT);
+
+    foreach (const qint16 &port, ports)
+    {
+        QByteArray packet = helloMessage(true, port);
+        if (!extension.isEmpty()) mSocket->writeDatagram(extension.data(), extension.length(), broadcast, port);
+        mSocket->writeDatagram(packet.data(), packet.length(), broadcast, port);
+    }
+}
+
+// HELLO message, with the port when not using the default one
+QByteArray DuktoProtocol::helloMessage(bool broadcast, qint16 port)
+{
+    QByteArray packet;
     if ((port == DEFAULT_UDP_PORT) && (mLocalUdpPort == DEFAULT_UDP_PORT))
     {
-        if (dest == QHostAddress::Broadcast)
-            packet->append(0x01);           // 0x01 -> HELLO MESSAGE (broadcast)
+        if (broadcast)
+            packet.append(0x01);            // 0x01 -> HELLO MESSAGE (broadcast)
         else
-            packet->append(0x02);           // 0x02 -> HELLO MESSAGE (unicast)
+            packet.append(0x02);            // 0x02 -> HELLO MESSAGE (unicast)
     }
     else
     {
-        if (dest == QHostAddress::Broadcast)
-            packet->append(0x04);           // 0x04 -> HELLO MESSAGE (broadcast) with PORT
+        if (broadcast)
+            packet.append(0x04);            // 0x04 -> HELLO MESSAGE (broadcast) with PORT
         else
-            packet->append(0x05);           // 0x05 -> HELLO MESSAGE (unicast) with PORT
-        packet->append((char*)&mLocalUdpPort, sizeof(qint16));
+            packet.append(0x05);            // 0x05 -> HELLO MESSAGE (unicast) with PORT
+        packet.append((char*)&mLocalUdpPort, sizeof(qint16));
     }
 
-    // Convert QString to QByteArray before appending
-    packet->append(getSystemSignature().toUtf8());
+    packet.append(mSignature);
+    return packet;
+}
 
-    // Send packet
-    if (dest == QHostAddress::Broadcast) {
-        sendToAllBroadcast(packet, port);
-        if (port != DEFAULT_UDP_PORT) sendToAllBroadcast(packet, DEFAULT_UDP_PORT);
+// HELLO extension message, listing the optional features supported by
+// this client. Legacy clients ignore the unknown message type.
+//  - 0x06
+//  - Sequence of fields: type (quint8), length (quint16 LE), value
+// Broadcast hellos also list the peers already known, which then
+// don't need to reply.
+QByteArray DuktoProtocol::helloExtension(bool broadcast)
+{
+    QByteArray packet;
+    packet.append(0x06);                // 0x06 -> HELLO EXTENSION
+
+    quint32 features = FeatureChunkedElements | FeatureLinkElements | FeatureSparseElements
+                       | FeaturePreconnect | FeatureControlChannel;
+    if (mDiscoveryMode == MulticastDiscovery) features |= FeatureMulticastDiscovery;
+    features = qToLittleEndian<quint32>(features);
+    appendHelloField(packet, HELLO_EXT_FEATURES, QByteArrayView((const char*) &features, sizeof(features)));
+    packet.append(mHelloIdentity);
+
+    if (broadcast && (mPeers.count() > 0))
+    {
+        QByteArray digests;
+        QList<Peer> peers = mPeers.peers();
+        for (int i = 0; (i < peers.size()) && (digests.size() < 4 * KNOWN_PEERS_MAX); i++)
+        {
+            // Cached peers may not know us (yet)
+            const Peer &p = peers.at(i);
+            if (p.provisional) continue;
+            quint32 digest = qToLittleEndian<quint32>(peerDigest(p.instanceId.isEmpty() ? p.name.toUtf8() : p.instanceId));
+            digests.append((const char*) &digest, sizeof(digest));
+        }
+        appendHelloField(packet, HELLO_EXT_KNOWN_IDS, digests);
+    }
+
+    return packet;
+}
+
+// The HELLO extension only goes where it can be understood: to peers
+// advertising features or not known yet, and to everybody until all the
+// peers around are known to be legacy clients
+bool DuktoProtocol::extensionWanted(const QHostAddress &dest)
+{
+    if (dest != QHostAddress::Broadcast)
+        return !mPeers.contains(dest) || (mPeers.features(dest) != 0);
+
+    if (mPeers.count() == 0) return true;
+    foreach (const Peer &p, mPeers.peers())
+        if (p.features != 0) return true;
+    return false;
+}
+
+// Digest of a peer (FNV-1a, 32 bits), stable across clients: of its
+// instance ID, or of its signature for peers without HELLO v2
+quint32 DuktoProtocol::peerDigest(QByteArrayView identity)
+{
+    quint32 hash = 2166136261u;
+    for (qsizetype i = 0; i < identity.size(); i++)
+    {
+        hash ^= (quint8) identity.at(i);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void DuktoProtocol::appendHelloField(QByteArray &packet, quint8 type, QByteArrayView value)
+{
+    quint16 length = qToLittleEndian<quint16>(value.size());
+    packet.append((char) type);
+    packet.append((const char*) &length, sizeof(length));
+    packet.append(value);
+}
+
+// Identity fields of HELLO v2, built once for all the hellos
+void DuktoProtocol::updateHelloIdentity()
+{
+    mSignature = getSystemSignature().toUtf8();
+    mHelloIdentity.clear();
+    if (mInstanceId.isEmpty()) return;
+
+    quint8 version = 2;
+    appendHelloField(mHelloIdentity, HELLO_EXT_VERSION, QByteArrayView((const char*) &version, sizeof(version)));
+    appendHelloField(mHelloIdentity, HELLO_EXT_INSTANCE, mInstanceId);
+    appendHelloField(mHelloIdentity, HELLO_EXT_USER, Platform::getSystemUsername().toUtf8());
+    appendHelloField(mHelloIdentity, HELLO_EXT_HOST, Platform::getHostname().toUtf8());
+    appendHelloField(mHelloIdentity, HELLO_EXT_PLATFORM, Platform::getPlatformName().toUtf8());
+
+    quint16 ports[3];
+    ports[0] = qToLittleEndian<quint16>(mLocalUdpPort);
+    ports[1] = qToLittleEndian<quint16>(mLocalTcpPort);
+    ports[2] = qToLittleEndian<quint16>(mAvatarPort);
+    appendHelloField(mHelloIdentity, HELLO_EXT_PORTS, QByteArrayView((const char*) ports, sizeof(ports)));
+    if (!mAvatarHash.isEmpty())
+        appendHelloField(mHelloIdentity, HELLO_EXT_AVATAR_HASH, mAvatarHash);
+}
+
+void DuktoProtocol::setInstanceId(QByteArray id)
+{
+    mInstanceId = id;
+    updateHelloIdentity();
+}
+
+void DuktoProtocol::setAvatar(qint16 port, QByteArray hash)
+{
+    mAvatarPort = port;
+    mAvatarHash = hash;
+    updateHelloIdentity();
+}
+
+void DuktoProtocol::handleHelloExtension(QByteArrayView data, QHostAddress &sender)
+{
+    quint32 features = 0;
+    bool knowsUs = false;
+    bool probe = false;
+    bool identity = false;
+    Peer info;
+
+    // Walk the fields, skipping the unknown ones
+    while (data.size() >= 3)
+    {
+        quint8 type = data.at(0);
+        quint16 length = qFromLittleEndian<quint16>(data.data() + 1);
+        if (data.size() < 3 + length) break;
+        QByteArrayView value = data.sliced(3, length);
+        data = data.sliced(3 + length);
+
+        if ((type == HELLO_EXT_FEATURES) && (value.size() >= (qsizetype) sizeof(features)))
+            features = qFromLittleEndian<quint32>(value.data());
+        else if ((type == HELLO_EXT_INSTANCE) && !value.isEmpty())
+        {
+            info.instanceId = value.toByteArray();
+            identity = true;
+        }
+        else if (type == HELLO_EXT_USER)
+            info.username = QString::fromUtf8(value);
+        else if (type == HELLO_EXT_HOST)
+            info.system = QString::fromUtf8(value);
+        else if (type == HELLO_EXT_PLATFORM)
+            info.platform = QString::fromUtf8(value);
+        else if ((type == HELLO_EXT_PORTS) && (value.size() >= 6))
+        {
+            info.port = qFromLittleEndian<quint16>(value.data());
+            info.tcpPort = qFromLittleEndian<quint16>(value.data() + 2);
+            info.avatarPort = qFromLittleEndian<quint16>(value.data() + 4);
+        }
+        else if (type == HELLO_EXT_AVATAR_HASH)
+            info.avatarHash = value.toByteArray();
+        else if (type == HELLO_EXT_PROBE)
+            probe = true;
+        else if (type == HELLO_EXT_KNOWN_IDS)
+        {
+            // The 16-bit digests of HELLO_EXT_KNOWN_PEERS collide too often to be trusted
+            quint32 own = peerDigest(mInstanceId.isEmpty() ? mSignature : mInstanceId);
+            for (qsizetype i = 0; i + 3 < value.size(); i += 4)
+                if (qFromLittleEndian<quint32>(value.data() + i) == own) knowsUs = true;
+        }
+    }
+
+    // Our own hello (multicast loopback). Installations cloned with
+    // their settings share the instance ID, but not address and port.
+    if (identity && (info.instanceId == mInstanceId) && isOwnHello(sender, info.port)) return;
+
+    // HELLO v2: the peer is known from the extension alone, the legacy
+    // HELLO that follows only refreshes it
+    if (identity && (info.port != 0))
+    {
+        info.features = features;
+        info.name = info.username + " at " + info.system + " (" + info.platform + ")";
+        mPeers.seen(sender, info);
     }
     else
-        mSocket->writeDatagram(packet->data(), packet->length(), dest, port);
+        mPeers.setFeatures(sender, features);
 
-    delete packet;
+    // Remembered for the HELLO that follows
+    if (knowsUs)
+        mKnownBy.insert(sender);
+    else
+        mKnownBy.remove(sender);
+    if (probe)
+        mProbedBy.insert(sender);
+    else
+        mProbedBy.remove(sender);
+}
+
+// Tells if a hello carrying our identity comes from this very instance:
+// sent from an address of this host, for our port
+bool DuktoProtocol::isOwnHello(const QHostAddress &sender, qint16 port)
+{
+    if (port != mLocalUdpPort) return false;
+    if (sender.isLoopback()) return true;
+    if (sender.protocol() == QAbstractSocket::IPv4Protocol)
+        return NetworkMonitor::instance()->localAddresses().contains(sender);
+    return QNetworkInterface::allAddresses().contains(sender);
+}
+
+// Schedules the reply to a broadcast hello. Replies are delayed by a
+// random time growing with the number of peers, so that a new client
+// doesn't get hundreds of them at once, and skipped for peers which
+// already know us or got a reply just before. Probes get their reply at once.
+void DuktoProtocol::queueReply(QHostAddress &sender, qint16 port)
+{
+    // Probes of a peer which has just started are answered at once: it
+    // shows us from its cache meanwhile, and drops us without an answer
+    if (mProbedBy.remove(sender))
+    {
+        mKnownBy.remove(sender);
+        mLastReply.insert(sender, mClock.elapsed());
+        sayHello(sender, port);
+        return;
+    }
+
+    if (mKnownBy.remove(sender)) return;
+
+    qint64 now = mClock.elapsed();
+    auto last = mLastReply.constFind(sender);
+    if ((last != mLastReply.constEnd()) && (now - *last < REPLY_MIN_INTERVAL)) return;
+    mLastReply.insert(sender, now);
+    mPendingReplies.insert(sender, port);
+
+    if (!mReplyTimer.isActive())
+    {
+        int window = qBound(50, 5 * mPeers.count(), REPLY_JITTER_MAX);
+        mReplyTimer.start(QRandomGenerator::global()->bounded(window));
+    }
+}
+
+// Loads the peers seen in the previous sessions, they're shown at once
+// and then probed: the ones not answering are dropped after a while
+void DuktoProtocol::restorePeers(const QByteArray &cache)
+{
+    mProbedPeers = mPeers.restore(cache);
+    if (mProbedPeers.isEmpty()) return;
+    mProbeRound = 0;
+    probeCachedPeers();
+}
+
+// Unicast hellos asking for a reply, so that they also work where
+// broadcast is filtered. All the peers are probed in the same round.
+void DuktoProtocol::probeCachedPeers()
+{
+    if (mProbeRound == PROBE_ROUNDS)
+    {
+        mPeers.dropProvisional();
+        mProbedPeers.clear();
+        return;
+    }
+
+    foreach (const Peer &p, mProbedPeers)
+        if (mPeers.peer(p.address).provisional)
+            sendProbe(p.address, p.port);
+
+    // Rounds at 0, 300 and 900 ms, then the timeout
+    mProbeRound++;
+    if (mProbeRound < PROBE_ROUNDS)
+        mProbeTimer.start(PROBE_INTERVAL * mProbeRound);
+    else
+        mProbeTimer.start(PROBE_TIMEOUT - PROBE_INTERVAL * (PROBE_ROUNDS - 1) * PROBE_ROUNDS / 2);
+}
+
+void DuktoProtocol::sendProbe(const QHostAddress &dest, qint16 port)
+{
+    QByteArray packet = helloMessage(true, port);
+    QUdpSocket *socket = udpSocketFor(dest);
+    if (extensionWanted(dest))
+    {
+        QByteArray extension = helloExtension(false);
+        appendHelloField(extension, HELLO_EXT_PROBE, QByteArrayView());
+        socket->writeDatagram(extension.data(), extension.length(), dest, port);
+    }
+    socket->writeDatagram(packet.data(), packet.length(), dest, port);
+}
+
+void DuktoProtocol::sendPendingReplies()
+{
+    for (auto it = mPendingReplies.constBegin(); it != mPendingReplies.constEnd(); ++it)
+        sayHello(it.key(), it.value());
+    mPendingReplies.clear();
+
+    // Forget the old replies
+    if (mLastReply.size() > 2 * mPeers.count() + 64)
+    {
+        qint64 now = mClock.elapsed();
+        for (auto it = mLastReply.begin(); it != mLastReply.end(); )
+            if (now - it.value() >= REPLY_MIN_INTERVAL)
+                it = mLastReply.erase(it);
+            else
+                ++it;
+    }
+}
+
+// Interval until the next periodic hello: on large networks it grows
+// with the number of peers (about one periodic hello per second on the
+// whole network), with some jitter so that clients don't synchronize.
+// Peers are expired after three intervals.
+int DuktoProtocol::nextHelloInterval()
+{
+    int interval = qBound(HELLO_INTERVAL, mPeers.count() * 1000, HELLO_INTERVAL_MAX);
+    mPeers.setTimeToLive(qMax<int>((int) PeerRegistry::DEFAULT_TTL, 3 * interval));
+    return interval - QRandomGenerator::global()->bounded(interval / 10);
+}
+
+// ms since everybody was last told about us, -1 if never
+qint64 DuktoProtocol::sinceBroadcastHello()
+{
+    return (mLastBroadcastHello < 0) ? -1 : mClock.elapsed() - mLastBroadcastHello;
+}
+
+// Features advertised by a peer (0 for legacy or unknown peers)
+quint32 DuktoProtocol::peerFeatures(const QString &ip)
+{
+    return mPeers.features(QHostAddress(ip));
 }
 
 void DuktoProtocol::sayGoodbye()
@@ -113,13 +674,14 @@ void DuktoProtocol::sayGoodbye()
     QList<qint16> ports;
     ports.append(mLocalUdpPort);
     if (mLocalUdpPort != DEFAULT_UDP_PORT) ports.append(DEFAULT_UDP_PORT);
-    foreach (const Peer &p, mPeers.values())
+    foreach (const Peer &p, mPeers.peers())
         if (!ports.contains(p.port))
             ports.append(p.port);
 
     // Send broadcast message to all discovered ports
+    // (also in multicast mode, for the legacy peers)
     foreach (const qint16 &port, ports)
-        sendToAllBroadcast(packet, port);
+        sendToAll(packet, port, true);
 
     // Free memory
     delete packet;
@@ -127,69 +689,177 @@ void DuktoProtocol::sayGoodbye()
 
 void DuktoProtocol::newUdpData()
 {
-    while (mSocket->hasPendingDatagrams()) {
-        QByteArray datagram;
-        const int maxLength = 65536;  // Theoretical max length in IPv4
-        datagram.resize(maxLength);
-        // datagram.resize(mSocket->pendingDatagramSize());
+    // A pool block holds the largest possible datagram
+    PooledBuffer buffer;
+    QUdpSocket *socket = qobject_cast<QUdpSocket*>(QObject::sender());
+    if (socket == NULL) socket = mSocket;
+
+    // The first datagram is read through Qt, which enables its read
+    // notifications again; the rest of the queue is emptied in batches
+    while (socket->hasPendingDatagrams()) {
         QHostAddress sender;
         quint16 senderPort;
-        int size = mSocket->readDatagram(datagram.data(), datagram.size(), &sender, &senderPort);
-        datagram.resize(size);
-        handleMessage(datagram, sender);
+        int size = socket->readDatagram(buffer.data(), buffer.size(), &sender, &senderPort);
+        if (size > 0) handleMessage(QByteArrayView(buffer.data(), size), sender);
+#if defined(Q_OS_LINUX)
+        drainDatagrams(socket, buffer.data());
+#endif
+    }
+}
+
+#if defined(Q_OS_LINUX)
+// Reads the pending datagrams with one recvmmsg() call for each batch,
+// into slots of a pool block, and handles them in place. The slots are
+// larger than any valid discovery message (at most 256 digests and the
+// identity in an extension), so the truncated datagrams are dropped.
+void DuktoProtocol::drainDatagrams(QUdpSocket *socket, char *block)
+{
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    struct sockaddr_storage addrs[RECV_BATCH];
+    int fd = socket->socketDescriptor();
+    if (fd < 0) return;
+
+    while (true)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < RECV_BATCH; i++)
+        {
+            iovs[i].iov_base = block + i * RECV_SLOT_SIZE;
+            iovs[i].iov_len = RECV_SLOT_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        int n = ::recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) return;
+
+        for (int i = 0; i < n; i++)
+        {
+            if ((msgs[i].msg_len < 1) || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) continue;
+            QHostAddress sender((const struct sockaddr*) &addrs[i]);
+
+            // Same form readDatagram() gives: plain IPv4, interface name as scope
+            bool ok;
+            quint32 ipv4 = sender.toIPv4Address(&ok);
+            if (ok)
+                sender.setAddress(ipv4);
+            else if (addrs[i].ss_family == AF_INET6)
+            {
+                quint32 scope = ((const struct sockaddr_in6*) &addrs[i])->sin6_scope_id;
+                if (scope != 0) sender.setScopeId(QNetworkInterface::interfaceNameFromIndex(scope));
+            }
+
+            handleMessage(QByteArrayView(block + i * RECV_SLOT_SIZE, msgs[i].msg_len), sender);
+        }
+
+        // Queue emptied
+        if (n < RECV_BATCH) return;
     }
 }
+#endif
 
-void DuktoProtocol::handleMessage(QByteArray &data, QHostAddress &sender)
+void DuktoProtocol::handleMessage(QByteArrayView data, QHostAddress &sender)
 {
     char msgtype = data.at(0);
+    mDatagrams++;
 
     switch(msgtype)
     {
     case 0x01:  // HELLO (broadcast)
     case 0x02:  // HELLO (unicast)
-        data.remove(0, 1);
-        if (data != getSystemSignature()) {
-            mPeers[sender.toString()] = Peer(sender, QString::fromUtf8(data), DEFAULT_UDP_PORT);
-            if (msgtype == 0x01) sayHello(sender, DEFAULT_UDP_PORT);
-            emit peerListAdded(mPeers[sender.toString()]);
+        data = data.sliced(1);
+        if ((data != mSignature) || !isOwnHello(sender, DEFAULT_UDP_PORT)) {
+            mPeers.seen(sender, QString::fromUtf8(data), DEFAULT_UDP_PORT);
+            if (msgtype == 0x01) queueReply(sender, DEFAULT_UDP_PORT);
         }
         break;
 
     case 0x03:  // GOODBYE
-        emit peerListRemoved(mPeers[sender.toString()]);
-        mPeers.remove(sender.toString());
+        mPeers.remove(sender);
         break;
 
     case 0x04:  // HELLO (broadcast) with PORT
     case 0x05:  // HELLO (unicast) with PORT
-        data.remove(0, 1);
-        qint16 port = *((qint16*) data.constData());
-        data.remove(0, 2);
-        if (data != getSystemSignature()) {
-            mPeers[sender.toString()] = Peer(sender, QString::fromUtf8(data), port);
-            if (msgtype == 0x04) sayHello(sender, port);
-            emit peerListAdded(mPeers[sender.toString()]);
+    {
+        if (data.size() < 3) break;
+        qint16 port;
+        memcpy(&port, data.data() + 1, sizeof(port));
+        data = data.sliced(3);
+        if ((data != mSignature) || !isOwnHello(sender, port)) {
+            mPeers.seen(sender, QString::fromUtf8(data), port);
+            if (msgtype == 0x04) queueReply(sender, port);
         }
         break;
     }
 
+    case 0x06:  // HELLO EXTENSION
+        handleHelloExtension(data.sliced(1), sender);
+        break;
+    }
+
 }
 
 // Incoming TCP connection request
 void DuktoProtocol::newIncomingConnection()
 {
 
-    // Check for pending connection
-    if (!mTcpServer->hasPendingConnections()) return;
+    while (mTcpServer->hasPendingConnections())
+    {
+        // Retrieve connection
+        QTcpSocket *s = mTcpServer->nextPendingConnection();
+
+        // Idle connections are limited, per address (one opened in advance,
+        // the control channel, and one spare) and in all
+        QHostAddress address = s->peerAddress();
+        int fromPeer = 0;
+        foreach (QTcpSocket *p, mPendingSockets)
+            if (p->peerAddress() == address) fromPeer++;
+        if ((fromPeer >= PENDING_PER_PEER) || (mPendingSockets.size() >= PENDING_MAX))
+        {
+            s->abort();
+            s->deleteLater();
+            continue;
+        }
+
+        // Wait for the connection header without blocking: connections
+        // opened in advance stay idle until the user picks what to send,
+        // and control sessions are accepted during a transfer too (plain
+        // transfer sessions are refused once their header tells them apart)
+        mPendingSockets.insert(s);
+        connect(s, &QTcpSocket::readyRead, this, &DuktoProtocol::pendingHeaderReady);
+        connect(s, &QTcpSocket::disconnected, this, &DuktoProtocol::pendingDisconnected);
+        QTimer::singleShot(HEADER_TIMEOUT, s, [this, s]() {
+            if (!mPendingSockets.remove(s)) return;
+            s->close();
+            s->deleteLater();
+        });
+    }
+}
 
-    // Retrieve connection
-    QTcpSocket *s = mTcpServer->nextPendingConnection();
+// The header of a pending connection has arrived: the transfer starts
+void DuktoProtocol::pendingHeaderReady()
+{
+    QTcpSocket *s = qobject_cast<QTcpSocket*>(sender());
+    if (!s || !mPendingSockets.contains(s)) return;
+    if (s->bytesAvailable() < (qint64) (2 * sizeof(qint64))) return;
+    mPendingSockets.remove(s);
+    disconnect(s, nullptr, this, nullptr);
+
+    // Control channel, independent of the transfers
+    if (ControlChannel::isSessionHeader(s->peek(16)))
+    {
+        mControl.accept(s);
+        return;
+    }
 
-    // If already receiving or sending, refuse the connection
+    // Busy with another transfer
     if (mIsReceiving || mIsSending)
     {
         s->close();
+        s->deleteLater();
         return;
     }
 
@@ -199,16 +869,6 @@ void DuktoProtocol::newIncomingConnection()
     // Set current TCP socket
     mCurrentSocket = s;
 
-    // Wait for connection header (timeout 10 sec)
-    if (!s->waitForReadyRead(10000))
-    {
-        // Did not receive the connection header, close
-        mCurrentSocket->close();
-        delete mCurrentSocket;
-        mCurrentSocket = NULL;
-        return;
-    }
-
     // Register socket event handlers
     connect(mCurrentSocket, SIGNAL(readyRead()), this, SLOT(readNewData()), Qt::DirectConnection);
     connect(mCurrentSocket, SIGNAL(disconnected()), this, SLOT(closedConnectionTmp()), Qt::QueuedConnection);
@@ -221,6 +881,9 @@ void DuktoProtocol::newIncomingConnection()
     mRootFolderName = "";
     mRootFolderRenamed = "";
     mReceivingText = false;
+    mElementChunked = false;
+    mElementSparse = false;
+    mReceivedNames.clear();
     mRecvStatus = FILENAME;
 
     // -- Read general header --
@@ -234,9 +897,17 @@ void DuktoProtocol::newIncomingConnection()
 
 }
 
+void DuktoProtocol::pendingDisconnected()
+{
+    QTcpSocket *s = qobject_cast<QTcpSocket*>(sender());
+    if (!s || !mPendingSockets.remove(s)) return;
+    s->deleteLater();
+}
+
 // Main reading process
 void DuktoProtocol::readNewData()
 {
+    PooledBuffer buffer;
 
     // While there is data to read
     while (mCurrentSocket->bytesAvailable() > 0)
@@ -266,11 +937,51 @@ void DuktoProtocol::readNewData()
         {
             // Cast sizeof(qint64) to qint64 to match the type of mCurrentSocket->bytesAvailable()
             if (!(mCurrentSocket->bytesAvailable() >= static_cast<qint64>(sizeof(qint64)))) return;
+
+            // Sparse elements are followed by their logical size
+            mCurrentSocket->peek((char*)&mElementSize, sizeof(qint64));
+            if ((mElementSize == SPARSE_ELEMENT_SIZE) && (mCurrentSocket->bytesAvailable() < static_cast<qint64>(2 * sizeof(qint64)))) return;
             mCurrentSocket->read((char*)&mElementSize, sizeof(qint64));
             mElementReceivedData = 0;
+
+            // The data of a sparse element follows as a sequence of extents
+            mElementSparse = (mElementSize == SPARSE_ELEMENT_SIZE);
+            if (mElementSparse)
+            {
+                mCurrentSocket->read((char*)&mSparseSize, sizeof(qint64));
+                mSparseEnd = 0;
+                mElementSize = 0;
+                if (mSparseSize < 0)
+                {
+                    qWarning() << "Invalid sparse element size:" << mSparseSize;
+                    abortReceive();
+                    return;
+                }
+            }
+
+            // The data of a chunked element follows as a sequence of chunks
+            mElementChunked = (mElementSize == CHUNKED_ELEMENT_SIZE);
+            if (mElementChunked) mElementSize = 0;
             QString name = QString::fromUtf8(mPartialName);
             mPartialName.clear();
 
+            // Texts are plain or chunked, never sparse nor links
+            if ((name == "___DUKTO___TEXT___")
+                && (mElementSparse || (mElementSize == SYMLINK_ELEMENT_SIZE) || (mElementSize == HARDLINK_ELEMENT_SIZE)))
+            {
+                qWarning() << "Invalid text element size:" << mElementSize;
+                abortReceive();
+                return;
+            }
+
+            // Links are followed by their target
+            if ((mElementSize == SYMLINK_ELEMENT_SIZE) || (mElementSize == HARDLINK_ELEMENT_SIZE))
+            {
+                mLinkName = name;
+                mRecvStatus = LINKTARGET;
+                break;
+            }
+
             // If the current element is a folder, create it and move to the next element
             if (mElementSize == -1)
             {
@@ -298,7 +1009,7 @@ void DuktoProtocol::readNewData()
 
                 // Create the folder
                 QDir dir(".");
-                bool ret = dir.mkpath(name);
+                bool ret = isInsideDestination(name) && dir.mkpath(name);
                 if (!ret)
                 {
                     emit receiveFileCancelled();
@@ -336,21 +1047,18 @@ void DuktoProtocol::readNewData()
             // Otherwise create the new file
             else
             {
+                QString senderName = name;
+
                 // If the file is in a renamed folder, handle accordingly
                 if ((name.indexOf('/') != -1) && (name.section("/", 0, 0) == mRootFolderName))
                     name = name.replace(0, name.indexOf('/'), mRootFolderRenamed);
 
                 // If the file already exists, change the name of the new one
-                int i = 2;
-                QString originalName = name;
-                while (QFile::exists(name)) {
-                    QFileInfo fi(originalName);
-                    name = fi.baseName() + " (" + QString::number(i) + ")." + fi.completeSuffix();
-                    i++;
-                }
+                name = availableName(name);
                 mReceivedFiles->append(name);
+                mReceivedNames.insert(senderName, name);
                 mCurrentFile = new QFile(name);
-                bool ret = mCurrentFile->open(QIODevice::WriteOnly);
+                bool ret = isInsideDestination(name) && mCurrentFile->open(QIODevice::WriteOnly);
                 if (!ret)
                 {
                     emit receiveFileCancelled();
@@ -373,59 +1081,307 @@ void DuktoProtocol::readNewData()
                     return;
                 }
                 mReceivingText = false;
+
+                // Holes are left unwritten, so that the file stays sparse
+                if (mElementSparse) mCurrentFile->resize(mSparseSize);
             }
-            mRecvStatus = DATA;
+            if (mElementChunked) mRecvStatus = CHUNKSIZE;
+            else if (mElementSparse) mRecvStatus = EXTENT;
+            else mRecvStatus = DATA;
         }
         break;
 
-        case DATA:
+        case LINKTARGET:
         {
-            // Try to read as much as needed to finish the current file
-            // (or to empty the received data buffer)
-            qint64 s = (mCurrentSocket->bytesAvailable() > (mElementSize - mElementReceivedData))
-                           ? (mElementSize - mElementReceivedData)
-                           : mCurrentSocket->bytesAvailable();
-            QByteArray d = mCurrentSocket->read(s);
-            mElementReceivedData += d.size();
-            mTotalReceivedData += d.size();
-            updateStatus();
-
-            // Save the read data
-            if (!mReceivingText)
-                mCurrentFile->write(d);
-            else
-                mTextToReceive.append(d);
-
-            // Check if the current element is complete
-            if (mElementReceivedData == mElementSize)
-            {
-                // Completed, close the file and prepare for the next element
-                mElementSize = -1;
-                if (!mReceivingText)
-                {
-                    mCurrentFile->deleteLater();
-                    mCurrentFile = NULL;
-                }
-                mRecvStatus = FILENAME;
+            char c;
+            while (1) {
+                int ret = mCurrentSocket->read(&c, sizeof(c));
+                if (ret < 1) return;
+                if (c == '\0') break;
+                mPartialName.append(c);
             }
+            createLink(mLinkName, QString::fromUtf8(mPartialName), mElementSize == HARDLINK_ELEMENT_SIZE);
+            mPartialName.clear();
+            mElementSize = -1;
+            mRecvStatus = FILENAME;
         }
         break;
 
-        }
-    }
-}
-
+        case CHUNKSIZE:
+        {
+            // Length of the next chunk, zero at the end of the element
+            qint32 length;
+            if (mCurrentSocket->bytesAvailable() < static_cast<qint64>(sizeof(length))) return;
+            mCurrentSocket->read((char*)&length, sizeof(length));
+            if (length > 0)
+            {
+                mElementSize = length;
+                mElementReceivedData = 0;
+                mRecvStatus = DATA;
+                break;
+            }
+
+            // Completed, close the file and prepare for the next element
+            mElementSize = -1;
+            mElementChunked = false;
+            if (!mReceivingText)
+            {
+                mCurrentFile->deleteLater();
+                mCurrentFile = NULL;
+            }
+            mRecvStatus = FILENAME;
+        }
+        break;
+
+        case EXTENT:
+        {
+            // Offset and length of the next extent, zero length at the end of the element
+            qint64 extent[2];
+            if (mCurrentSocket->bytesAvailable() < static_cast<qint64>(sizeof(extent))) return;
+            mCurrentSocket->read((char*)extent, sizeof(extent));
+
+            // Extents must lie within the logical size of the element
+            if ((extent[0] < 0) || (extent[1] < 0) || (extent[0] > mSparseSize - extent[1]))
+            {
+                qWarning() << "Invalid extent:" << extent[0] << extent[1] << "of" << mSparseSize;
+                abortReceive();
+                return;
+            }
+
+            // Holes count as received data
+            if (extent[0] > mSparseEnd)
+            {
+                mTotalReceivedData += qMin(extent[0], mSparseSize) - mSparseEnd;
+            }
+
+            if (extent[1] > 0)
+            {
+                if (!mReceivingText) mCurrentFile->seek(extent[0]);
+                mSparseEnd = qMax(mSparseEnd, extent[0] + extent[1]);
+                mElementSize = extent[1];
+                mElementReceivedData = 0;
+                mRecvStatus = DATA;
+                break;
+            }
+
+            // Completed, close the file and prepare for the next element
+            mElementSize = -1;
+            mElementSparse = false;
+            if (!mReceivingText)
+            {
+                mCurrentFile->deleteLater();
+                mCurrentFile = NULL;
+            }
+            mRecvStatus = FILENAME;
+        }
+        break;
+
+        case DATA:
+        {
+            // Try to read as much as needed to finish the current file
+            // (or to empty the received data buffer)
+            qint64 s = (mCurrentSocket->bytesAvailable() > (mElementSize - mElementReceivedData))
+                           ? (mElementSize - mElementReceivedData)
+                           : mCurrentSocket->bytesAvailable();
+            if (s > buffer.size()) s = buffer.size();
+            qint64 r = mCurrentSocket->read(buffer.data(), s);
+            if (r < 0) return;
+            mElementReceivedData += r;
+            mTotalReceivedData += r;
+
+            // Save the read data
+            if (!mReceivingText)
+                mCurrentFile->write(buffer.data(), r);
+            else if (!mTextFile && (mTextToReceive.size() + r <= TEXT_SPILL_SIZE))
+                mTextToReceive.append(buffer.data(), r);
+            else
+                spillText(buffer.data(), r);
+
+            // Check if the current element is complete
+            if ((mElementReceivedData == mElementSize) && mElementChunked)
+            {
+                // Only the current chunk is
+                mRecvStatus = CHUNKSIZE;
+            }
+            else if ((mElementReceivedData == mElementSize) && mElementSparse)
+            {
+                // Only the current extent is
+                mRecvStatus = EXTENT;
+            }
+            else if (mElementReceivedData == mElementSize)
+            {
+                // Completed, close the file and prepare for the next element
+                mElementSize = -1;
+                if (!mReceivingText)
+                {
+                    mCurrentFile->deleteLater();
+                    mCurrentFile = NULL;
+                }
+                mRecvStatus = FILENAME;
+            }
+        }
+        break;
+
+        }
+    }
+}
+
+// Recreates a link received from the peer. Hard links can only point to
+// files received in the same transfer; where they are not supported, the
+// file is copied.
+void DuktoProtocol::createLink(QString name, QString target, bool hard)
+{
+    QString senderName = name;
+
+    // If the link is in a renamed folder, handle accordingly
+    if ((name.indexOf('/') != -1) && (name.section("/", 0, 0) == mRootFolderName))
+        name = name.replace(0, name.indexOf('/'), mRootFolderRenamed);
+
+    // Never replace existing files
+    QFileInfo fi(name);
+    if (fi.exists() || fi.isSymLink() || !isInsideDestination(name))
+    {
+        qWarning() << "Link not created:" << name;
+        return;
+    }
+
+    bool ret;
+    if (hard)
+    {
+        if (!mReceivedNames.contains(target))
+        {
+            qWarning() << "Hard link to a file not received:" << name;
+            return;
+        }
+#if defined(Q_OS_UNIX)
+        ret = (::link(QFile::encodeName(mReceivedNames.value(target)).constData(),
+                      QFile::encodeName(name).constData()) == 0);
+#else
+        ret = QFile::copy(mReceivedNames.value(target), name);
+#endif
+        if (ret) mReceivedNames.insert(senderName, name);
+    }
+    else
+    {
+        // Targets leading out of the destination folder are refused
+        QString path = linkTargetPath(name, target);
+        if (path.isEmpty())
+        {
+            qWarning() << "Link out of the destination folder:" << name << "->" << target;
+            return;
+        }
+#if defined(Q_OS_UNIX)
+        ret = (::symlink(QFile::encodeName(target).constData(), QFile::encodeName(name).constData()) == 0);
+#else
+        // No symbolic links without privileges (and shortcuts aren't links):
+        // a copy of the target, if it has been received already
+        ret = QFileInfo(path).isFile() && QFile::copy(path, name);
+#endif
+    }
+    if (!ret)
+    {
+        qWarning() << "Unable to create link:" << name;
+        return;
+    }
+
+    // Links at the top level are listed among the received elements
+    if (name.indexOf('/') == -1) mReceivedFiles->append(name);
+}
+
+// Target of a symbolic link received from the peer, as a path from the
+// destination folder; empty if it's absolute or leads out of the folder
+QString DuktoProtocol::linkTargetPath(const QString &name, const QString &target)
+{
+    if (target.isEmpty() || QDir::isAbsolutePath(target)) return QString();
+    QString path = QDir::cleanPath(QFileInfo(name).path() + "/" + target);
+    if ((path == "..") || path.startsWith("../") || !isInsideDestination(path)) return QString();
+    return path;
+}
+
+// Tells if a path received from the peer stays inside the destination
+// folder, also when some of its parent folders are symbolic links
+bool DuktoProtocol::isInsideDestination(const QString &name)
+{
+    QString base = QDir::current().canonicalPath();
+    QString dir = QFileInfo(QDir::cleanPath(QDir::current().absoluteFilePath(name))).absolutePath();
+
+    // Look for the nearest existing parent
+    while (!QFileInfo::exists(dir) && (dir != QFileInfo(dir).absolutePath()))
+        dir = QFileInfo(dir).absolutePath();
+    QString canonical = QFileInfo(dir).canonicalFilePath();
+
+    return (canonical == base) || canonical.startsWith(base + "/");
+}
+
+// Received text beyond TEXT_SPILL_SIZE goes to a file of the destination
+// folder, starting with what was kept in memory so far
+void DuktoProtocol::spillText(const char *data, qint64 size)
+{
+    if (!mTextFile)
+    {
+        mTextFile = new QFile(availableName("Text snippet.txt"));
+        if (!mTextFile->open(QIODevice::WriteOnly))
+        {
+            // Kept in memory then
+            delete mTextFile;
+            mTextFile = NULL;
+            mTextToReceive.append(data, size);
+            return;
+        }
+        mTextFile->write(mTextToReceive);
+        mTextToReceive = QByteArray();
+    }
+    mTextFile->write(data, size);
+}
+
 void DuktoProtocol::closedConnectionTmp()
 {
     QTimer::singleShot(500, this, SLOT(closedConnection()));
 }
 
+// Drops the transfer being received because of invalid data from the
+// peer, removing the file being written
+void DuktoProtocol::abortReceive()
+{
+    if (mCurrentFile)
+    {
+        QString name = mCurrentFile->fileName();
+        mCurrentFile->close();
+        delete mCurrentFile;
+        mCurrentFile = NULL;
+        QFile::remove(name);
+    }
+    emit receiveFileCancelled();
+
+    // Close socket
+    if (mCurrentSocket)
+    {
+        mCurrentSocket->disconnect();
+        mCurrentSocket->disconnectFromHost();
+        mCurrentSocket->close();
+        mCurrentSocket->deleteLater();
+        mCurrentSocket = NULL;
+    }
+
+    // Free memory
+    delete mReceivedFiles;
+    mReceivedFiles = NULL;
+    mElementSparse = false;
+    mReceivingText = false;
+
+    // Set state
+    mIsReceiving = false;
+}
+
 // Closing the TCP connection in reception
 void DuktoProtocol::closedConnection()
 {
     // Empty the receive buffer
     readNewData();
 
+    // Dropped while reading what was left
+    if (!mIsReceiving) return;
+
     // Close any current file
     if (mCurrentFile)
     {
@@ -440,13 +1396,24 @@ void DuktoProtocol::closedConnection()
 
     // File reception completed
     else if (!mReceivingText)
-        emit receiveFileComplete(mReceivedFiles, mTotalSize);
+        emit receiveFileComplete(mReceivedFiles, (mTotalSize >= 0) ? mTotalSize : mTotalReceivedData);
+
+    // Large text reception completed, it's in a file
+    else if (mTextFile)
+    {
+        QString name = mTextFile->fileName();
+        mTextFile->close();
+        delete mTextFile;
+        mTextFile = NULL;
+        emit receiveTextFileComplete(name, (mTotalSize >= 0) ? mTotalSize : mTotalReceivedData);
+    }
 
     // Text reception completed
     else
     {
         QString rec = QString::fromUtf8(mTextToReceive);
-        emit receiveTextComplete(&rec, mTotalSize);
+        mTextToReceive = QByteArray();
+        emit receiveTextComplete(&rec, (mTotalSize >= 0) ? mTotalSize : mTotalReceivedData);
     }
 
     // Close socket
@@ -476,21 +1443,17 @@ void DuktoProtocol::sendFile(QString ipDest, qint16 port, QStringList files)
     // Check if other activities are in progress
     if (mIsReceiving || mIsSending) return;
     mIsSending = true;
+    mRemoteFeatures = peerFeatures(ipDest);
+
+    // A small file goes on the control channel when possible
+    if (sendOnControlChannel(ipDest, port, files, QString())) return;
 
     // Files to send
     mFilesToSend = expandTree(files);
     mFileCounter = 0;
 
     // Connect to the recipient
-    mCurrentSocket = new QTcpSocket(this);
-
-    // Handle signals
-    connect(mCurrentSocket, &QTcpSocket::connected, this, &DuktoProtocol::sendMetaData, Qt::DirectConnection);
-    connect(mCurrentSocket, &QTcpSocket::errorOccurred, this, &DuktoProtocol::sendConnectError, Qt::DirectConnection);
-    connect(mCurrentSocket, &QTcpSocket::bytesWritten, this, &DuktoProtocol::sendData, Qt::DirectConnection);
-
-    // Connect to host
-    mCurrentSocket->connectToHost(ipDest, port);
+    connectForTransfer(ipDest, port);
 }
 
 void DuktoProtocol::sendText(QString ipDest, qint16 port, QString text)
@@ -501,19 +1464,20 @@ void DuktoProtocol::sendText(QString ipDest, qint16 port, QString text)
     // Check for other ongoing activities
     if (mIsReceiving || mIsSending) return;
     mIsSending = true;
+    mRemoteFeatures = peerFeatures(ipDest);
+
+    // Without a new connection when possible
+    if (sendOnControlChannel(ipDest, port, QStringList(), text)) return;
 
     // Text to send
     mFilesToSend = new QStringList();
     mFilesToSend->append("___DUKTO___TEXT___");
     mFileCounter = 0;
-    mTextToSend = text;
+    mTextToSend = text.toUtf8();
+    mTextSent = 0;
 
     // Connect to the recipient
-    mCurrentSocket = new QTcpSocket(this);
-    connect(mCurrentSocket, &QTcpSocket::connected, this, &DuktoProtocol::sendMetaData, Qt::DirectConnection);
-    connect(mCurrentSocket, &QTcpSocket::errorOccurred, this, &DuktoProtocol::sendConnectError, Qt::DirectConnection);
-    connect(mCurrentSocket, &QTcpSocket::bytesWritten, this, &DuktoProtocol::sendData, Qt::DirectConnection);
-    mCurrentSocket->connectToHost(ipDest, port);
+    connectForTransfer(ipDest, port);
 }
 
 void DuktoProtocol::sendScreen(QString ipDest, qint16 port, QString path)
@@ -524,6 +1488,7 @@ void DuktoProtocol::sendScreen(QString ipDest, qint16 port, QString path)
     // Check for other ongoing activities
     if (mIsReceiving || mIsSending) return;
     mIsSending = true;
+    mRemoteFeatures = peerFeatures(ipDest);
 
     // File to send
     QStringList files;
@@ -533,17 +1498,244 @@ void DuktoProtocol::sendScreen(QString ipDest, qint16 port, QString path)
     mSendingScreen = true;
 
     // Connect to the recipient
-    mCurrentSocket = new QTcpSocket(this);
+    connectForTransfer(ipDest, port);
+}
+
+// Sends the content of a device whose size is not known in advance
+// (pipe, process output, generated data...) as a chunked element. The
+// source must stay alive until the transfer is over; its end is the end
+// of file for files and pipes, or readChannelFinished()/close() for other
+// sequential devices. Only peers advertising FeatureChunkedElements can
+// receive it.
+void DuktoProtocol::sendStream(QString ipDest, qint16 port, QIODevice *source, QString name)
+{
+    // Check for default port
+    if (port == 0) port = DEFAULT_TCP_PORT;
+
+    // Check for other ongoing activities
+    if (mIsReceiving || mIsSending) return;
+
+    // Check that the recipient is able to receive it
+    if (!(peerFeatures(ipDest) & FeatureChunkedElements))
+    {
+        emit sendFileError(QAbstractSocket::UnsupportedSocketOperationError);
+        return;
+    }
+    mIsSending = true;
+    mRemoteFeatures = peerFeatures(ipDest);
+
+    // Stream to send
+    mFilesToSend = new QStringList();
+    mFilesToSend->append("___DUKTO___STREAM___");
+    mFileCounter = 0;
+    mStreamSource = source;
+    mStreamName = name;
+
+    // Connect to the recipient
+    connectForTransfer(ipDest, port);
+}
+
+// Opens the connection to a peer in advance (e.g. when its send page
+// is shown), so that the transfer starts at once and an unreachable peer
+// is found out before the user picks what to send. Only for peers that
+// accept idle connections.
+void DuktoProtocol::preconnect(QString ipDest, qint16 port)
+{
+    if (port == 0) port = DEFAULT_TCP_PORT;
+    if (mIsReceiving || mIsSending) return;
+    if (!(peerFeatures(ipDest) & FeaturePreconnect)) return;
+
+    // Already open (or opening) to the same peer
+    if (mWarmSocket && (mWarmIp == ipDest) && (mWarmPort == port))
+    {
+        mWarmTimer.start();
+        return;
+    }
+    dropPreconnection();
+
+    mWarmSocket = new QTcpSocket(this);
+    mWarmIp = ipDest;
+    mWarmPort = port;
+    mWarmConnected = false;
+    connect(mWarmSocket, &QTcpSocket::connected, this, [this]() {
+        mWarmConnected = true;
+        emit peerReachable(mWarmIp, true);
+    });
+    connect(mWarmSocket, &QTcpSocket::errorOccurred, this, &DuktoProtocol::preconnectError);
+    mWarmSocket->connectToHost(ipDest, port);
+    mWarmTimer.start();
+}
+
+void DuktoProtocol::preconnectError(QAbstractSocket::SocketError e)
+{
+    Q_UNUSED(e);
+
+    // Closed by the peer after being open, it's still reachable
+    QString ip = mWarmIp;
+    bool wasConnected = mWarmConnected;
+    dropPreconnection();
+    if (!wasConnected) emit peerReachable(ip, false);
+}
+
+void DuktoProtocol::dropPreconnection()
+{
+    mWarmTimer.stop();
+    if (!mWarmSocket) return;
+    disconnect(mWarmSocket, nullptr, this, nullptr);
+    mWarmSocket->close();
+    mWarmSocket->deleteLater();
+    mWarmSocket = NULL;
+    mWarmConnected = false;
+}
+
+// Connection for a new transfer: the one opened in advance when it's
+// ready, a new one otherwise
+void DuktoProtocol::connectForTransfer(const QString &ipDest, qint16 port)
+{
+    // Nothing sent yet, the counters of the previous transfer don't count
+    mSentData = 0;
+    mTotalSize = 0;
+
+    bool warm = mWarmSocket && mWarmConnected && (mWarmIp == ipDest) && (mWarmPort == port)
+                && (mWarmSocket->state() == QAbstractSocket::ConnectedState);
+    if (warm)
+    {
+        mWarmTimer.stop();
+        disconnect(mWarmSocket, nullptr, this, nullptr);
+        mCurrentSocket = mWarmSocket;
+        mWarmSocket = NULL;
+        mWarmConnected = false;
+    }
+    else
+    {
+        dropPreconnection();
+        mCurrentSocket = new QTcpSocket(this);
+    }
 
     // Handle signals
-    connect(mCurrentSocket, &QTcpSocket::connected, this, &DuktoProtocol::sendMetaData, Qt::DirectConnection);
     connect(mCurrentSocket, &QTcpSocket::errorOccurred, this, &DuktoProtocol::sendConnectError, Qt::DirectConnection);
     connect(mCurrentSocket, &QTcpSocket::bytesWritten, this, &DuktoProtocol::sendData, Qt::DirectConnection);
 
-    // Establish connection
+    // Already connected: start from the event loop, as it would on connection
+    if (warm)
+    {
+        QTcpSocket *s = mCurrentSocket;
+        QTimer::singleShot(0, s, [this, s]() {
+            if (mCurrentSocket == s) sendMetaData();
+        });
+        return;
+    }
+
+    connect(mCurrentSocket, &QTcpSocket::connected, this, &DuktoProtocol::sendMetaData, Qt::DirectConnection);
     mCurrentSocket->connectToHost(ipDest, port);
 }
 
+// Sends a text or a single small file as a message on the control
+// channel, if the peer supports it. The transfer ends when the message
+// is acknowledged.
+bool DuktoProtocol::sendOnControlChannel(const QString &ipDest, qint16 port, const QStringList &files, const QString &text)
+{
+    if (!(mRemoteFeatures & FeatureControlChannel)) return false;
+
+    if (files.isEmpty())
+    {
+        if (text.size() > ControlChannel::MAX_MESSAGE_SIZE / 3) return false;
+        mControlMessage = mControl.sendText(ipDest, port, text);
+        mTotalSize = text.toUtf8().size();
+        mControlTotal = mTotalSize;
+        mControlDelivered = 0;
+        return true;
+    }
+
+    if (files.size() != 1) return false;
+    QFileInfo fi(files.at(0));
+    if (!fi.isFile() || fi.isSymLink() || (fi.size() > ControlChannel::MAX_MESSAGE_SIZE)) return false;
+    QFile file(files.at(0));
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    QByteArray data = file.readAll();
+    if (data.size() != fi.size()) return false;
+    mControlMessage = mControl.sendFile(ipDest, port, fi.fileName(), data);
+    mTotalSize = data.size();
+    mControlTotal = mTotalSize;
+    mControlDelivered = 0;
+    return true;
+}
+
+void DuktoProtocol::controlMessageProgress(quint32 id, qint64 total, qint64 delivered)
+{
+    if (id != mControlMessage) return;
+    mControlTotal = total;
+    mControlDelivered = delivered;
+}
+
+void DuktoProtocol::controlMessageDelivered(quint32 id)
+{
+    if (id != mControlMessage) return;
+    mControlMessage = 0;
+    mIsSending = false;
+    emit sendFileComplete();
+}
+
+void DuktoProtocol::controlMessageFailed(quint32 id)
+{
+    if (id != mControlMessage) return;
+    mControlMessage = 0;
+    mIsSending = false;
+    emit sendFileError(QAbstractSocket::RemoteHostClosedError);
+}
+
+// Messages received during a transfer are shown after it
+void DuktoProtocol::controlTextReceived(QString ip, QString text)
+{
+    if (mIsReceiving || mIsSending)
+    {
+        QTimer::singleShot(500, this, [this, ip, text]() { controlTextReceived(ip, text); });
+        return;
+    }
+
+    emit receiveFileStart(ip);
+    emit receiveTextComplete(&text, text.toUtf8().size());
+}
+
+void DuktoProtocol::controlFileReceived(QString ip, QString name, QByteArray data)
+{
+    if (mIsReceiving || mIsSending)
+    {
+        QTimer::singleShot(500, this, [this, ip, name, data]() { controlFileReceived(ip, name, data); });
+        return;
+    }
+
+    // Only a plain name, in the destination folder
+    name = QFileInfo(name).fileName();
+    if (name.isEmpty() || (name == "..")) return;
+    name = availableName(name);
+    QFile file(name);
+    if (!isInsideDestination(name) || !file.open(QIODevice::WriteOnly) || (file.write(data) != data.size()))
+    {
+        file.remove();
+        return;
+    }
+    file.close();
+
+    emit receiveFileStart(ip);
+    QStringList files;
+    files.append(name);
+    emit receiveFileComplete(&files, data.size());
+}
+
+// Name not used yet for a received file: "name (2).ext", "name (3).ext"...
+QString DuktoProtocol::availableName(const QString &name)
+{
+    int i = 2;
+    QString available = name;
+    while (QFile::exists(available)) {
+        QFileInfo fi(name);
+        available = fi.baseName() + " (" + QString::number(i) + ")." + fi.completeSuffix();
+        i++;
+    }
+    return available;
+}
+
 void DuktoProtocol::sendMetaData()
 {
     // Set send buffer
@@ -558,38 +1750,39 @@ void DuktoProtocol::sendMetaData()
     //  - Name of first file
     //  - Size of first (and only) file (-1 for a folder)
 
-    QByteArray header;
+    PooledBuffer header;
     qint64 tmp;
 
     // Number of entities
     tmp = mFilesToSend->count();
-    header.append((char*) &tmp, sizeof(tmp));
-    // Total size
+    memcpy(header.data(), &tmp, sizeof(tmp));
+    // Total size (-1 if unknown)
     mTotalSize = computeTotalSize(mFilesToSend);
-    header.append((char*) &mTotalSize, sizeof(mTotalSize));
+    tmp = mTotalSizeKnown ? mTotalSize : -1;
+    memcpy(header.data() + sizeof(tmp), &tmp, sizeof(tmp));
+    qint64 size = sizeof(tmp) + sizeof(mTotalSize);
+
+    mTotalSize += size;
 
-    // First element
-    header.append(nextElementHeader());
+    // First element(s)
+    mSentBuffer = 0;
+    size = appendElementBatch(header.data(), size);
 
     // Send header
-    mCurrentSocket->write(header);
+    mCurrentSocket->write(header.data(), size);
 
     // Initialize variables
-    mTotalSize += header.size();
     mSentData = 0;
-    mSentBuffer = 0;
-
-    // Update user interface
-    updateStatus();
+    mSentBuffer += size;
 }
 
 void DuktoProtocol::sendData(qint64 b)
 {
-    QByteArray d;
+    PooledBuffer buffer;
+    qint64 size = 0;
 
     // Update statistics
     mSentData += b;
-    updateStatus();
 
     // Check if all data placed in the buffer has been sent
     mSentBuffer -= b;
@@ -597,49 +1790,298 @@ void DuktoProtocol::sendData(qint64 b)
     // If there is more data to send, wait for it to be sent
     if (mSentBuffer > 0) return;
 
-    // If it's a textual send, send all the text
-    if ((!mTextToSend.isEmpty()) && (mFilesToSend->at(mFileCounter - 1) == "___DUKTO___TEXT___"))
+    // If it's a textual send, send the next part of the text
+    if ((mTextSent < mTextToSend.size()) && (mFilesToSend->at(mFileCounter - 1) == "___DUKTO___TEXT___"))
+    {
+        size = qMin<qint64>(BufferPool::BLOCK_SIZE, mTextToSend.size() - mTextSent);
+        mCurrentSocket->write(mTextToSend.constData() + mTextSent, size);
+        mTextSent += size;
+        mSentBuffer = size;
+        if (mTextSent == mTextToSend.size()) mTextToSend = QByteArray();
+        return;
+    }
+
+    // If the current element is chunked, send its next chunk
+    if (mChunkedSource)
     {
-        d.append(mTextToSend.toUtf8().data());
-        mCurrentSocket->write(d);
-        mSentBuffer = d.size();
-        mTextToSend.clear();
+        size = nextChunk(buffer.data());
+        if (size == 0)
+        {
+            // Nothing ready yet, resume when the source has data
+            mWaitingForSource = true;
+            mSentBuffer = 0;
+            return;
+        }
+        mCurrentSocket->write(buffer.data(), size);
+        mSentBuffer = size;
+        return;
+    }
+
+    // If the current file is sparse, send its next extent
+    if (mCurrentFile && mSendSparse)
+    {
+        size = nextSparseRun(buffer.data());
+        mCurrentSocket->write(buffer.data(), size);
+        mSentBuffer = size;
         return;
     }
 
     // If the current file is not finished, send a new part of the file
-    if (mCurrentFile)
-        d = mCurrentFile->read(10000);
-    if (d.size() > 0)
+    if (mCurrentFile && (mFileRemaining > 0))
+        size = readFileData(buffer.data(), SEND_CHUNK_SIZE);
+    if (size > 0)
     {
-        mCurrentSocket->write(d);
-        mSentBuffer = d.size();
+        mCurrentSocket->write(buffer.data(), size);
+        mSentBuffer = size;
         return;
     }
 
-    // Otherwise, close the file and move to the next one
-    d.append(nextElementHeader());
+    // Otherwise, move to the next elements
+    mSentBuffer = 0;
+    size = appendElementBatch(buffer.data(), 0);
 
     // Are there no more files to send?
-    if (d.size() == 0)
+    if ((size == 0) && (mSentBuffer == 0))
     {
         closeCurrentTransfer();
         return;
     }
 
-    // Send the header along with the first chunk of the file
-    mTotalSize += d.size();
-    if (mCurrentFile)
-        d.append(mCurrentFile->read(10000));
-    mCurrentSocket->write(d);
-    mSentBuffer += d.size();
+    // Send the headers along with the data of the small files
+    // and the first chunk of the last one
+    if (size > 0)
+        mCurrentSocket->write(buffer.data(), size);
+    mSentBuffer += size;
 
     return;
 }
 
+// Appends to the batch the headers of the next elements. Small files are
+// packed whole together with their header, so that a tree of tiny files
+// goes out in a few large writes instead of one write per element. The
+// stream is the same the receiver would get element by element.
+// The batch is a pool block already filled up to 'used' bytes; returns
+// the new amount of data in the block. Data that had to be written
+// directly is accounted in mSentBuffer.
+qint64 DuktoProtocol::appendElementBatch(char *batch, qint64 used)
+{
+    while (used < SEND_BATCH_SIZE)
+    {
+        qint64 size = nextElementHeader(batch + used, BufferPool::BLOCK_SIZE - used);
+        if (size == 0) break;
+        if ((size < 0) && (used > 0))
+        {
+            // Flush the batch and go on with an empty one
+            mCurrentSocket->write(batch, used);
+            mSentBuffer += used;
+            used = 0;
+            size = nextElementHeader(batch, BufferPool::BLOCK_SIZE);
+        }
+        if (size < 0)
+        {
+            // Only a name longer than a block gets here, written on its own
+            QByteArray header(-size, 0);
+            size = nextElementHeader(header.data(), header.size());
+            mCurrentSocket->write(header.constData(), size);
+            mSentBuffer += size;
+        }
+        else
+            used += size;
+        mTotalSize += size;
+
+        // Text and chunked elements are sent on their own by sendData()
+        if (mFilesToSend->at(mFileCounter - 1) == "___DUKTO___TEXT___") break;
+        if (mChunkedSource) break;
+        if (mSendSparse) break;
+
+        // Element by element, the data after the header (as without batching)
+        if (!mSendBatching) break;
+
+        // Folders have no data
+        if (!mCurrentFile) continue;
+
+        // A file which doesn't fit in the batch is sent chunk by chunk
+        if (used + mFileRemaining > SEND_BATCH_SIZE)
+        {
+            used += readFileData(batch + used, qMin<qint64>(SEND_CHUNK_SIZE, BufferPool::BLOCK_SIZE - used));
+            break;
+        }
+
+        // Small file, send it whole
+        used += readFileData(batch + used, mFileRemaining);
+        mCurrentFile->close();
+        delete mCurrentFile;
+        mCurrentFile = NULL;
+    }
+    return used;
+}
+
+// Next data of the current file, no more than its header announced: a
+// file grown in the meantime is cut, one that shrank is padded with
+// zeros, so that the stream stays in sync with the headers
+qint64 DuktoProtocol::readFileData(char *buffer, qint64 max)
+{
+    qint64 n = qMin(max, mFileRemaining);
+    bool exhausted = mCurrentFile->atEnd();
+    qint64 r = mCurrentFile->read(buffer, n);
+    if (r < n)
+    {
+        if (!exhausted) qWarning() << "File shrank while being sent:" << mCurrentFile->fileName();
+        r = qMax<qint64>(0, r);
+        memset(buffer + r, 0, n - r);
+    }
+    mFileRemaining -= n;
+    return n;
+}
+
+// Fills the buffer with the next run of the sparse file being sent:
+//  - Offset (qint64) and length (qint64) of the run, length 0 for the end marker
+//  - Data
+// Holes between runs are skipped and counted as sent. Returns the size of
+// what has to be written.
+qint64 DuktoProtocol::nextSparseRun(char *buffer)
+{
+    qint64 extent[2];
+    qint64 offset = mSendSparsePos;
+    qint64 r = 0;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    int fd = mCurrentFile->handle();
+
+    // Look for the next extent of data
+    if (offset >= mSendSparseDataEnd)
+    {
+        offset = ::lseek(fd, mSendSparsePos, SEEK_DATA);
+        if (offset < 0) offset = mSendSparseSize;  // ENXIO: only a hole left
+        mSendSparseDataEnd = (offset < mSendSparseSize) ? ::lseek(fd, offset, SEEK_HOLE) : offset;
+        if (mSendSparseDataEnd < 0) mSendSparseDataEnd = mSendSparseSize;
+    }
+#endif
+
+    // Read the data of the run
+    if ((offset < mSendSparseDataEnd) && mCurrentFile->seek(offset))
+        r = mCurrentFile->read(buffer + sizeof(extent), qMin<qint64>(SEND_CHUNK_SIZE, mSendSparseDataEnd - offset));
+    if (r < 0) qWarning() << "Error reading sparse file:" << mCurrentFile->errorString();
+    if (r <= 0) offset = qMax(offset, mSendSparseSize);
+
+    // Skipped holes are accounted as sent, run headers as overhead
+    if (offset > mSendSparsePos) mSentData += offset - mSendSparsePos;
+    mTotalSize += sizeof(extent);
+
+    extent[0] = offset;
+    extent[1] = qMax<qint64>(r, 0);
+    memcpy(buffer, extent, sizeof(extent));
+    mSendSparsePos = offset + extent[1];
+
+    // End marker, the element is complete
+    if (extent[1] == 0)
+    {
+        mCurrentFile->close();
+        delete mCurrentFile;
+        mCurrentFile = NULL;
+        mSendSparse = false;
+    }
+    return sizeof(extent) + extent[1];
+}
+
+// Fills the buffer with the next chunk of the chunked element being sent:
+//  - Length of the chunk (qint32), 0 for the end marker
+//  - Data
+// Returns the size of what has to be written, or 0 when the source has no
+// data ready yet.
+qint64 DuktoProtocol::nextChunk(char *buffer)
+{
+    qint32 length = 0;
+    qint64 r = mChunkedSource->read(buffer + sizeof(length), SEND_CHUNK_SIZE);
+
+    // No data available, but the source is not over
+    if ((r == 0) && !chunkedSourceAtEnd()) return 0;
+
+    if (r < 0) qWarning() << "Error reading chunked source:" << mChunkedSource->errorString();
+    if (r > 0) length = r;
+    memcpy(buffer, &length, sizeof(length));
+
+    // End marker sent, the element is over
+    if (length == 0) closeChunkedSource();
+
+    return sizeof(length) + length;
+}
+
+// Tells if a source that returned no data has reached its end
+bool DuktoProtocol::chunkedSourceAtEnd()
+{
+    // Regular files may still be growing (a log being written): they're
+    // over once their size stays the same for a while
+    QFileDevice *file = qobject_cast<QFileDevice*>(mChunkedSource);
+    if (file && !file->isSequential())
+    {
+        qint64 size = file->size();
+        if (size == mChunkedSourceSize) return true;
+        mChunkedSourceSize = size;
+        QTimer::singleShot(CHUNKED_GROWTH_WAIT, this, &DuktoProtocol::chunkedSourceReady);
+        return false;
+    }
+
+    // Pipes opened as files return no data only at the end (read is blocking)
+    if (file) return true;
+
+    return mChunkedSourceEnded || !mChunkedSource->isOpen() || !mChunkedSource->isSequential();
+}
+
+void DuktoProtocol::openChunkedSource(QIODevice *source)
+{
+    mChunkedSource = source;
+    mChunkedSourceEnded = false;
+    mChunkedSourceSize = -1;
+    mWaitingForSource = false;
+    connect(mChunkedSource, &QIODevice::readyRead, this, &DuktoProtocol::chunkedSourceReady);
+    connect(mChunkedSource, &QIODevice::readChannelFinished, this, &DuktoProtocol::chunkedSourceFinished);
+    connect(mChunkedSource, &QIODevice::aboutToClose, this, &DuktoProtocol::chunkedSourceFinished);
+}
+
+void DuktoProtocol::closeChunkedSource()
+{
+    if (!mChunkedSource) return;
+    disconnect(mChunkedSource, nullptr, this, nullptr);
+
+    // Files opened by the protocol are closed here, streams belong to the caller
+    if (mChunkedSource == mCurrentFile)
+    {
+        mCurrentFile->close();
+        delete mCurrentFile;
+        mCurrentFile = NULL;
+    }
+    if (mChunkedSource == mPipeSource)
+    {
+        // Possibly from its own readyRead()
+        mPipeSource->close();
+        mPipeSource->deleteLater();
+        mPipeSource = NULL;
+    }
+    mChunkedSource = NULL;
+    mWaitingForSource = false;
+}
+
+// New data from the source of a chunked element
+void DuktoProtocol::chunkedSourceReady()
+{
+    if (!mWaitingForSource) return;
+    mWaitingForSource = false;
+    sendData(0);
+}
+
+// The source of a chunked element has no more data to give
+void DuktoProtocol::chunkedSourceFinished()
+{
+    mChunkedSourceEnded = true;
+    chunkedSourceReady();
+}
+
 // Close data transfer
 void DuktoProtocol::closeCurrentTransfer(bool aborted)
 {
+    closeChunkedSource();
+    mStreamSource = NULL;
     mCurrentSocket->disconnect();
     mCurrentSocket->disconnectFromHost();
     if (mCurrentSocket->state() != QTcpSocket::UnconnectedState)
@@ -653,6 +2095,8 @@ void DuktoProtocol::closeCurrentTransfer(bool aborted)
         delete mCurrentFile;
         mCurrentFile = NULL;
     }
+    mTextToSend = QByteArray();
+    mSendSparse = false;
     mIsSending = false;
     if (!aborted)
         emit sendFileComplete();
@@ -662,18 +2106,34 @@ void DuktoProtocol::closeCurrentTransfer(bool aborted)
     return;
 }
 
-// Update sending statistics
-void DuktoProtocol::updateStatus()
+// Counters of the current transfer (total -1 when unknown), sampled by
+// the UI at its own pace rather than signalled for every chunk
+void DuktoProtocol::transferProgress(qint64 *total, qint64 *partial) const
 {
-    if (mIsSending)
-        emit transferStatusUpdate(mTotalSize, mSentData);
+    *total = 0;
+    *partial = 0;
+    if (mControlMessage != 0)
+    {
+        *total = mControlTotal;
+        *partial = mControlDelivered;
+    }
+    else if (mIsSending)
+    {
+        *total = mTotalSizeKnown ? mTotalSize : -1;
+        *partial = mSentData;
+    }
     else if (mIsReceiving)
-        emit transferStatusUpdate(mTotalSize, mTotalReceivedData);
+    {
+        *total = mTotalSize;
+        *partial = mTotalReceivedData;
+    }
 }
 
 // In case of connection failure
 void DuktoProtocol::sendConnectError(QAbstractSocket::SocketError e)
 {
+    closeChunkedSource();
+    mStreamSource = NULL;
     if (mCurrentSocket)
     {
         mCurrentSocket->close();
@@ -686,6 +2146,7 @@ void DuktoProtocol::sendConnectError(QAbstractSocket::SocketError e)
         delete mCurrentFile;
         mCurrentFile = NULL;
     }
+    mTextToSend = QByteArray();
     mIsSending = false;
     emit sendFileError(e);
 }
@@ -702,132 +2163,339 @@ QStringList* DuktoProtocol::expandTree(QStringList files)
     mBasePath.replace("\\", "/"); // Normalize to forward slashes
     if (mBasePath.right(1) == "/") mBasePath.chop(1);
 
+    // Links found during the walk
+    mWalkedInodes.clear();
+    mFileInodes.clear();
+    mSymlinks.clear();
+    mHardlinks.clear();
+
     // Iterate over elements
     QStringList* expanded = new QStringList();
     for (int i = 0; i < files.count(); i++) {
         QString path = files.at(i);
         path.replace("\\", "/"); // Normalize to forward slashes
-        addRecursive(expanded, path);
+        addRecursive(expanded, path, true);
     }
 
     return expanded;
 }
 
-// Recursively add all folders and files contained in a folder
-void DuktoProtocol::addRecursive(QStringList *e, QString path)
+// Identifier of the file a path points to ("device:inode"), and number
+// of hard links to it. Where inodes are not available, the canonical
+// path is used and hard links are not detected.
+static QString inodeKey(const QString &path, int *links)
+{
+    *links = 1;
+#if defined(Q_OS_UNIX)
+    struct stat st;
+    if (::stat(QFile::encodeName(path).constData(), &st) != 0) return "";
+    *links = st.st_nlink;
+    return QString::number(st.st_dev) + ":" + QString::number(st.st_ino);
+#else
+    return QFileInfo(path).canonicalFilePath();
+#endif
+}
+
+// Target of a symbolic link, as stored in the link
+static QString symlinkTarget(const QString &path)
+{
+#if defined(Q_OS_UNIX)
+    char target[4096];
+    ssize_t size = ::readlink(QFile::encodeName(path).constData(), target, sizeof(target));
+    if (size > 0) return QFile::decodeName(QByteArray(target, size));
+#endif
+    return QFileInfo(path).symLinkTarget();
+}
+
+// Recursively add all folders and files contained in a folder. Each
+// folder is walked once, even if reachable through links. Links inside
+// folders are handled according to the link policy: when the peer can
+// recreate them, a file reachable through many links is sent only once.
+void DuktoProtocol::addRecursive(QStringList *e, QString path, bool topLevel)
 {
 
     path.replace("\\", "/"); // Normalize to forward slashes
     path.replace("//", "/");
     if (path.right(1) == "/") path.chop(1);
-    e->append(path);
 
     QFileInfo fi(path);
+    bool linksAsElements = (mLinkPolicy == LinksAsElements) && (mRemoteFeatures & FeatureLinkElements);
+
+    // Symbolic links met while walking (the selected items are always followed)
+    if (!topLevel && fi.isSymLink())
+    {
+        if (mLinkPolicy == SkipLinks) return;
+        if (linksAsElements)
+        {
+            // Only links within the base path are sent as such, with a
+            // relative target: the others would lead elsewhere on the peer
+            QString target = symlinkTarget(path);
+            QString folder = QFileInfo(path).path();
+            QString resolved = QDir::cleanPath(QDir::isAbsolutePath(target) ? target : folder + "/" + target);
+            if ((resolved == mBasePath) || resolved.startsWith(mBasePath + "/"))
+            {
+                e->append(path);
+                mSymlinks.insert(path, QDir(folder).relativeFilePath(resolved));
+                return;
+            }
+        }
+        if (!fi.exists()) return;   // Dangling
+    }
+
+    int links;
+    QString key = inodeKey(path, &links);
+
     if (fi.isDir())
     {
+        // Skip folders already walked (links to folders, loops)
+        if (!key.isEmpty() && mWalkedInodes.contains(key)) return;
+        mWalkedInodes.insert(key);
+        e->append(path);
+
         QStringList entries = QDir(path).entryList(QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot);
         for (int i = 0; i < entries.count(); i++) {
             QString childPath = path + "/" + entries.at(i);
             childPath.replace("\\", "/"); // Normalize to forward slashes
-            addRecursive(e, childPath);
+            addRecursive(e, childPath, false);
         }
+        return;
     }
+
+    // Files with more than one path
+    if (!key.isEmpty() && ((links > 1) || fi.isSymLink()))
+    {
+        if (mFileInodes.contains(key))
+        {
+            if (mLinkPolicy == SkipLinks) return;
+            if (linksAsElements) mHardlinks.insert(path, mFileInodes.value(key));
+        }
+        else
+            mFileInodes.insert(key, path);
+    }
+    e->append(path);
 }
 
-// Returns the header to send for the next element
-QByteArray DuktoProtocol::nextElementHeader()
+// Writes the header of the next element in the buffer and returns its
+// size: 0 when there are no more elements, minus the size it needs when
+// it doesn't fit in max bytes (the element is then left for the next call)
+qint64 DuktoProtocol::nextElementHeader(char *buffer, qint64 max)
 {
-    QByteArray header;
-
     // Get the name of the next file (if it's not the last one)
-    if (mFilesToSend->size() == mFileCounter) return header; // If no more files, return empty header
-    QString fullname = mFilesToSend->at(mFileCounter++);
+    if (mFilesToSend->size() == mFileCounter) return 0;
+    const QString &fullname = mFilesToSend->at(mFileCounter);
+    bool stream = (fullname == "___DUKTO___STREAM___");
+    bool text = (fullname == "___DUKTO___TEXT___");
+
+    // Name of the element: streams have their own, texts the identifier,
+    // files are named without the base path
+    QStringView name = fullname;
+    if (stream)
+        name = mStreamName;
+    else if (mSendingScreen && !text)
+        name = u"Screenshot.jpg";
+    else if (!text && name.startsWith(mBasePath) && (name.size() > mBasePath.size()) && (name.at(mBasePath.size()) == u'/'))
+        name = name.sliced(mBasePath.size() + 1);
+
+    // Size of the element:
+    //  - Text size for texts, CHUNKED_ELEMENT_SIZE for streams
+    //  - SYMLINK_ELEMENT_SIZE or HARDLINK_ELEMENT_SIZE for links, followed by the
+    //    target: as found on disk for symbolic links, element name for hard links
+    //  - File size, or SPARSE_ELEMENT_SIZE followed by the logical size
+    qint64 size = -1;
+    qint64 logicalSize = 0;
+    bool link = mSymlinks.contains(fullname) || mHardlinks.contains(fullname);
+    QString target;
+    if (stream)
+        size = CHUNKED_ELEMENT_SIZE;
+    else if (text)
+        size = mTextToSend.size();
+    else if (link)
+    {
+        bool hard = mHardlinks.contains(fullname);
+        size = hard ? HARDLINK_ELEMENT_SIZE : SYMLINK_ELEMENT_SIZE;
+        target = hard ? mHardlinks.value(fullname) : mSymlinks.value(fullname);
+        if (hard) target.replace(mBasePath + "/", "");
+    }
+    else
+    {
+        QFileInfo fi(fullname);
+        logicalSize = fi.size();
+        if (fi.isFile()) size = isSparseFile(fullname) ? SPARSE_ELEMENT_SIZE : logicalSize;
+        else if (isChunkedElement(fullname)) size = CHUNKED_ELEMENT_SIZE;
+    }
 
-    // Close the previous file if it's still open
+    // Room for the UTF-8 names at worst
+    QStringEncoder utf8(QStringEncoder::Utf8);
+    qint64 needed = utf8.requiredSpace(name.size()) + 1 + sizeof(size);
+    if (link) needed += utf8.requiredSpace(target.size()) + 1;
+    if (size == SPARSE_ELEMENT_SIZE) needed += sizeof(logicalSize);
+    if (needed > max) return -needed;
+
+    char *p = utf8.appendToBuffer(buffer, name);
+    *p++ = '\0';
+    memcpy(p, &size, sizeof(size));
+    p += sizeof(size);
+    if (link)
+    {
+        p = utf8.appendToBuffer(p, target);
+        *p++ = '\0';
+    }
+    if (size == SPARSE_ELEMENT_SIZE)
+    {
+        memcpy(p, &logicalSize, sizeof(logicalSize));
+        p += sizeof(logicalSize);
+    }
+
+    // The element is taken: close the previous file if it's still open
+    mFileCounter++;
+    if (!stream && !text) mSendingScreen = false;
     if (mCurrentFile) {
         mCurrentFile->close();
         delete mCurrentFile;
         mCurrentFile = nullptr;
     }
+    mSendSparse = false;
 
-    // Check if it's a text transfer
-    if (fullname == "___DUKTO___TEXT___") {
-        // Append the text identifier to the header
-        header.append(fullname.toUtf8());
-        header.append('\0');
-        // Append the text size to the header
-        qint64 size = mTextToSend.toUtf8().length();
-        header.append((char*) &size, sizeof(size));
-        return header;
+    // Open the file
+    if (stream) {
+        openChunkedSource(mStreamSource);
     }
-
-    // Get the file name
-    QString name;
-
-    // Check if it's a screenshot
-    if (mSendingScreen) {
-        name = "Screenshot.jpg";
-        mSendingScreen = false;
-    } else {
-        name = fullname;
+    else if (text || link) {
+        // Nothing to open
     }
-
-    // Add the file name to the header without the base path
-    name.replace(mBasePath + "/", "");
-    header.append(name.toUtf8());
-    header.append('\0');
-
-    // Add the file size to the header
-    qint64 size = -1;
-    QFileInfo fi2(fullname);
-    if (fi2.isFile()) size = fi2.size();
-    header.append((char*) &size, sizeof(size));
-
-    // Open the file
-    if (size > -1) {
+    else if (size == SPARSE_ELEMENT_SIZE) {
+        mSendSparseSize = logicalSize;
+        mCurrentFile = new QFile(fullname);
+        mCurrentFile->open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+        mSendSparse = true;
+        mSendSparsePos = 0;
+        mSendSparseDataEnd = 0;
+    }
+    else if (size > -1) {
         mCurrentFile = new QFile(fullname);
         mCurrentFile->open(QIODevice::ReadOnly);
+        mFileRemaining = size;
+    }
+    else if (size == CHUNKED_ELEMENT_SIZE) {
+#if defined(Q_OS_UNIX)
+        // Pipes and devices are read when they have data, not waited for
+        mPipeSource = new PipeSource(fullname);
+        mPipeSource->open(QIODevice::ReadOnly);
+        openChunkedSource(mPipeSource);
+#else
+        mCurrentFile = new QFile(fullname);
+        mCurrentFile->open(QIODevice::ReadOnly);
+        openChunkedSource(mCurrentFile);
+#endif
     }
 
-    return header;
+    return p - buffer;
 }
 
 // Calculates the total size of all files to be transferred
 qint64 DuktoProtocol::computeTotalSize(QStringList *e)
 {
     // If you send a text
+    mTotalSizeKnown = true;
     if ((e->length() == 1) && (e->at(0) == "___DUKTO___TEXT___"))
-        return mTextToSend.toUtf8().length();
+        return mTextToSend.size();
 
     // If you send regular files
     qint64 size = 0;
+    mTotalSizeKnown = true;
     for (int i = 0; i < e->count(); i++)
     {
+        if (isChunkedElement(e->at(i))) {
+            mTotalSizeKnown = false;
+            continue;
+        }
+        if (mSymlinks.contains(e->at(i)) || mHardlinks.contains(e->at(i))) continue;
         QFileInfo fi(e->at(i));
         if (!fi.isDir()) size += fi.size();
     }
     return size;
 }
 
-// Sends a packet to all broadcast addresses of the PC
-void DuktoProtocol::sendToAllBroadcast(QByteArray *packet, qint16 port)
+// Tells if an element has to be sent as a chunked element: streams, and
+// pipes or devices in the file list when the peer supports it
+bool DuktoProtocol::isChunkedElement(const QString &path)
 {
-    // List available interfaces
-    QList<QNetworkInterface> ifaces = QNetworkInterface::allInterfaces();
+    if (path == "___DUKTO___STREAM___") return true;
+    if (!(mRemoteFeatures & FeatureChunkedElements)) return false;
+    if (path == "___DUKTO___TEXT___") return false;
+    QFileInfo fi(path);
+    return fi.exists() && !fi.isDir() && !fi.isFile();
+}
 
-    // Iterate interfaces
-    for (int i = 0; i < ifaces.size(); i++)
+// Tells if a file has to be sent as a sparse element: files with holes,
+// when the peer supports it and holes can be found on this platform
+bool DuktoProtocol::isSparseFile(const QString &path)
+{
+    if (!(mRemoteFeatures & FeatureSparseElements)) return false;
+#if defined(Q_OS_UNIX) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+    struct stat st;
+    if (::stat(QFile::encodeName(path).constData(), &st) != 0) return false;
+    return S_ISREG(st.st_mode) && (static_cast<qint64>(st.st_blocks) * 512 < static_cast<qint64>(st.st_size));
+#else
+    Q_UNUSED(path);
+    return false;
+#endif
+}
+
+// Tells if hellos have to be broadcast: always in broadcast mode; in
+// multicast mode for the first one and while some peer around doesn't
+// listen to the multicast groups (legacy clients, or current ones left
+// in broadcast mode)
+bool DuktoProtocol::useBroadcast()
+{
+    if (mDiscoveryMode == BroadcastDiscovery) return true;
+    if (mBroadcastProbe)
     {
-        // Iterate all interface IPs
-        QList<QNetworkAddressEntry> addrs = ifaces[i].addressEntries();
+        mBroadcastProbe = false;
+        return true;
+    }
+    foreach (const Peer &p, mPeers.peers())
+        if (!p.provisional && !(p.features & FeatureMulticastDiscovery)) return true;
+    return false;
+}
 
-        // Send packet for each IP broadcast
-        for (int j = 0; j < addrs.size(); j++)
-            if ((addrs[j].ip().protocol() == QAbstractSocket::IPv4Protocol) && (addrs[j].broadcast().toString() != ""))
-            {
-                mSocket->writeDatagram(packet->data(), packet->length(), addrs[j].broadcast(), port);
-                mSocket->flush();
-            }
+// Sends a packet to the peers on all the local networks
+void DuktoProtocol::sendToAll(QByteArray *packet, qint16 port, bool broadcast)
+{
+    if (mDiscoveryMode == MulticastDiscovery)
+        for (auto it = mMulticastInterfaces.constBegin(); it != mMulticastInterfaces.constEnd(); ++it)
+            sendToMulticast(packet, port, it.value());
+    if (broadcast)
+        sendToAllBroadcast(packet, port);
+}
+
+// Sends a packet to the discovery group on an interface: the IPv4 group
+// where the interface has an IPv4 address, the IPv6 one otherwise
+void DuktoProtocol::sendToMulticast(QByteArray *packet, qint16 port, const QNetworkInterface &iface)
+{
+    static const QHostAddress group4(MULTICAST_GROUP_IPV4);
+    if (mJoinedIPv4.contains(iface.name()))
+    {
+        mSocket->setMulticastInterface(iface);
+        mSocket->writeDatagram(packet->data(), packet->length(), group4, port);
+        return;
+    }
+
+    QHostAddress group6(MULTICAST_GROUP_IPV6);
+    group6.setScopeId(iface.name());
+    mSocket6->writeDatagram(packet->data(), packet->length(), group6, port);
+}
+
+// Sends a packet to all broadcast addresses of the PC
+void DuktoProtocol::sendToAllBroadcast(QByteArray *packet, qint16 port)
+{
+    // Send packet for each IP broadcast of the available interfaces
+    // (kept up to date by the network monitor, no enumeration here)
+    const QList<QHostAddress> &broadcasts = NetworkMonitor::instance()->broadcastAddresses();
+    for (int i = 0; i < broadcasts.size(); i++)
+    {
+        mSocket->writeDatagram(packet->data(), packet->length(), broadcasts.at(i), port);
+        mSocket->flush();
     }
 }
 
@@ -837,6 +2505,16 @@ void DuktoProtocol::abortCurrentTransfer()
     // Check if it's sending data
     if (!mIsSending) return;
 
+    // Message on the control channel
+    if (mControlMessage != 0)
+    {
+        mControl.cancel(mControlMessage);
+        mControlMessage = 0;
+        mIsSending = false;
+        emit sendFileAborted();
+        return;
+    }
+
     // Abort current connection
     closeCurrentTransfer(true);
     emit sendFileAborted();
@@ -847,6 +2525,7 @@ void DuktoProtocol::updateBuddyName()
 {
     // Send disconnection packet
     sayGoodbye();
+    updateHelloIdentity();
 
     // Send packet with the new name
     sayHello(QHostAddress::Broadcast, true);
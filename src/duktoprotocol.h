@@ -7,16 +7,48 @@
 #include <QtNetwork/QTcpSocket>
 #include <QtNetwork/QTcpServer>
 #include <QtNetwork/QHostInfo>
+#include <QtNetwork/QNetworkInterface>
 #include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QByteArrayView>
 
 #include "peer.h"
+#include "peerregistry.h"
+#include "controlchannel.h"
+
+class PipeSource;
 
 class DuktoProtocol : public QObject
 {
     Q_OBJECT
 
 public:
+    // Optional protocol features, advertised through the HELLO extension
+    enum Feature {
+        FeatureChunkedElements = 0x0001,    // Elements of unknown size, sent in chunks
+        FeatureLinkElements = 0x0002,       // Symbolic and hard links recreated by the receiver
+        FeatureSparseElements = 0x0004,     // Files with holes, sent as extents of data
+        FeaturePreconnect = 0x0008,         // Connections kept idle for a while before the header
+        FeatureControlChannel = 0x0010,     // Text and small files on a long-lived connection (ControlChannel)
+        FeatureMulticastDiscovery = 0x0020  // Hellos received on the discovery multicast groups
+    };
+
+    // How links found inside the folders to send are handled
+    enum LinkPolicy {
+        LinksAsElements,    // Sent as links, if the peer can recreate them (otherwise followed)
+        FollowLinks,        // Sent as the files and folders they point to
+        SkipLinks           // Not sent
+    };
+
+    // Delivery path of the discovery messages
+    enum DiscoveryMode {
+        BroadcastDiscovery,     // IPv4 broadcast on each network (legacy)
+        MulticastDiscovery      // IPv4/IPv6 multicast groups, broadcast only for legacy peers
+    };
+
     DuktoProtocol();
     virtual ~DuktoProtocol();
     void initialize();
@@ -24,13 +56,33 @@ public:
     void sayHello(QHostAddress dest);
     void sayHello(QHostAddress dest, qint16 port);
     void sayGoodbye();
-    inline QHash<QString, Peer>& getPeers() { return mPeers; }
+    inline PeerRegistry& getPeers() { return mPeers; }
     void sendFile(QString ipDest, qint16 port, QStringList files);
     void sendText(QString ipDest, qint16 port, QString text);
     void sendScreen(QString ipDest, qint16 port, QString path);
+    void sendStream(QString ipDest, qint16 port, QIODevice *source, QString name);
+    void preconnect(QString ipDest, qint16 port);
+    quint32 peerFeatures(const QString &ip);
     inline bool isBusy() { return mIsSending || mIsReceiving; }
+    void transferProgress(qint64 *total, qint64 *partial) const;
     void abortCurrentTransfer();
     void updateBuddyName();
+    inline void setLinkPolicy(LinkPolicy policy) { mLinkPolicy = policy; }
+    // Off only to measure what the batching saves (dukto-simulator --send-bench)
+    inline void setSendBatching(bool batching) { mSendBatching = batching; }
+    int nextHelloInterval();
+    qint64 sinceBroadcastHello();
+    void setDiscoveryMode(DiscoveryMode mode);
+    void setInstanceId(QByteArray id);
+    void setAvatar(qint16 port, QByteArray hash);
+    void restorePeers(const QByteArray &cache);
+    inline QByteArray savePeers() const { return mPeers.save(); }
+
+    // Discovery messages handled, to measure the receive path
+    inline qint64 datagramsHandled() const { return mDatagrams; }
+
+    // Digest of a peer in the known peers of the HELLO extension
+    static quint32 peerDigest(QByteArrayView identity);
 
 public slots:
     void newUdpData();
@@ -41,9 +93,25 @@ public slots:
     void sendMetaData();
     void sendData(qint64 b);
     void sendConnectError(QAbstractSocket::SocketError);
+    void chunkedSourceReady();
+    void chunkedSourceFinished();
+    void newBroadcastAddress(QHostAddress broadcast);
+    void sendPendingReplies();
+    void joinMulticastGroups();
+    void probeCachedPeers();
+    void preconnectError(QAbstractSocket::SocketError e);
+    void dropPreconnection();
+    void pendingHeaderReady();
+    void pendingDisconnected();
+    void controlTextReceived(QString ip, QString text);
+    void controlFileReceived(QString ip, QString name, QByteArray data);
+    void controlMessageProgress(quint32 id, qint64 total, qint64 delivered);
+    void controlMessageDelivered(quint32 id);
+    void controlMessageFailed(quint32 id);
 
 signals:
     void peerListAdded(Peer peer);
+    void peerListChanged(Peer peer);
     void peerListRemoved(Peer peer);
     void sendFileComplete();
     void sendFileError(int code);
@@ -51,26 +119,93 @@ signals:
     void receiveFileStart(QString senderIp);
     void receiveFileComplete(QStringList *files, qint64 totalSize);
     void receiveTextComplete(QString *text, qint64 totalSize);
+    void receiveTextFileComplete(QString path, qint64 totalSize);
     void receiveFileCancelled();
-    void transferStatusUpdate(qint64 total, qint64 partial);
+    void peerReachable(QString ip, bool reachable);
 
 private:
     QString getSystemSignature();
     QStringList* expandTree(QStringList files);
-    void addRecursive(QStringList *e, QString path);
+    void addRecursive(QStringList *e, QString path, bool topLevel);
     qint64 computeTotalSize(QStringList *e);
-    QByteArray nextElementHeader();
+    qint64 nextElementHeader(char *buffer, qint64 max);
+    qint64 appendElementBatch(char *batch, qint64 used);
+    qint64 readFileData(char *buffer, qint64 max);
+    bool isChunkedElement(const QString &path);
+    qint64 nextChunk(char *buffer);
+    qint64 nextSparseRun(char *buffer);
+    bool isSparseFile(const QString &path);
+    bool chunkedSourceAtEnd();
+    void openChunkedSource(QIODevice *source);
+    void closeChunkedSource();
+    QByteArray helloMessage(bool broadcast, qint16 port);
+    QByteArray helloExtension(bool broadcast);
+    bool extensionWanted(const QHostAddress &dest);
+    void updateHelloIdentity();
+    void queueReply(QHostAddress &sender, qint16 port);
+    void sendProbe(const QHostAddress &dest, qint16 port);
+    void appendHelloField(QByteArray &packet, quint8 type, QByteArrayView value);
+    void handleHelloExtension(QByteArrayView data, QHostAddress &sender);
+    bool isOwnHello(const QHostAddress &sender, qint16 port);
+    void createLink(QString name, QString target, bool hard);
+    QString linkTargetPath(const QString &name, const QString &target);
+    bool isInsideDestination(const QString &name);
+    void spillText(const char *data, qint64 size);
+    void abortReceive();
+    void openUdpSockets();
+    QUdpSocket* udpSocketFor(const QHostAddress &dest);
+    bool useBroadcast();
+    void sendToAll(QByteArray *packet, qint16 port, bool broadcast);
+    void sendToMulticast(QByteArray *packet, qint16 port, const QNetworkInterface &iface);
     void sendToAllBroadcast(QByteArray *packet, qint16 port);
     void closeCurrentTransfer(bool aborted = false);
+    void connectForTransfer(const QString &ipDest, qint16 port);
+    bool sendOnControlChannel(const QString &ipDest, qint16 port, const QStringList &files, const QString &text);
+    static QString availableName(const QString &name);
 
-    void handleMessage(QByteArray &data, QHostAddress &sender);
-    void updateStatus();
+    void handleMessage(QByteArrayView data, QHostAddress &sender);
+#if defined(Q_OS_LINUX)
+    void drainDatagrams(QUdpSocket *socket, char *block);
+#endif
 
     QUdpSocket *mSocket;            // Socket UDP segnalazione
+    QUdpSocket *mSocket6;           // IPv6 discovery socket (multicast mode only)
+    DiscoveryMode mDiscoveryMode;
+    QHash<QString, QNetworkInterface> mMulticastInterfaces; // Interfaces joined to the groups
+    QSet<QString> mJoinedIPv4;      // Interfaces joined to the IPv4 group
+    bool mBroadcastProbe;           // Next hello also broadcast (multicast mode)
+    qint64 mDatagrams;              // Discovery messages handled
     QTcpServer *mTcpServer;         // Socket TCP attesa dati
     QTcpSocket *mCurrentSocket;     // Socket TCP dell'attuale trasferimento file
+    QSet<QTcpSocket*> mPendingSockets;  // Incoming connections waiting for their header
+    QTcpSocket *mWarmSocket;        // Connection opened in advance (FeaturePreconnect)
+    QString mWarmIp;
+    qint16 mWarmPort;
+    bool mWarmConnected;
+    QTimer mWarmTimer;              // Closes the connection opened in advance when unused
+    ControlChannel mControl;        // Long-lived connections for text and small files
+    quint32 mControlMessage;        // Message shown as the current transfer, 0 if none
+    qint64 mControlTotal;           // Progress of that message
+    qint64 mControlDelivered;
+
+    PeerRegistry mPeers;            // Elenco peer individuati
+    QByteArray mInstanceId;         // Stable ID of this installation (HELLO v2)
+    qint16 mAvatarPort;
+    QByteArray mAvatarHash;
+    QByteArray mHelloIdentity;      // HELLO v2 fields, ready to be appended
+    QByteArray mSignature;          // getSystemSignature() in UTF-8, as sent in the hellos
 
-    QHash<QString, Peer> mPeers;    // Elenco peer individuati
+    // Discovery traffic control
+    QElapsedTimer mClock;
+    QTimer mReplyTimer;             // Delay of the replies to broadcast hellos
+    qint64 mLastBroadcastHello;     // Time of the last hello to everybody, -1 if none
+    QHash<QHostAddress, qint16> mPendingReplies;    // Peers to reply to -> port
+    QHash<QHostAddress, qint64> mLastReply;         // Time of the last reply to each peer
+    QSet<QHostAddress> mKnownBy;    // Peers whose last broadcast listed us as known
+    QSet<QHostAddress> mProbedBy;   // Peers whose last hello was a probe (HELLO_EXT_PROBE)
+    QTimer mProbeTimer;             // Probes of the peers loaded from the cache
+    QList<Peer> mProbedPeers;
+    int mProbeRound;
 
     // Send and receive members
     qint16 mLocalUdpPort;
@@ -80,14 +215,35 @@ private:
     QFile *mCurrentFile;            // Puntatore al file aperto corrente
     qint64 mTotalSize;              // Quantità totale di dati da inviare o ricevere
     int mFileCounter;              // Puntatore all'elemento correntemente da trasmettere o ricevere
+    quint32 mRemoteFeatures;        // Features supported by the peer of the current transfer
 
     // Sending members
     QStringList *mFilesToSend;      // Elenco degli elementi da trasmettere
     qint64 mSentData;               // Quantità di dati totale trasmessi
     qint64 mSentBuffer;             // Quantità di dati rimanenti nel buffer di trasmissione
     QString mBasePath;              // Percorso base per l'invio di file e cartelle
-    QString mTextToSend;            // Testo da inviare (in caso di invio testuale)
+    QByteArray mTextToSend;         // Text to send, UTF-8 (encoded once)
+    qint64 mTextSent;               // Bytes of the text already written
     bool mSendingScreen;            // Flag che indica se si sta inviando uno screenshot
+    bool mTotalSizeKnown;           // False if some element has an unknown size
+    qint64 mFileRemaining;          // Data of the current file still to send, as its header says
+    bool mSendBatching;             // Small elements packed together (appendElementBatch())
+    QIODevice *mStreamSource;       // Device to send (in caso di invio stream)
+    QString mStreamName;            // Name of the element for the stream
+    QIODevice *mChunkedSource;      // Source of the chunked element being sent
+    bool mChunkedSourceEnded;       // The chunked source has signalled its end
+    qint64 mChunkedSourceSize;      // Size of a chunked regular file at its last end, -1 if none yet
+    PipeSource *mPipeSource;        // Pipe or device being sent, read without blocking
+    bool mWaitingForSource;         // Sending paused until the chunked source has data
+    LinkPolicy mLinkPolicy;         // How links inside folders are sent
+    QSet<QString> mWalkedInodes;    // Folders already walked by expandTree()
+    QHash<QString, QString> mFileInodes;    // Inode -> first path found for files with many links
+    QHash<QString, QString> mSymlinks;      // Symbolic links to send -> link target
+    QHash<QString, QString> mHardlinks;     // Hard links to send -> path sent with the data
+    bool mSendSparse;               // The current file is sent as a sparse element
+    qint64 mSendSparseSize;         // Logical size of the sparse file being sent
+    qint64 mSendSparsePos;          // Offset reached in the sparse file being sent
+    qint64 mSendSparseDataEnd;      // End of the extent of data being sent
 
     // Receive members
     qint64 mElementsToReceiveCount;    // Numero di elementi da ricevere
@@ -98,12 +254,22 @@ private:
     QString mRootFolderRenamed;        // Nome della cartella principale da utilizzare
     QStringList *mReceivedFiles;        // Elenco degli elementi da trasmettere
     QByteArray mTextToReceive;             // Testo ricevuto in caso di invio testo
+    QFile *mTextFile;                  // Received text too large to be kept in memory
     bool mReceivingText;               // Ricezione di testo in corso
+    bool mElementChunked;              // The current element is received in chunks
+    QString mLinkName;                 // Name of the link being received
+    bool mElementSparse;               // The current element is received as extents
+    qint64 mSparseSize;                // Logical size of the sparse element
+    qint64 mSparseEnd;                 // End of the last extent received
+    QHash<QString, QString> mReceivedNames; // Name sent by the peer -> name of the received file
     QByteArray mPartialName;              // Nome prossimo file letto solo in parte
     enum RecvStatus {
         FILENAME,
         FILESIZE,
-        DATA
+        DATA,
+        CHUNKSIZE,
+        LINKTARGET,
+        EXTENT
     } mRecvStatus;
 
 };
@@ -1,5 +1,10 @@
 #include "guibehind.h"
 #include "platform.h"
+#include "networkmonitor.h"
+#include "avatarcache.h"
+#include "startuptrace.h"
+#include "idlescheduler.h"
+#include "wakeupstats.h"
 #include "winhelper.h" // Add this include
 
 #include <QDebug>
@@ -14,6 +19,7 @@
 #include <QRegularExpression>
 #include <QThread>
 #include <QTemporaryFile>
+#include <QFile>
 #include <QTimer>
 #include <QClipboard>
 #include <QFileDialog>
@@ -26,14 +32,21 @@
 #endif
 
 #define NETWORK_PORT 4644 // 6742
+#define TEXT_PREVIEW_SIZE 65536     // Bytes of a large text received shown at once
+#define SHOW_BACK_INTERVAL 10000    // ms between two tiles flipped, while shown
+#define HELLO_SLACK 10              // Periodic hellos wait up to 1/10 of the interval for other work
+#define HELLO_IDLE_SLACK 4          // or 1/4 while the window is hidden
+#define CLIPBOARD_DELAY 250         // ms, changes in a row are read once
 
 #if defined(Q_OS_ANDROID)
 #endif
 
 // The constructor is private and can only be called within the singleton instance method
 GuiBehind::GuiBehind(QQmlApplicationEngine &engine, QObject *parent) :
-    QObject(parent), mShowBackTimer(NULL), mPeriodicHelloTimer(NULL), mClipboard(NULL),
-    mMiniWebServer(NULL), mSettings(this), mDestBuddy(NULL), mUpdatesChecker(NULL)
+    QObject(parent), mShowBackTask(-1), mHelloTask(-1), mClipboardTask(-1), mHelloInterval(0),
+    mIdle(false), mClipboardDirty(false), mPeersDirty(false), mClipboard(NULL),
+    mMiniWebServer(NULL), mSettings(this), mDestBuddy(NULL), mUpdatesChecker(NULL),
+    mProgressMeter(NULL), mCurrentTransferRate(0), mCurrentTransferEta(-1)
 {
 #if defined(Q_OS_ANDROID)
     requestPermissions();
@@ -51,23 +64,31 @@ GuiBehind::GuiBehind(QQmlApplicationEngine &engine, QObject *parent) :
     setCurrentTransferProgress(0);
     setTextSnippetSending(false);
     setShowUpdateBanner(false);
+    mDestinationReachable = true;
+    mClipboardTextAvailable = false;
+    mDeferredInitDone = false;
+    StartupTrace::mark("destination folder");
 
-    // Clipboard object
+    // Clipboard object, read after the first frame
     mClipboard = QApplication::clipboard();
-    connect(mClipboard, SIGNAL(dataChanged()), this, SLOT(clipboardChanged()));
-    clipboardChanged(); // Initial call to handle current clipboard data
 
     // Add "Me" entry
     mBuddiesList.addMeElement();
 
     // Add "Ip" entry
     mBuddiesList.addIpElement();
+    StartupTrace::mark("buddy list");
 
     // Destination buddy
     mDestBuddy = new DestinationBuddy(this);
 
-    // Mini web server
+    // Mini web server, the avatar is loaded after the first frame
     mMiniWebServer = new MiniWebServer(NETWORK_PORT + 1);
+    mMiniWebServer->setShares(mSettings.sharedPaths());
+    mMiniWebServer->setUploads(mSettings.acceptUploads());
+    connect(mMiniWebServer, SIGNAL(uploadComplete(QStringList,qint64,QString)), this, SLOT(uploadComplete(QStringList,qint64,QString)));
+    connect(mMiniWebServer, SIGNAL(avatarReady()), this, SLOT(avatarReady()));
+    StartupTrace::mark("web server");
 
     // Initialize and set the current theme color
     mTheme.setThemeColor(mSettings.themeColor());
@@ -79,38 +100,78 @@ GuiBehind::GuiBehind(QQmlApplicationEngine &engine, QObject *parent) :
     engine.rootContext()->setContextProperty("guiBehind", this);
     engine.rootContext()->setContextProperty("destinationBuddy", mDestBuddy);
     engine.rootContext()->setContextProperty("theme", &mTheme);
+    engine.addImageProvider("avatars", new AvatarCache());
+    StartupTrace::mark("qml context");
 
     // Register protocol signals
     connect(&mDuktoProtocol, SIGNAL(peerListAdded(Peer)), this, SLOT(peerListAdded(Peer)));
+    connect(&mDuktoProtocol, SIGNAL(peerListChanged(Peer)), this, SLOT(peerListChanged(Peer)));
     connect(&mDuktoProtocol, SIGNAL(peerListRemoved(Peer)), this, SLOT(peerListRemoved(Peer)));
     connect(&mDuktoProtocol, SIGNAL(receiveFileStart(QString)), this, SLOT(receiveFileStart(QString)));
-    connect(&mDuktoProtocol, SIGNAL(transferStatusUpdate(qint64,qint64)), this, SLOT(transferStatusUpdate(qint64,qint64)));
     connect(&mDuktoProtocol, SIGNAL(receiveFileComplete(QStringList*,qint64)), this, SLOT(receiveFileComplete(QStringList*,qint64)));
     connect(&mDuktoProtocol, SIGNAL(receiveTextComplete(QString*,qint64)), this, SLOT(receiveTextComplete(QString*,qint64)));
+    connect(&mDuktoProtocol, SIGNAL(receiveTextFileComplete(QString,qint64)), this, SLOT(receiveTextFileComplete(QString,qint64)));
     connect(&mDuktoProtocol, SIGNAL(sendFileComplete()), this, SLOT(sendFileComplete()));
     connect(&mDuktoProtocol, SIGNAL(sendFileError(int)), this, SLOT(sendFileError(int)));
     connect(&mDuktoProtocol, SIGNAL(receiveFileCancelled()), this, SLOT(receiveFileCancelled()));
     connect(&mDuktoProtocol, SIGNAL(sendFileAborted()), this, SLOT(sendFileAborted()));
+    connect(&mDuktoProtocol, SIGNAL(peerReachable(QString,bool)), this, SLOT(peerReachable(QString,bool)));
+
+    // Progress sampled at the UI rate, not for every chunk
+    mProgressMeter = new ProgressMeter(&mDuktoProtocol, this);
+    connect(mProgressMeter, SIGNAL(progress(qint64,qint64)), this, SLOT(transferStatusUpdate(qint64,qint64)));
 
     // Register other signals
     connect(this, SIGNAL(remoteDestinationAddressChanged()), this, SLOT(remoteDestinationAddressHandler()));
 
-    // Say "hello"
+    // Protocol settings, the sockets are opened after the first frame
     mDuktoProtocol.setPorts(NETWORK_PORT, NETWORK_PORT);
+    mDuktoProtocol.setLinkPolicy(static_cast<DuktoProtocol::LinkPolicy>(mSettings.linkPolicy()));
+    mDuktoProtocol.setDiscoveryMode(static_cast<DuktoProtocol::DiscoveryMode>(mSettings.discoveryMode()));
+    mDuktoProtocol.setInstanceId(mSettings.instanceId());
+
+    // Start random rotate, on the wakeups of the other periodic work when possible
+    IdleScheduler *scheduler = IdleScheduler::instance();
+    mShowBackTask = scheduler->add(this, SLOT(showRandomBack()), SHOW_BACK_INTERVAL, SHOW_BACK_INTERVAL / 2);
+    uint iSeed = QDateTime::currentSecsSinceEpoch();
+    srand(iSeed);
+    scheduler->start(mShowBackTask);
+    mClipboardTask = scheduler->add(this, SLOT(checkClipboard()), CLIPBOARD_DELAY, 0);
+    StartupTrace::mark("gui behind constructor");
+}
+
+// Everything the window doesn't need to show up, once it's shown
+void GuiBehind::deferredInit()
+{
+    if (mDeferredInitDone) return;
+    mDeferredInitDone = true;
+
+    // Say "hello", the avatar is announced again once loaded
     mDuktoProtocol.initialize();
     mDuktoProtocol.sayHello(QHostAddress::Broadcast);
+    StartupTrace::mark("discovery");
 
-    // Periodic "hello" timer
-    mPeriodicHelloTimer = new QTimer(this);
-    connect(mPeriodicHelloTimer, SIGNAL(timeout()), this, SLOT(periodicHello()));
-    mPeriodicHelloTimer->start(60000);
+    // Peers of the previous session, shown while they're verified
+    mDuktoProtocol.restorePeers(mSettings.peerCache());
 
-    // Start random rotate
-    mShowBackTimer = new QTimer(this);
-    connect(mShowBackTimer, SIGNAL(timeout()), this, SLOT(showRandomBack()));
-    uint iSeed = QDateTime::currentSecsSinceEpoch();
-    srand(iSeed);
-    mShowBackTimer->start(10000);
+    // Periodic "hello"
+    mHelloInterval = mDuktoProtocol.nextHelloInterval();
+    mHelloTask = IdleScheduler::instance()->add(this, SLOT(periodicHello()), mHelloInterval,
+                                                mHelloInterval / (mIdle ? HELLO_IDLE_SLACK : HELLO_SLACK));
+    IdleScheduler::instance()->start(mHelloTask);
+    StartupTrace::mark("peer cache");
+
+    // Avatar loaded and encoded on a pool thread, see avatarReady()
+    mMiniWebServer->loadAvatar();
+
+    // Addresses for the IP page
+    mIpAddresses.populate();
+    StartupTrace::mark("ip list");
+
+    // Clipboard content
+    connect(mClipboard, SIGNAL(dataChanged()), this, SLOT(clipboardChanged()));
+    clipboardChanged(); // Initial call to handle current clipboard data
+    StartupTrace::mark("clipboard");
 
     // Enqueue check for updates
     mUpdatesChecker = new UpdatesChecker();
@@ -125,6 +186,19 @@ GuiBehind::GuiBehind(QQmlApplicationEngine &engine, QObject *parent) :
             trayIcon->show();
     }
 #endif
+    StartupTrace::mark("deferred initialization");
+}
+
+// The avatar is served (or there's none), peers are told about it
+void GuiBehind::avatarReady()
+{
+    QByteArray hash = mMiniWebServer->avatarHash();
+    mDuktoProtocol.setAvatar(hash.isEmpty() ? 0 : NETWORK_PORT + 1, hash);
+    if (!hash.isEmpty()) mDuktoProtocol.sayHello(QHostAddress::Broadcast);
+    StartupTrace::mark("avatar");
+
+    // Last of the deferred work
+    StartupTrace::finish();
 }
 
 #if defined(Q_OS_ANDROID)
@@ -178,6 +252,13 @@ void GuiBehind::setWindowGeometry(QRect geo)
 // Add the new buddy to the buddy list
 void GuiBehind::peerListAdded(Peer peer) {
     mBuddiesList.addBuddy(peer);
+    mPeersDirty = true;
+}
+
+// Update a buddy whose name, port or features changed
+void GuiBehind::peerListChanged(Peer peer) {
+    mBuddiesList.addBuddy(peer);
+    mPeersDirty = true;
 }
 
 // Remove the buddy from the buddy list
@@ -197,6 +278,7 @@ void GuiBehind::peerListRemoved(Peer peer) {
 
     // Remove from the list
     mBuddiesList.removeBuddy(peer.address.toString());
+    mPeersDirty = true;
 }
 
 void GuiBehind::showRandomBack()
@@ -208,12 +290,48 @@ void GuiBehind::showRandomBack()
     if (i < mBuddiesList.rowCount()) mBuddiesList.showSingleBack(i);
 }
 
+// Read once the changes settle, and not at all while nobody can see it
 void GuiBehind::clipboardChanged()
 {
-    mClipboardTextAvailable = (mClipboard->text() != "");
+    mClipboardDirty = true;
+    IdleScheduler *scheduler = IdleScheduler::instance();
+    if (!mIdle && !scheduler->isActive(mClipboardTask)) scheduler->start(mClipboardTask);
+}
+
+void GuiBehind::checkClipboard()
+{
+    IdleScheduler::instance()->stop(mClipboardTask);
+    if (!mClipboardDirty) return;
+    mClipboardDirty = false;
+    bool available = (mClipboard->text() != "");
+    if (available == mClipboardTextAvailable) return;
+    mClipboardTextAvailable = available;
     emit clipboardTextAvailableChanged();
 }
 
+// Window hidden or minimized: no tiles flipping, no clipboard reads, and
+// the periodic hellos go out along with the other work
+void GuiBehind::setIdle(bool idle)
+{
+    if (idle == mIdle) return;
+    mIdle = idle;
+    WakeupStats::setIdle(idle);
+
+    IdleScheduler *scheduler = IdleScheduler::instance();
+    if (idle)
+    {
+        scheduler->stop(mShowBackTask);
+        scheduler->stop(mClipboardTask);
+    }
+    else
+    {
+        scheduler->start(mShowBackTask);
+        checkClipboard();
+    }
+    if (mHelloTask >= 0)
+        scheduler->setInterval(mHelloTask, mHelloInterval, mHelloInterval / (idle ? HELLO_IDLE_SLACK : HELLO_SLACK));
+}
+
 void GuiBehind::receiveFileStart(QString senderIp)
 {
     // Look for the sender in the buddy list
@@ -227,12 +345,38 @@ void GuiBehind::receiveFileStart(QString senderIp)
     setCurrentTransferSending(false);
     // mView->win7()->setProgressValue(0, 100);
     // mView->win7()->setProgressState(EcWin7::Normal);
+    startProgressMeter();
 
     emit transferStart();
 }
 
 void GuiBehind::transferStatusUpdate(qint64 total, qint64 partial)
 {
+    // Rate and time left, as averaged by the meter
+    if (mProgressMeter->rate() != mCurrentTransferRate)
+    {
+        mCurrentTransferRate = mProgressMeter->rate();
+        emit currentTransferRateChanged();
+    }
+    if (mProgressMeter->eta() != mCurrentTransferEta)
+    {
+        mCurrentTransferEta = mProgressMeter->eta();
+        emit currentTransferEtaChanged();
+    }
+
+    // Unknown total size (chunked streams), show only the transferred data
+    if (total < 0)
+    {
+        if (partial < 1024)
+            setCurrentTransferStats(QString::number(partial) + " B");
+        else if (partial < 1048576)
+            setCurrentTransferStats(QString::number(partial * 1.0 / 1024, 'f', 1) + " KB");
+        else
+            setCurrentTransferStats(QString::number(partial * 1.0 / 1048576, 'f', 1) + " MB");
+        setCurrentTransferProgress(0);
+        return;
+    }
+
     // Stats formatting
     if (total < 1024)
         setCurrentTransferStats(QString::number(partial) + " B of " + QString::number(total) + " B");
@@ -287,7 +431,7 @@ void GuiBehind::receiveFileComplete(QStringList *files, qint64 totalSize) {
 void GuiBehind::receiveTextComplete(QString *text, qint64 totalSize)
 {
     // Add an entry to recent activities
-    mRecentList.addRecent(tr("Text snippet"), *text, "text", mCurrentTransferBuddy, totalSize);
+    if (text) mRecentList.addRecent(tr("Text snippet"), *text, "text", mCurrentTransferBuddy, totalSize);
 
     // Update GUI
     // mView->win7()->setProgressState(EcWin7::NoProgress);
@@ -312,6 +456,34 @@ void GuiBehind::receiveTextComplete(QString *text, qint64 totalSize)
     emit receiveCompleted();
 }
 
+// Large text, the history only refers to the file
+void GuiBehind::receiveTextFileComplete(QString path, qint64 totalSize)
+{
+    mRecentList.addRecent(tr("Text snippet"), QDir(".").absoluteFilePath(path), "textfile", mCurrentTransferBuddy, totalSize);
+    receiveTextComplete(NULL, totalSize);
+}
+
+// Start of a large text received, with where to find the rest
+void GuiBehind::showTextFile(QString path, QString sender)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        showTextSnippet(tr("The text has been moved or deleted:") + "\n" + path, sender);
+        return;
+    }
+    QByteArray data = file.read(TEXT_PREVIEW_SIZE);
+
+    // Not cut in the middle of a character
+    if (!file.atEnd())
+        while (!data.isEmpty() && ((data.at(data.size() - 1) & 0xC0) == 0x80)) data.chop(1);
+    if (!file.atEnd() && !data.isEmpty() && ((uchar) data.at(data.size() - 1) >= 0xC0)) data.chop(1);
+
+    QString text = QString::fromUtf8(data);
+    if (!file.atEnd()) text += "\n\n[...] " + tr("Full text in") + " " + path;
+    showTextSnippet(text, sender);
+}
+
 void GuiBehind::showTextSnippet(QString text, QString sender)
 {
     setTextSnippet(text);
@@ -411,7 +583,7 @@ void GuiBehind::refreshIpList()
 void GuiBehind::showSendPage(QString ip)
 {
     // Check for a buddy with the provided IP address
-    QStandardItem *buddy = mBuddiesList.buddyByIp(ip);
+    const BuddyListItemModel::Buddy *buddy = mBuddiesList.buddyByIp(ip);
     if (buddy == NULL) return;
 
     // Update exposed data for the selected user
@@ -428,10 +600,32 @@ void GuiBehind::showSendPage(QString ip)
     setTextSnippetSending(true);
     setTextSnippet("");
 
+    // Connect while the user picks what to send
+    mDestinationReachable = true;
+    emit destinationReachableChanged();
+    if (mDestBuddy->ip() != "IP")
+        mDuktoProtocol.preconnect(mDestBuddy->ip(), mDestBuddy->port());
+
     // Show send UI
     emit gotoSendPage();
 }
 
+// Files dragged over the buddy list, which has a single buddy
+void GuiBehind::prepareDrop()
+{
+    const BuddyListItemModel::Buddy *buddy = mBuddiesList.buddyByIp(mBuddiesList.fistBuddyIp());
+    if (buddy == NULL) return;
+    mDuktoProtocol.preconnect(buddy->ip, buddy->port);
+}
+
+// Result of the connection opened in advance
+void GuiBehind::peerReachable(QString ip, bool reachable)
+{
+    if ((ip != mDestBuddy->ip()) || (reachable == mDestinationReachable)) return;
+    mDestinationReachable = reachable;
+    emit destinationReachableChanged();
+}
+
 void GuiBehind::sendDroppedFiles(const QStringList &files)
 {
     if (files.isEmpty()) return;
@@ -860,6 +1054,7 @@ bool GuiBehind::prepareStartTransfer(QString *ip, qint16 *port)
     setCurrentTransferProgress(0);
     // mView->win7()->setProgressState(EcWin7::Normal);
     // mView->win7()->setProgressValue(0, 100);
+    startProgressMeter();
 
     emit transferStart();
     return true;
@@ -949,6 +1144,15 @@ void GuiBehind::sendFileError(int code)
     emit gotoMessagePage();
 }
 
+void GuiBehind::startProgressMeter()
+{
+    mCurrentTransferRate = 0;
+    mCurrentTransferEta = -1;
+    emit currentTransferRateChanged();
+    emit currentTransferEtaChanged();
+    mProgressMeter->start();
+}
+
 void GuiBehind::resetProgressStatus()
 {
 #if defined(Q_OS_WIN)
@@ -959,7 +1163,26 @@ void GuiBehind::resetProgressStatus()
 // Periodic hello sending
 void GuiBehind::periodicHello()
 {
-    mDuktoProtocol.sayHello(QHostAddress::Broadcast);
+    // New interfaces are announced as soon as they are notified,
+    // otherwise look for them here
+    if (!NetworkMonitor::instance()->isWatching()) NetworkMonitor::instance()->refresh();
+
+    // Not again if everybody has been told about us lately anyway (new
+    // network, avatar, name...)
+    qint64 since = mDuktoProtocol.sinceBroadcastHello();
+    if ((since < 0) || (since >= mHelloInterval / 2)) mDuktoProtocol.sayHello(QHostAddress::Broadcast);
+
+    // Less frequent hellos as the network grows
+    mHelloInterval = mDuktoProtocol.nextHelloInterval();
+    IdleScheduler::instance()->setInterval(mHelloTask, mHelloInterval,
+                                           mHelloInterval / (mIdle ? HELLO_IDLE_SLACK : HELLO_SLACK));
+
+    // Also saved here when changed, in case the application gets killed
+    if (mPeersDirty)
+    {
+        mSettings.savePeerCache(mDuktoProtocol.savePeers());
+        mPeersDirty = false;
+    }
 }
 
 // Show updates message
@@ -1031,6 +1254,16 @@ void GuiBehind::setCurrentTransferStats(QString stats)
     emit currentTransferStatsChanged();
 }
 
+double GuiBehind::currentTransferRate()
+{
+    return mCurrentTransferRate;
+}
+
+qint64 GuiBehind::currentTransferEta()
+{
+    return mCurrentTransferEta;
+}
+
 QString GuiBehind::textSnippetBuddy()
 {
     return mTextSnippetBuddy;
@@ -1167,6 +1400,20 @@ void GuiBehind::setShowTermsOnStart(bool show)
     emit showTermsOnStartChanged();
 }
 
+bool GuiBehind::multicastDiscovery()
+{
+    return mSettings.discoveryMode() == DuktoProtocol::MulticastDiscovery;
+}
+
+void GuiBehind::setMulticastDiscovery(bool multicast)
+{
+    if (multicast == multicastDiscovery()) return;
+    DuktoProtocol::DiscoveryMode mode = multicast ? DuktoProtocol::MulticastDiscovery : DuktoProtocol::BroadcastDiscovery;
+    mSettings.saveDiscoveryMode(mode);
+    mDuktoProtocol.setDiscoveryMode(mode);
+    emit multicastDiscoveryChanged();
+}
+
 bool GuiBehind::showUpdateBanner()
 {
     return mShowUpdateBanner;
@@ -1178,6 +1425,54 @@ void GuiBehind::setShowUpdateBanner(bool show)
     emit showUpdateBannerChanged();
 }
 
+bool GuiBehind::destinationReachable()
+{
+    return mDestinationReachable;
+}
+
+QStringList GuiBehind::sharedPaths()
+{
+    return mMiniWebServer->shares();
+}
+
+// Share mode, the paths can come from QML as file URLs
+void GuiBehind::setSharedPaths(const QStringList &paths)
+{
+    QStringList local;
+    foreach (const QString &path, paths)
+    {
+        QUrl url(path);
+        local.append(url.isLocalFile() ? url.toLocalFile() : path);
+    }
+    if (local == mMiniWebServer->shares()) return;
+    mMiniWebServer->setShares(local);
+    mSettings.saveSharedPaths(local);
+    emit sharedPathsChanged();
+}
+
+bool GuiBehind::acceptUploads()
+{
+    return mMiniWebServer->uploads();
+}
+
+void GuiBehind::setAcceptUploads(bool accept)
+{
+    if (accept == acceptUploads()) return;
+    mMiniWebServer->setUploads(accept);
+    mSettings.saveAcceptUploads(accept);
+    emit acceptUploadsChanged();
+}
+
+// Files sent from a browser, in the current folder like the transfers
+void GuiBehind::uploadComplete(const QStringList &files, qint64 size, const QString &from)
+{
+    QDir d(".");
+    if (files.size() == 1)
+        mRecentList.addRecent(files.at(0), d.absoluteFilePath(files.at(0)), "file", from, size);
+    else if (files.size() > 1)
+        mRecentList.addRecent(tr("Files and folders"), d.absolutePath(), "misc", from, size);
+}
+
 void GuiBehind::setBuddyName(QString name)
 {
     qDebug() << "Buddy name is:  " << name;
@@ -1313,6 +1608,7 @@ bool GuiBehind::canAcceptDrop()
 
 void GuiBehind::close()
 {
+    mSettings.savePeerCache(mDuktoProtocol.savePeers());
     mDuktoProtocol.sayGoodbye();
 }
 
@@ -18,6 +18,7 @@
 #include "settings.h"
 #include "miniwebserver.h"
 #include "updateschecker.h"
+#include "progressmeter.h"
 
 class MiniWebServer;
 class QNetworkAccessManager;
@@ -30,6 +31,8 @@ class GuiBehind : public QObject
     Q_PROPERTY(int currentTransferProgress READ currentTransferProgress NOTIFY currentTransferProgressChanged)
     Q_PROPERTY(QString currentTransferStats READ currentTransferStats NOTIFY currentTransferStatsChanged)
     Q_PROPERTY(bool currentTransferSending READ currentTransferSending NOTIFY currentTransferSendingChanged)
+    Q_PROPERTY(double currentTransferRate READ currentTransferRate NOTIFY currentTransferRateChanged)
+    Q_PROPERTY(qint64 currentTransferEta READ currentTransferEta NOTIFY currentTransferEtaChanged)
     Q_PROPERTY(QString currentPath READ currentPath WRITE setCurrentPath NOTIFY currentPathChanged FINAL)
     Q_PROPERTY(QString overlayState READ overlayState WRITE setOverlayState NOTIFY overlayStateChanged FINAL)
     Q_PROPERTY(QString buddyName READ buddyName WRITE setBuddyName NOTIFY buddyNameChanged FINAL)
@@ -42,6 +45,10 @@ class GuiBehind : public QObject
     Q_PROPERTY(QString messagePageText READ messagePageText WRITE setMessagePageText NOTIFY messagePageTextChanged)
     Q_PROPERTY(QString messagePageTitle READ messagePageTitle WRITE setMessagePageTitle NOTIFY messagePageTitleChanged)
     Q_PROPERTY(bool showTermsOnStart READ showTermsOnStart WRITE setShowTermsOnStart NOTIFY showTermsOnStartChanged)
+    Q_PROPERTY(bool multicastDiscovery READ multicastDiscovery WRITE setMulticastDiscovery NOTIFY multicastDiscoveryChanged)
+    Q_PROPERTY(QStringList sharedPaths READ sharedPaths WRITE setSharedPaths NOTIFY sharedPathsChanged)
+    Q_PROPERTY(bool acceptUploads READ acceptUploads WRITE setAcceptUploads NOTIFY acceptUploadsChanged)
+    Q_PROPERTY(bool destinationReachable READ destinationReachable NOTIFY destinationReachableChanged)
     Q_PROPERTY(bool showUpdateBanner READ showUpdateBanner WRITE setShowUpdateBanner NOTIFY showUpdateBannerChanged)
     Q_PROPERTY(bool clipboardTextAvailable READ clipboardTextAvailable NOTIFY clipboardTextAvailableChanged)
     Q_PROPERTY(QString appVersion READ appVersion CONSTANT)
@@ -63,6 +70,8 @@ public:
     void setCurrentTransferProgress(int value);
     QString currentTransferStats();
     void setCurrentTransferStats(QString stats);
+    double currentTransferRate();
+    qint64 currentTransferEta();
     QString textSnippetBuddy();
     void setTextSnippetBuddy(QString buddy);
     QString textSnippet();
@@ -88,8 +97,15 @@ public:
     void setMessagePageBackState(QString state);
     bool showTermsOnStart();
     void setShowTermsOnStart(bool show);
+    bool multicastDiscovery();
+    void setMulticastDiscovery(bool multicast);
     bool showUpdateBanner();
     void setShowUpdateBanner(bool show);
+    bool destinationReachable();
+    QStringList sharedPaths();
+    void setSharedPaths(const QStringList &paths);
+    bool acceptUploads();
+    void setAcceptUploads(bool accept);
     //    void setBuddyName(QString name);
 
 
@@ -112,6 +128,8 @@ signals:
     void currentTransferBuddyChanged();
     void currentTransferProgressChanged();
     void currentTransferStatsChanged();
+    void currentTransferRateChanged();
+    void currentTransferEtaChanged();
     void currentTransferSendingChanged();
     void textSnippetBuddyChanged();
     void textSnippetChanged();
@@ -125,7 +143,11 @@ signals:
     void messagePageTitleChanged();
     void messagePageBackStateChanged();
     void showTermsOnStartChanged();
+    void multicastDiscoveryChanged();
     void showUpdateBannerChanged();
+    void destinationReachableChanged();
+    void sharedPathsChanged();
+    void acceptUploadsChanged();
     void buddyNameChanged();
 
     // Received by QML
@@ -142,31 +164,43 @@ public slots:
 
     void showRandomBack();
     void clipboardChanged();
+    void checkClipboard();
     void remoteDestinationAddressHandler();
     void periodicHello();
     void showUpdatesMessage();
     void sendScreenStage2();
+    void deferredInit();
+    void setIdle(bool idle);
 
     // Called by Dukto protocol
     void peerListAdded(Peer peer);
+    void peerListChanged(Peer peer);
     void peerListRemoved(Peer peer);
     void receiveFileStart(QString senderIp);
     void transferStatusUpdate(qint64 total, qint64 partial);
     void receiveFileComplete(QStringList *files, qint64 totalSize);
     void receiveTextComplete(QString *text, qint64 totalSize);
+    void receiveTextFileComplete(QString path, qint64 totalSize);
     void sendFileComplete();
     void sendFileError(int code);
     void receiveFileCancelled();
     void sendFileAborted();
+    void peerReachable(QString ip, bool reachable);
+
+    // Called by the web server
+    void avatarReady();
+    void uploadComplete(const QStringList &files, qint64 size, const QString &from);
 
     // Called by QML
     void close();
     void openDestinationFolder();
     void refreshIpList();
     void showTextSnippet(QString text, QString sender);
+    void showTextFile(QString path, QString sender);
     void openFile(QString path);
     void changeDestinationFolder(QString dirpath);
     void showSendPage(QString ip);
+    void prepareDrop();
     void sendSomeFiles(const QStringList &files);
     void sendAllFiles(const QStringList &files);
     void sendClipboardText();
@@ -189,8 +223,13 @@ private:
     GuiBehind(const GuiBehind&) = delete; // Delete copy constructor
     GuiBehind& operator=(const GuiBehind&) = delete; // Delete assignment operator
 
-    QTimer *mShowBackTimer;
-    QTimer *mPeriodicHelloTimer;
+    int mShowBackTask;              // Periodic work, in the IdleScheduler
+    int mHelloTask;
+    int mClipboardTask;
+    int mHelloInterval;
+    bool mIdle;                     // Window hidden or minimized
+    bool mClipboardDirty;           // Changed while idle
+    bool mPeersDirty;               // Peer list changed since the cache was saved
     QClipboard *mClipboard;
     MiniWebServer *mMiniWebServer;
     Settings mSettings;
@@ -201,10 +240,13 @@ private:
     DuktoProtocol mDuktoProtocol;
     Theme mTheme;
     UpdatesChecker *mUpdatesChecker;
+    ProgressMeter *mProgressMeter;
 
     int mCurrentTransferProgress;
     QString mCurrentTransferBuddy;
     QString mCurrentTransferStats;
+    double mCurrentTransferRate;
+    qint64 mCurrentTransferEta;
     bool mCurrentTransferSending;
     QString mTextSnippetBuddy;
     QString mTextSnippet;
@@ -216,9 +258,12 @@ private:
     QString mMessagePageTitle;
     QString mMessagePageBackState;
     bool mShowUpdateBanner;
+    bool mDestinationReachable;
+    bool mDeferredInitDone;
     QString mScreenTempPath;
 
     bool prepareStartTransfer(QString *ip, qint16 *port);
+    void startProgressMeter();
     void startTransfer(QStringList files);
     void startTransfer(QString text);
 
@@ -0,0 +1,340 @@
+#include "historylog.h"
+
+#include <QDir>
+#include <QtEndian>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <io.h>
+#else
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+#define HEADER_SIZE 8           // Magic and version
+#define INDEX_ENTRY_SIZE 16     // Offset (8), sender hash (4), kind (1), reserved (3)
+#define RECORD_FIXED_SIZE 17    // Time (8), size (8), kind (1), then the strings
+#define VERSION 1
+
+HistoryLog::HistoryLog() :
+    mLogSize(0), mCount(0), mLogMap(NULL), mLogMapped(0), mIndexMap(NULL), mIndexMapped(0)
+{
+}
+
+HistoryLog::~HistoryLog()
+{
+    close();
+}
+
+bool HistoryLog::open(const QString &folder)
+{
+    close();
+    mFolder = folder;
+    QDir().mkpath(folder);
+    mLog.setFileName(folder + "/history.log");
+    mIndex.setFileName(folder + "/history.idx");
+    if (!mLog.open(QIODevice::ReadWrite) || !mIndex.open(QIODevice::ReadWrite))
+    {
+        close();
+        return false;
+    }
+
+    // Not a log of ours (or another version), started over
+    if (!ensureHeader(mLog, "DKHL"))
+    {
+        mLog.resize(0);
+        mIndex.resize(0);
+        if (!ensureHeader(mLog, "DKHL"))
+        {
+            close();
+            return false;
+        }
+    }
+    if (!ensureHeader(mIndex, "DKHI")) mIndex.resize(0);
+    ensureHeader(mIndex, "DKHI");
+    mLogSize = mLog.size();
+
+    // Index behind the log: the records missing are indexed again
+    if (!checkIndex())
+    {
+        unmap();
+        mIndex.resize(HEADER_SIZE);
+        mCount = 0;
+    }
+    quint64 end = HEADER_SIZE;
+    if (mCount > 0)
+    {
+        quint32 length;
+        record(offsetAt(mCount - 1), &length);
+        end = offsetAt(mCount - 1) + 4 + length;
+    }
+    scan(end);
+    return true;
+}
+
+void HistoryLog::close()
+{
+    unmap();
+    mLog.close();
+    mIndex.close();
+    mLogSize = 0;
+    mCount = 0;
+}
+
+// Before a file is resized (which some systems refuse while it's mapped)
+void HistoryLog::unmap() const
+{
+    if (mLogMap) mLog.unmap(mLogMap);
+    if (mIndexMap) mIndex.unmap(mIndexMap);
+    mLogMap = mIndexMap = NULL;
+    mLogMapped = mIndexMapped = 0;
+}
+
+bool HistoryLog::ensureHeader(QFile &file, const char *magic)
+{
+    uchar header[HEADER_SIZE];
+    memcpy(header, magic, 4);
+    qToLittleEndian<quint32>(VERSION, header + 4);
+    if (file.size() == 0)
+        return (file.write((const char*) header, HEADER_SIZE) == HEADER_SIZE) && file.flush();
+    file.seek(0);
+    return (file.size() >= HEADER_SIZE) && (file.read(HEADER_SIZE) == QByteArray((const char*) header, HEADER_SIZE));
+}
+
+// Maps the whole file again when needed bytes aren't mapped yet
+bool HistoryLog::mapped(QFile &file, uchar *&map, qint64 &mappedSize, qint64 needed)
+{
+    if (needed <= mappedSize) return true;
+    if (map) file.unmap(map);
+    mappedSize = file.size();
+    map = (mappedSize > 0) ? file.map(0, mappedSize) : NULL;
+    if (!map) mappedSize = 0;
+    return map && (needed <= mappedSize);
+}
+
+const uchar* HistoryLog::indexEntry(int i) const
+{
+    qint64 at = HEADER_SIZE + (qint64) i * INDEX_ENTRY_SIZE;
+    if (!mapped(mIndex, mIndexMap, mIndexMapped, at + INDEX_ENTRY_SIZE)) return NULL;
+    return mIndexMap + at;
+}
+
+quint64 HistoryLog::offsetAt(int i) const
+{
+    const uchar *p = indexEntry(i);
+    return p ? qFromLittleEndian<quint64>(p) : 0;
+}
+
+HistoryLog::Kind HistoryLog::kindAt(int i) const
+{
+    const uchar *p = indexEntry(i);
+    return p ? static_cast<Kind>(p[12]) : Misc;
+}
+
+quint32 HistoryLog::senderHashAt(int i) const
+{
+    const uchar *p = indexEntry(i);
+    return p ? qFromLittleEndian<quint32>(p + 8) : 0;
+}
+
+// FNV-1a of the UTF-8 name, the same on every run and platform
+quint32 HistoryLog::senderHash(const QString &sender)
+{
+    QByteArray data = sender.toUtf8();
+    quint32 hash = 2166136261u;
+    for (int i = 0; i < data.size(); i++)
+        hash = (hash ^ (uchar) data.at(i)) * 16777619u;
+    return hash;
+}
+
+// Record at offset of the log, NULL if it isn't all there
+const uchar* HistoryLog::record(quint64 offset, quint32 *length) const
+{
+    if ((offset < HEADER_SIZE) || ((qint64) offset + 4 > mLogSize)) return NULL;
+    if (!mapped(mLog, mLogMap, mLogMapped, offset + 4)) return NULL;
+    *length = qFromLittleEndian<quint32>(mLogMap + offset);
+    if ((qint64) (offset + 4 + *length) > mLogSize) return NULL;
+    if (!mapped(mLog, mLogMap, mLogMapped, offset + 4 + *length)) return NULL;
+    return mLogMap + offset + 4;
+}
+
+bool HistoryLog::decode(const uchar *data, quint32 length, Entry *entry) const
+{
+    if (length < RECORD_FIXED_SIZE) return false;
+    entry->time = qFromLittleEndian<qint64>(data);
+    entry->size = qFromLittleEndian<qint64>(data + 8);
+    entry->kind = static_cast<Kind>(data[16]);
+    quint32 at = RECORD_FIXED_SIZE;
+    QString *fields[] = { &entry->name, &entry->value, &entry->sender };
+    for (QString *field : fields)
+    {
+        if (length - at < 4) return false;
+        quint32 n = qFromLittleEndian<quint32>(data + at);
+        at += 4;
+        if (length - at < n) return false;
+        *field = QString::fromUtf8((const char*) data + at, n);
+        at += n;
+    }
+    return true;
+}
+
+HistoryLog::Entry HistoryLog::entry(int i) const
+{
+    Entry e = { 0, 0, Misc, QString(), QString(), QString() };
+    if ((i < 0) || (i >= mCount)) return e;
+    quint32 length;
+    const uchar *data = record(offsetAt(i), &length);
+    if (data) decode(data, length, &e);
+    return e;
+}
+
+// Cheap checks: offsets of the first and last entries, last record complete
+bool HistoryLog::checkIndex()
+{
+    qint64 size = mIndex.size() - HEADER_SIZE;
+    mCount = (size < 0) ? 0 : size / INDEX_ENTRY_SIZE;
+    if (size % INDEX_ENTRY_SIZE) mIndex.resize(HEADER_SIZE + (qint64) mCount * INDEX_ENTRY_SIZE);
+    if (mCount == 0) return true;
+    if (offsetAt(0) != HEADER_SIZE) return false;
+    quint32 length;
+    return record(offsetAt(mCount - 1), &length) != NULL;
+}
+
+// Indexes the records from the offset on, cuts a torn one at the end
+void HistoryLog::scan(quint64 from)
+{
+    quint64 offset = from;
+    forever
+    {
+        quint32 length;
+        const uchar *data = record(offset, &length);
+        Entry e;
+        if (!data || !decode(data, length, &e)) break;
+        if (!writeIndexEntry(offset, e)) break;
+        offset += 4 + length;
+    }
+    if ((qint64) offset < mLogSize)
+    {
+        unmap();
+        mLog.resize(offset);
+        mLogSize = offset;
+    }
+    mIndex.flush();
+}
+
+bool HistoryLog::writeIndexEntry(quint64 offset, const Entry &entry)
+{
+    uchar data[INDEX_ENTRY_SIZE];
+    memset(data, 0, INDEX_ENTRY_SIZE);
+    qToLittleEndian<quint64>(offset, data);
+    qToLittleEndian<quint32>(senderHash(entry.sender), data + 8);
+    data[12] = entry.kind;
+    mIndex.seek(HEADER_SIZE + (qint64) mCount * INDEX_ENTRY_SIZE);
+    if (mIndex.write((const char*) data, INDEX_ENTRY_SIZE) != INDEX_ENTRY_SIZE) return false;
+    mCount++;
+    return true;
+}
+
+bool HistoryLog::append(const Entry &entry)
+{
+    if (!mLog.isOpen()) return false;
+
+    QByteArray fields[] = { entry.name.toUtf8(), entry.value.toUtf8(), entry.sender.toUtf8() };
+    QByteArray data(4 + RECORD_FIXED_SIZE, Qt::Uninitialized);
+    qToLittleEndian<qint64>(entry.time, data.data() + 4);
+    qToLittleEndian<qint64>(entry.size, data.data() + 12);
+    data[20] = (char) entry.kind;
+    for (const QByteArray &field : fields)
+    {
+        uchar n[4];
+        qToLittleEndian<quint32>(field.size(), n);
+        data.append((const char*) n, 4);
+        data.append(field);
+    }
+    qToLittleEndian<quint32>(data.size() - 4, data.data());
+
+    if ((mCount >= MAX_ENTRIES) || (mLogSize + data.size() > MAX_SIZE))
+    {
+        compact();
+        if (!mLog.isOpen()) return false;
+    }
+
+    // Log first, the index is rebuilt from it if a crash comes in between
+    mLog.seek(mLogSize);
+    if ((mLog.write(data) != data.size()) || !mLog.flush())
+    {
+        unmap();
+        mLog.resize(mLogSize);
+        return false;
+    }
+    quint64 offset = mLogSize;
+    mLogSize += data.size();
+    bool ok = writeIndexEntry(offset, entry);
+    mIndex.flush();
+    return ok;
+}
+
+// On the disk before it's renamed over the current file
+static bool syncFile(QFile &file)
+{
+    if (!file.flush()) return false;
+#if defined(Q_OS_WIN)
+    return FlushFileBuffers((HANDLE) _get_osfhandle(file.handle()));
+#else
+    return ::fsync(file.handle()) == 0;
+#endif
+}
+
+// Atomic: after a crash either the old file or the new one is there
+static bool replaceFile(const QString &from, const QString &to)
+{
+#if defined(Q_OS_WIN)
+    return MoveFileExW((LPCWSTR) QDir::toNativeSeparators(from).utf16(), (LPCWSTR) QDir::toNativeSeparators(to).utf16(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    return ::rename(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0;
+#endif
+}
+
+// Keeps the newest three quarters (of the entries and of the bytes),
+// written as new files which replace the current ones
+bool HistoryLog::compact()
+{
+    int first = qMax(0, mCount - MAX_ENTRIES / 4 * 3);
+    while ((first < mCount - 1) && (mLogSize - (qint64) offsetAt(first) > MAX_SIZE / 4 * 3)) first++;
+    if ((first == 0) || !mapped(mLog, mLogMap, mLogMapped, mLogSize)) return false;
+
+    quint64 start = offsetAt(first);
+    qint64 shift = start - HEADER_SIZE;
+    QFile log(mFolder + "/history.log.new");
+    QFile index(mFolder + "/history.idx.new");
+    bool ok = log.open(QIODevice::WriteOnly | QIODevice::Truncate) && index.open(QIODevice::WriteOnly | QIODevice::Truncate)
+              && ensureHeader(log, "DKHL") && ensureHeader(index, "DKHI");
+    if (ok) ok = (log.write((const char*) mLogMap + start, mLogSize - start) == mLogSize - (qint64) start);
+    for (int i = first; ok && (i < mCount); i++)
+    {
+        uchar data[INDEX_ENTRY_SIZE];
+        memcpy(data, indexEntry(i), INDEX_ENTRY_SIZE);
+        qToLittleEndian<quint64>(offsetAt(i) - shift, data);
+        ok = (index.write((const char*) data, INDEX_ENTRY_SIZE) == INDEX_ENTRY_SIZE);
+    }
+    ok = ok && syncFile(log) && syncFile(index);
+    log.close();
+    index.close();
+    if (!ok)
+    {
+        log.remove();
+        index.remove();
+        return false;
+    }
+
+    // Each file replaced at once, the index last: an old one left by a
+    // crash in between is found stale and rebuilt
+    QString folder = mFolder;
+    close();
+    if (replaceFile(folder + "/history.log.new", folder + "/history.log"))
+        replaceFile(folder + "/history.idx.new", folder + "/history.idx");
+    QFile::remove(folder + "/history.log.new");
+    QFile::remove(folder + "/history.idx.new");
+    return open(folder);
+}
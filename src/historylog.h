@@ -0,0 +1,86 @@
+#ifndef HISTORYLOG_H
+#define HISTORYLOG_H
+
+#include <QFile>
+#include <QString>
+
+// Transfers received, kept across sessions in two append-only files of a
+// folder:
+//
+//   history.log    records, one per transfer (time, size, kind, name,
+//                  value, sender), variable size
+//   history.idx    16 bytes per record: its offset in the log, the hash
+//                  of its sender and its kind, so that a record is found
+//                  (and a filter applied) without reading the log
+//
+// Both are memory-mapped, only the records read are paged in. The index
+// is checked at open and rebuilt from the log where it's behind (a crash
+// between the two writes), a torn record at the end of the log is cut.
+// Past MAX_ENTRIES or MAX_SIZE, the oldest quarter is dropped.
+class HistoryLog
+{
+public:
+    static const int MAX_ENTRIES = 1000000;
+    static const qint64 MAX_SIZE = 268435456;   // Bytes of the log
+
+    enum Kind {
+        Text,
+        File,
+        Misc,
+        TextFile        // Text received into a file, the value is its path
+    };
+
+    struct Entry {
+        qint64 time;        // ms since the epoch
+        qint64 size;
+        Kind kind;
+        QString name;
+        QString value;
+        QString sender;
+    };
+
+    HistoryLog();
+    ~HistoryLog();
+
+    bool open(const QString &folder);
+    void close();
+    inline int count() const { return mCount; }
+
+    bool append(const Entry &entry);
+    Entry entry(int i) const;
+
+    // From the index only
+    Kind kindAt(int i) const;
+    quint32 senderHashAt(int i) const;
+    static quint32 senderHash(const QString &sender);
+
+private:
+    HistoryLog(const HistoryLog&) = delete;
+    HistoryLog& operator=(const HistoryLog&) = delete;
+
+    const uchar* indexEntry(int i) const;
+    quint64 offsetAt(int i) const;
+    const uchar* record(quint64 offset, quint32 *length) const;
+    bool decode(const uchar *data, quint32 length, Entry *entry) const;
+    bool checkIndex();
+    void scan(quint64 from);
+    bool writeIndexEntry(quint64 offset, const Entry &entry);
+    bool compact();
+    void unmap() const;
+    static bool ensureHeader(QFile &file, const char *magic);
+    static bool mapped(QFile &file, uchar *&map, qint64 &mappedSize, qint64 needed);
+
+    QString mFolder;
+    mutable QFile mLog;
+    mutable QFile mIndex;
+    qint64 mLogSize;
+    int mCount;
+
+    // Remapped when a read goes past what's mapped (the files grew)
+    mutable uchar *mLogMap;
+    mutable qint64 mLogMapped;
+    mutable uchar *mIndexMap;
+    mutable qint64 mIndexMapped;
+};
+
+#endif // HISTORYLOG_H
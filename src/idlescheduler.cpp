@@ -0,0 +1,107 @@
+#include "idlescheduler.h"
+
+#include <QCoreApplication>
+
+IdleScheduler* IdleScheduler::instance()
+{
+    // Owned by the application, so that it goes away with the event loop
+    static IdleScheduler *instance = new IdleScheduler(QCoreApplication::instance());
+    return instance;
+}
+
+IdleScheduler::IdleScheduler(QObject *parent) :
+    QObject(parent), mWakeups(0), mRuns(0)
+{
+    mClock.start();
+    mTimer.setSingleShot(true);
+    mTimer.setTimerType(Qt::CoarseTimer);
+    connect(&mTimer, SIGNAL(timeout()), this, SLOT(timeout()));
+}
+
+int IdleScheduler::add(QObject *receiver, const char *member, int interval, int slack)
+{
+    // SLOT(name()) is "1name()", only the name is needed to invoke it
+    QByteArray name(member);
+    if (!name.isEmpty() && (name.at(0) >= '0') && (name.at(0) <= '9')) name.remove(0, 1);
+    qsizetype paren = name.indexOf('(');
+    if (paren >= 0) name.truncate(paren);
+
+    Task t;
+    t.receiver = receiver;
+    t.member = name;
+    t.interval = qMax(1, interval);
+    t.slack = qBound(0, slack, t.interval - 1);
+    t.due = -1;
+    mTasks.append(t);
+    return mTasks.size() - 1;
+}
+
+void IdleScheduler::setInterval(int task, int interval, int slack)
+{
+    Task &t = mTasks[task];
+    qint64 last = t.due - t.interval;
+    t.interval = qMax(1, interval);
+    t.slack = qBound(0, slack, t.interval - 1);
+
+    // Still counted from the previous run
+    if (t.due >= 0)
+    {
+        t.due = last + t.interval;
+        arm();
+    }
+}
+
+void IdleScheduler::start(int task)
+{
+    mTasks[task].due = mClock.elapsed() + mTasks.at(task).interval;
+    arm();
+}
+
+void IdleScheduler::stop(int task)
+{
+    mTasks[task].due = -1;
+    arm();
+}
+
+bool IdleScheduler::isActive(int task) const
+{
+    return mTasks.at(task).due >= 0;
+}
+
+// Timer set for the nearest deadline, stopped without active tasks
+void IdleScheduler::arm()
+{
+    qint64 next = -1;
+    foreach (const Task &t, mTasks)
+        if ((t.due >= 0) && ((next < 0) || (t.due < next))) next = t.due;
+
+    if (next < 0)
+        mTimer.stop();
+    else
+        mTimer.start(qMax<qint64>(0, next - mClock.elapsed()));
+}
+
+// Every task within its window runs now, the others wait for a later wakeup
+void IdleScheduler::timeout()
+{
+    mWakeups++;
+    qint64 now = mClock.elapsed();
+
+    // Tasks may start or stop tasks, or add new ones
+    for (int i = 0; i < mTasks.size(); i++)
+    {
+        Task &t = mTasks[i];
+        if ((t.due < 0) || (t.due - t.slack > now)) continue;
+        if (!t.receiver)
+        {
+            t.due = -1;
+            continue;
+        }
+        t.due = now + t.interval;
+        QObject *receiver = t.receiver;
+        QByteArray member = t.member;
+        mRuns++;
+        QMetaObject::invokeMethod(receiver, member.constData(), Qt::DirectConnection);
+    }
+    arm();
+}
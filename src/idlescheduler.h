@@ -0,0 +1,58 @@
+#ifndef IDLESCHEDULER_H
+#define IDLESCHEDULER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QList>
+
+// Periodic work of the application on a single timer, to keep the
+// process from waking up for each task on its own. A task runs between
+// interval - slack and interval ms after its previous run: the timer is
+// set for the earliest deadline, and every task already in its window at
+// that point runs on the same wakeup. Used from the GUI thread only.
+class IdleScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    static IdleScheduler* instance();
+
+    // Slot (SLOT() name) of the receiver to call, returns the id of the
+    // task, stopped until start()
+    int add(QObject *receiver, const char *member, int interval, int slack);
+    void setInterval(int task, int interval, int slack);
+
+    // Counted from now
+    void start(int task);
+    void stop(int task);
+    bool isActive(int task) const;
+
+    // Times the timer fired, and tasks run
+    inline qint64 wakeups() const { return mWakeups; }
+    inline qint64 runs() const { return mRuns; }
+
+private slots:
+    void timeout();
+
+private:
+    explicit IdleScheduler(QObject *parent = NULL);
+    void arm();
+
+    struct Task {
+        QPointer<QObject> receiver;
+        QByteArray member;      // Normalized slot name
+        int interval;
+        int slack;
+        qint64 due;             // ms from mClock, -1 if stopped
+    };
+
+    QList<Task> mTasks;
+    QTimer mTimer;
+    QElapsedTimer mClock;
+    qint64 mWakeups;
+    qint64 mRuns;
+};
+
+#endif // IDLESCHEDULER_H
@@ -1,7 +1,8 @@
 #include "ipaddressitemmodel.h"
 
 #include <QHostAddress>
-#include <QNetworkInterface>
+
+#include "networkmonitor.h"
 
 IpAddressItemModel::IpAddressItemModel() :
     QStandardItemModel(NULL)
@@ -9,8 +10,18 @@ IpAddressItemModel::IpAddressItemModel() :
     QHash<int, QByteArray> roleNames;
     roleNames[Ip] = "ip";
     setItemRoleNames(roleNames);
+}
 
-    refreshIpList();
+// Not in the constructor, the list is only needed once the window shows up
+void IpAddressItemModel::populate()
+{
+    // Addresses of the active, non-loopback interfaces, kept up to date
+    NetworkMonitor *monitor = NetworkMonitor::instance();
+    const QList<QHostAddress> &addresses = monitor->localAddresses();
+    for (int i = 0; i < addresses.size(); i++)
+        addIp(addresses.at(i).toString());
+    connect(monitor, &NetworkMonitor::localAddressAdded, this, [this](QHostAddress ip) { addIp(ip.toString()); });
+    connect(monitor, &NetworkMonitor::localAddressRemoved, this, [this](QHostAddress ip) { removeIp(ip.toString()); });
 }
 
 void IpAddressItemModel::addIp(QString ip)
@@ -20,37 +31,17 @@ void IpAddressItemModel::addIp(QString ip)
     appendRow(it);
 }
 
-void IpAddressItemModel::refreshIpList()
+void IpAddressItemModel::removeIp(QString ip)
 {
-    // Clear current IP list
-    clear();
-
-    // Get all network interfaces
-    QList<QNetworkInterface> interfaces = QNetworkInterface::allInterfaces();
-
-    // Iterate over each network interface
-    for (const QNetworkInterface &interface : interfaces)
-    {
-        // Skip inactive or loopback interfaces
-        if (!(interface.flags() & QNetworkInterface::IsUp) ||
-            !(interface.flags() & QNetworkInterface::IsRunning) ||
-            (interface.flags() & QNetworkInterface::IsLoopBack))
-        {
-            continue;
-        }
-
-        // Get the list of IP addresses for the interface
-        QList<QNetworkAddressEntry> entries = interface.addressEntries();
-        for (const QNetworkAddressEntry &entry : entries)
-        {
-            QHostAddress ip = entry.ip();
-            // Add only IPv4 addresses that are not localhost
-            if (ip.protocol() == QAbstractSocket::IPv4Protocol &&
-                ip.toString() != "127.0.0.1")
-            {
-                addIp(ip.toString());
-            }
-        }
-    }
+    for (int i = rowCount() - 1; i >= 0; i--)
+        if (item(i)->data(IpAddressItemModel::Ip).toString() == ip)
+            removeRow(i);
 }
 
+void IpAddressItemModel::refreshIpList()
+{
+    // Changes are applied as they are notified, only check again
+    // where the system doesn't notify them
+    NetworkMonitor *monitor = NetworkMonitor::instance();
+    if (!monitor->isWatching()) monitor->refresh();
+}
@@ -2,11 +2,13 @@
 #define IPADDRESSITEMMODEL_H
 
 #include <QStandardItemModel>
+#include <QHostAddress>
 
 class IpAddressItemModel : public QStandardItemModel
 {
 public:
     IpAddressItemModel();
+    void populate();
     void refreshIpList();
 
     enum IpRoles {
@@ -15,6 +17,7 @@ public:
 
 private:
     void addIp(QString ip);
+    void removeIp(QString ip);
 };
 
 #endif // IPADDRESSITEMMODEL_H
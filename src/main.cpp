@@ -2,11 +2,18 @@
 #include <QQmlApplicationEngine>
 #include <QIcon>
 #include <QFile>
+#include <QQuickWindow>
+#include <QTimer>
 
 #include "guibehind.h"
+#include "startuptrace.h"
+#include "wakeupstats.h"
 
 int main(int argc, char *argv[])
 {
+    StartupTrace::start(argc, argv);
+    WakeupStats::start(argc, argv);
+
 #if defined(Q_OS_WIN) || defined(Q_OS_UNIX)
     QApplication app(argc, argv); // Use QApplication for desktop
 #else
@@ -18,6 +25,9 @@ int main(int argc, char *argv[])
     QCoreApplication::setOrganizationDomain("com.dukto");
     QCoreApplication::setApplicationVersion(APP_VERSION); // Set version from CMake
 
+    WakeupStats::install();
+    StartupTrace::mark("application");
+
     QIcon icon(":/src/assets/dukto.png"); // Set the app icon
     app.setWindowIcon(icon);
 
@@ -26,9 +36,33 @@ int main(int argc, char *argv[])
     // qDebug() << "FileUtils exists?" << QFile::exists(":/src/libs/FileUtils.java");
 
     // Use the singleton instance of GuiBehind
-    GuiBehind::instance(engine);
+    GuiBehind &gui = GuiBehind::instance(engine);
+    StartupTrace::mark("gui behind");
 
     engine.loadFromModule("dukto6", "Main");
+    StartupTrace::mark("qml loaded");
+
+    // What isn't needed to show the window waits for its first frame
+    QQuickWindow *window = qobject_cast<QQuickWindow*>(engine.rootObjects().value(0));
+    if (window)
+    {
+        QObject::connect(window, &QQuickWindow::frameSwapped, &gui, [&gui]() {
+            StartupTrace::firstFrame();
+            gui.deferredInit();
+        }, static_cast<Qt::ConnectionType>(Qt::QueuedConnection | Qt::SingleShotConnection));
+
+        // Not forever though: a window never exposed (or a platform without
+        // frames) would leave discovery and the rest undone
+        QTimer::singleShot(5000, &gui, &GuiBehind::deferredInit);
+    }
+    else
+        QTimer::singleShot(0, &gui, &GuiBehind::deferredInit);
+
+    // Less work while nobody can see the window
+    if (window)
+        QObject::connect(window, &QWindow::visibilityChanged, &gui, [&gui](QWindow::Visibility visibility) {
+            gui.setIdle((visibility == QWindow::Hidden) || (visibility == QWindow::Minimized));
+        });
 
     return app.exec();
 }
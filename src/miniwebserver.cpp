@@ -3,67 +3,689 @@
 #include <QTcpSocket>
 #include <QStringList>
 #include <QDateTime>
+#include <QTimeZone>
+#include <QLocale>
 #include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QUrl>
+#include <QMimeDatabase>
+#include <QStorageInfo>
 #include <QImage>
 #include <QBuffer>
-#include <QRegularExpression>
+#include <QCryptographicHash>
+#include <QCoreApplication>
+#include <QThreadPool>
+#include <QPointer>
 
 #include "platform.h"
+#include "bufferpool.h"
+#include "sharestream.h"
+#include "uploadreceiver.h"
 
-MiniWebServer::MiniWebServer(int port)
+#define HTTP_DATE_FORMAT "ddd, dd MMM yyyy hh:mm:ss 'GMT'"
+
+static QByteArray httpDate(const QDateTime &date)
 {
-    // Load and convert avatar image
-    QString path = Platform::getAvatarPath();
-    if (path != "")
-    {
-        QImage img(path);
-        QImage scaled = img.scaled(64, 64, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-        QBuffer tmp(&mAvatarData);
-        tmp.open(QIODevice::WriteOnly);
-        scaled.save(&tmp, "PNG");
+    return QLocale::c().toString(date.toUTC(), HTTP_DATE_FORMAT).toLatin1();
+}
+
+static QDateTime parseHttpDate(const QByteArray &value)
+{
+    QDateTime date = QLocale::c().toDateTime(QString::fromLatin1(value), HTTP_DATE_FORMAT);
+    date.setTimeZone(QTimeZone::utc());
+    return date;
+}
+
+// Single range of a Range header: 1 if valid, -1 if outside of the file,
+// 0 if not understood (multiple ranges...), the whole file is sent then
+static int parseRange(const QByteArray &value, qint64 size, qint64 *offset, qint64 *length)
+{
+    if (!value.startsWith("bytes=") || value.contains(',')) return 0;
+    QByteArray spec = value.mid(6).trimmed();
+    qsizetype dash = spec.indexOf('-');
+    if (dash < 0) return 0;
+    QByteArray a = spec.left(dash).trimmed();
+    QByteArray b = spec.mid(dash + 1).trimmed();
 
-        // Start server
-        listen(QHostAddress::Any, port);
+    bool ok;
+    qint64 first, last;
+    if (a.isEmpty())
+    {
+        // Last n bytes
+        qint64 n = b.toLongLong(&ok);
+        if (!ok) return 0;
+        if ((n <= 0) || (size == 0)) return -1;
+        first = qMax<qint64>(0, size - n);
+        last = size - 1;
+    }
+    else
+    {
+        first = a.toLongLong(&ok);
+        if (!ok) return 0;
+        last = size - 1;
+        if (!b.isEmpty())
+        {
+            last = b.toLongLong(&ok);
+            if (!ok || (last < first)) return 0;
+        }
+        if (first >= size) return -1;
+        last = qMin(last, size - 1);
     }
+
+    *offset = first;
+    *length = last - first + 1;
+    return 1;
+}
+
+MiniWebServer::MiniWebServer(int port) :
+    mPort(port), mUploads(false)
+{
+    // Responses, built once (the avatar ones when it's loaded)
+    mNotFoundResponse = serialize("404 Not Found", QByteArray(), QByteArray());
+    mBadRequestResponse = serialize("400 Bad Request", QByteArray(), QByteArray());
+    mUnavailableResponse = serialize("503 Service Unavailable", "Retry-After: 1\r\n", QByteArray());
+
+    connect(&mIdleTimer, SIGNAL(timeout()), this, SLOT(closeIdleClients()));
+}
+
+// Avatar loaded, scaled and encoded on a pool thread, the server starts
+// once it's there. avatarReady() follows, even without avatar.
+void MiniWebServer::loadAvatar()
+{
+    QPointer<MiniWebServer> server(this);
+    QThreadPool::globalInstance()->start([server]() {
+        QByteArray data;
+        QString path = Platform::getAvatarPath();
+        if (path != "")
+        {
+            QImage img(path);
+            QImage scaled = img.scaled(64, 64, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            QBuffer tmp(&data);
+            tmp.open(QIODevice::WriteOnly);
+            scaled.save(&tmp, "PNG");
+        }
+
+        // The server is only looked at on its own thread
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [server, data]() {
+            if (server) server->setAvatar(data);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void MiniWebServer::setAvatar(const QByteArray &data)
+{
+    mAvatarData = data;
+    mAvatarETag = "\"" + avatarHash().toHex() + "\"";
+    mAvatarResponse = serialize("200 OK", "Content-Type: image/png\r\n"
+                                          "Cache-Control: max-age=60\r\n"
+                                          "ETag: " + mAvatarETag + "\r\n", mAvatarData);
+    mNotModifiedResponse = serialize("304 Not Modified", "ETag: " + mAvatarETag + "\r\n", QByteArray());
+    updateListening();
+    emit avatarReady();
+}
+
+// Hash of the avatar served, empty without avatar
+QByteArray MiniWebServer::avatarHash()
+{
+    if (mAvatarData.isEmpty()) return QByteArray();
+    return QCryptographicHash::hash(mAvatarData, QCryptographicHash::Sha1);
+}
+
+void MiniWebServer::setShares(const QStringList &paths)
+{
+    mShares = paths;
+    updateListening();
+}
+
+void MiniWebServer::setUploads(bool enabled)
+{
+    mUploads = enabled;
+    updateListening();
+}
+
+// The server runs for the avatar, the shares or the uploads
+void MiniWebServer::updateListening()
+{
+    bool needed = !mAvatarData.isEmpty() || !mShares.isEmpty() || mUploads;
+    if (!isListening() && needed)
+        listen(QHostAddress::Any, mPort);
+    else if (isListening() && !needed)
+        close();
+}
+
+QByteArray MiniWebServer::header(const QByteArray &status, const QByteArray &headers, qint64 length, bool close)
+{
+    return "HTTP/1.1 " + status + "\r\n" + headers
+           + "Content-Length: " + QByteArray::number(length) + "\r\n"
+           + (close ? "Connection: close\r\n\r\n" : "\r\n");
+}
+
+MiniWebServer::Response MiniWebServer::serialize(const QByteArray &status, const QByteArray &headers, const QByteArray &body)
+{
+    Response r;
+    r.keepAlive = header(status, headers, body.size(), false) + body;
+    r.close = header(status, headers, body.size(), true) + body;
+    r.bodySize = body.size();
+    return r;
 }
 
 void MiniWebServer::incomingConnection(qintptr handle)
 {
     QTcpSocket* s = new QTcpSocket(this);
+    s->setSocketDescriptor(handle);
+
+    // Too many clients, refuse politely
+    if (mClients.size() >= MAX_CLIENTS)
+    {
+        connect(s, SIGNAL(disconnected()), s, SLOT(deleteLater()));
+        s->write(mUnavailableResponse.close);
+        s->disconnectFromHost();
+        return;
+    }
+
+    Client c;
+    c.requests = 0;
+    c.idle.start();
+    c.stream = NULL;
+    c.listing = false;
+    c.closeAfterStream = false;
+    c.upload = NULL;
+    c.closeAfterUpload = false;
+    mClients.insert(s, c);
+
+    // Uploads are read as fast as they're written to disk, requests as fast as they're answered
+    s->setReadBufferSize(MAX_PENDING_OUTPUT);
     connect(s, SIGNAL(readyRead()), this, SLOT(readClient()));
+    connect(s, SIGNAL(bytesWritten(qint64)), this, SLOT(readClient()));
     connect(s, SIGNAL(disconnected()), this, SLOT(discardClient()));
-    s->setSocketDescriptor(handle);
+    if (!mIdleTimer.isActive()) mIdleTimer.start(KEEP_ALIVE_TIMEOUT / 3);
 }
 
 void MiniWebServer::readClient()
 {
     QTcpSocket* socket = (QTcpSocket*)sender();
-    if (socket->canReadLine()) {
-        // Define the QRegularExpression as static so it's only created once
-        static const QRegularExpression regex("[ \r\n][ \r\n]*");
+    auto it = mClients.find(socket);
+    if (it == mClients.end()) return;
+
+    it->idle.restart();
+    processRequests(socket, *it);
+}
+
+// Answers the complete requests received so far, in order
+void MiniWebServer::processRequests(QTcpSocket *socket, Client &client)
+{
+    forever
+    {
+        // The body being listed, streamed or received comes first
+        if (client.listing) return;
+        if (client.stream && !pumpStream(socket, client)) return;
+        if (client.upload)
+        {
+            client.input.append(socket->readAll());
+            if (!receiveUpload(socket, client)) return;
+        }
+        if (socket->bytesToWrite() >= MAX_PENDING_OUTPUT) return;
+
+        // Requests are read one header block at a time, and only once the
+        // output has drained: the rest waits in the (bounded) socket buffer
+        if (client.input.size() <= MAX_REQUEST_SIZE)
+            client.input.append(socket->read(MAX_REQUEST_SIZE + 1 - client.input.size()));
+
+        qsizetype end = client.input.indexOf("\r\n\r\n");
+        if (end < 0)
+        {
+            // Still incomplete, unless too large
+            if (client.input.size() > MAX_REQUEST_SIZE)
+            {
+                client.input.clear();
+                respond(socket, mBadRequestResponse, false, true);
+            }
+            return;
+        }
+        if (end > MAX_REQUEST_SIZE)
+        {
+            client.input.clear();
+            respond(socket, mBadRequestResponse, false, true);
+            return;
+        }
 
-        QStringList tokens = QString(socket->readLine()).split(regex);
-        if (tokens[0] == "GET") {
+        QList<QByteArray> lines = client.input.left(end).split('\n');
+        client.input.remove(0, end + 4);
+        client.requests++;
 
-            QTextStream os(socket);
-            os.setAutoDetectUnicode(true);
-            os << "HTTP/1.0 200 OK\r\n"
-                  "Content-Type: image/png\r\n"
-                  "Content-Length: " << mAvatarData.size() << "\r\n"
-                                        "\r\n";
-            os.flush();
+        // Request line
+        QList<QByteArray> tokens = lines.at(0).trimmed().split(' ');
+        if (tokens.size() != 3)
+        {
+            respond(socket, mBadRequestResponse, false, true);
+            return;
+        }
+        Request r;
+        r.contentLength = -1;
+        r.chunked = false;
+        r.expectContinue = false;
+        r.method = tokens.at(0);
+        qsizetype question = tokens.at(1).indexOf('?');
+        r.path = (question < 0) ? tokens.at(1) : tokens.at(1).left(question);
+        r.query = (question < 0) ? QByteArray() : tokens.at(1).mid(question + 1);
+        bool http10 = (tokens.at(2) == "HTTP/1.0");
+
+        // Headers of interest
+        QByteArray connection;
+        for (int i = 1; i < lines.size(); i++)
+        {
+            const QByteArray &line = lines.at(i);
+            qsizetype colon = line.indexOf(':');
+            if (colon <= 0) continue;
+            QByteArray name = line.left(colon).trimmed().toLower();
+            if (name == "connection")
+                connection = line.mid(colon + 1).trimmed().toLower();
+            else if (name == "if-none-match")
+                r.ifNoneMatch = line.mid(colon + 1).trimmed();
+            else if (name == "if-modified-since")
+                r.ifModifiedSince = line.mid(colon + 1).trimmed();
+            else if (name == "range")
+                r.range = line.mid(colon + 1).trimmed();
+            else if (name == "content-type")
+                r.contentType = line.mid(colon + 1).trimmed();
+            else if (name == "content-length")
+                r.contentLength = line.mid(colon + 1).trimmed().toLongLong();
+            else if (name == "transfer-encoding")
+                r.chunked = line.mid(colon + 1).trimmed().toLower().endsWith("chunked");
+            else if (name == "expect")
+                r.expectContinue = (line.mid(colon + 1).trimmed().toLower() == "100-continue");
+        }
 
-            QDataStream ds(socket);
-            ds.writeRawData(mAvatarData.data(), mAvatarData.size());
+        // HTTP/1.0 closes unless asked otherwise, HTTP/1.1 the opposite
+        r.close = http10 ? (connection != "keep-alive") : (connection == "close");
+        if (client.requests >= MAX_REQUESTS) r.close = true;
+        r.head = (r.method == "HEAD");
 
-            socket->close();
-            if (socket->state() == QTcpSocket::UnconnectedState) delete socket;
+        // Body to send or to receive before the next request
+        bool busy = false;
+        if (mUploads && (((r.method == "POST") && (r.path == "/upload"))
+                         || ((r.method == "PUT") && r.path.startsWith("/upload/"))))
+            busy = startUpload(socket, client, r);
+        else if (!r.head && (r.method != "GET"))
+        {
+            respond(socket, mBadRequestResponse, false, true);
+            return;
         }
+        else if ((r.path == "/dukto/avatar") && !mAvatarData.isEmpty())
+        {
+            if ((r.ifNoneMatch == mAvatarETag) || (r.ifNoneMatch == "*"))
+                respond(socket, mNotModifiedResponse, r.head, r.close);
+            else
+                respond(socket, mAvatarResponse, r.head, r.close);
+        }
+        else if ((!mShares.isEmpty() || mUploads) && ((r.path == "/") || r.path.startsWith("/share")))
+            busy = serveShare(socket, client, r);
+        else
+            respond(socket, mNotFoundResponse, r.head, r.close);
+
+        if (r.close && !busy) return;
     }
 }
 
+// The client may be gone when this returns with close set
+void MiniWebServer::respond(QTcpSocket *socket, const Response &response, bool head, bool close)
+{
+    const QByteArray &data = close ? response.close : response.keepAlive;
+    if (head)
+        socket->write(data.constData(), data.size() - response.bodySize);
+    else
+        socket->write(data);
+
+    if (close) closeClient(socket);
+}
+
+// No more requests from this client, gone once the output is flushed
+void MiniWebServer::closeClient(QTcpSocket *socket)
+{
+    disconnect(socket, SIGNAL(readyRead()), this, SLOT(readClient()));
+    disconnect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(readClient()));
+    socket->disconnectFromHost();
+}
+
+// Share mode: "/" lists the shares, "/share/<n>/<path>" is a file or a
+// folder of share n, and "?tar" gets a folder as an archive. True if the
+// body is left to stream, otherwise the client may be gone when closing.
+bool MiniWebServer::serveShare(QTcpSocket *socket, Client &client, const Request &r)
+{
+    if ((r.path == "/") || (r.path == "/share") || (r.path == "/share/"))
+    {
+        QString items;
+        for (int i = 0; i < mShares.size(); i++)
+        {
+            QFileInfo info(mShares.at(i));
+            QString href = "/share/" + QString::number(i) + (info.isDir() ? "/" : "");
+            items += "<li><a href=\"" + href + "\">" + info.fileName().toHtmlEscaped() + (info.isDir() ? "/" : "") + "</a></li>";
+        }
+        if (mUploads)
+            items += "<li><form method=\"post\" action=\"/upload\" enctype=\"multipart/form-data\">"
+                     "<input type=\"file\" name=\"file\" multiple> <input type=\"submit\" value=\""
+                     + tr("Send") + "\"></form></li>";
+        respond(socket, serialize("200 OK", "Content-Type: text/html; charset=utf-8\r\n",
+                                  page(Platform::getSystemUsername(), items)), r.head, r.close);
+        return false;
+    }
+
+    // Share and path in it, which can't leave it
+    QString rest = QUrl::fromPercentEncoding(r.path.mid(7));
+    qsizetype slash = rest.indexOf('/');
+    bool ok;
+    int n = ((slash < 0) ? rest : rest.left(slash)).toInt(&ok);
+    QString relative = (slash < 0) ? QString() : rest.mid(slash + 1);
+    if (!r.path.startsWith("/share/") || !ok || (n < 0) || (n >= mShares.size())
+        || relative.split('/').contains(".."))
+    {
+        respond(socket, mNotFoundResponse, r.head, r.close);
+        return false;
+    }
+    QFileInfo root(mShares.at(n));
+    QFileInfo info(relative.isEmpty() ? root.absoluteFilePath() : root.absoluteFilePath() + "/" + relative);
+    QString canonical = info.canonicalFilePath();
+    QString rootCanonical = root.canonicalFilePath();
+    if (canonical.isEmpty() || !info.isReadable()
+        || ((canonical != rootCanonical) && !canonical.startsWith(rootCanonical + "/")))
+    {
+        respond(socket, mNotFoundResponse, r.head, r.close);
+        return false;
+    }
+
+    QByteArray headers;
+    QByteArray status = "200 OK";
+    qint64 offset = 0;
+    qint64 length;
+    QString path = info.absoluteFilePath();
+
+    if (info.isDir() && (r.query == "tar"))
+    {
+        // Folder as an archive, listed off this thread (large trees take
+        // a while) and read as it's sent
+        ShareStream *archive = new ShareStream(path);
+        headers = "Content-Type: application/x-tar\r\n"
+                  "Content-Disposition: attachment; filename*=UTF-8''"
+                  + QUrl::toPercentEncoding(info.fileName() + ".tar") + "\r\n";
+        client.listing = true;
+        QPointer<MiniWebServer> server(this);
+        QPointer<QTcpSocket> target(socket);
+        bool head = r.head;
+        bool close = r.close;
+        QThreadPool::globalInstance()->start([server, target, archive, headers, head, close]() {
+            archive->list();
+            QMetaObject::invokeMethod(QCoreApplication::instance(), [server, target, archive, headers, head, close]() {
+                if (server && target)
+                    server->sendArchive(target, archive, headers, head, close);
+                else
+                    delete archive;
+            }, Qt::QueuedConnection);
+        });
+        return true;
+    }
+    else if (info.isDir())
+    {
+        // Relative links need the trailing slash
+        if (!r.path.endsWith('/'))
+        {
+            respond(socket, serialize("301 Moved Permanently", "Location: " + r.path + "/\r\n", QByteArray()), r.head, r.close);
+            return false;
+        }
+
+        QString items = "<li><a href=\"?tar\">" + tr("Download all (.tar)") + "</a></li>";
+        QFileInfoList entries = QDir(path).entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::NoSymLinks,
+                                                         QDir::DirsFirst | QDir::Name | QDir::IgnoreCase);
+        foreach (const QFileInfo &entry, entries)
+        {
+            QString name = entry.fileName() + (entry.isDir() ? "/" : "");
+            QString size = entry.isDir() ? QString() : " (" + QLocale::c().formattedDataSize(entry.size()) + ")";
+            items += "<li><a href=\"" + QString::fromLatin1(QUrl::toPercentEncoding(entry.fileName())) + (entry.isDir() ? "/" : "")
+                     + "\">" + name.toHtmlEscaped() + "</a>" + size + "</li>";
+        }
+        respond(socket, serialize("200 OK", "Content-Type: text/html; charset=utf-8\r\n",
+                                  page(info.fileName(), items)), r.head, r.close);
+        return false;
+    }
+
+    // File, whole or a range of it
+    QDateTime modified = info.lastModified();
+    length = info.size();
+    headers = "Content-Type: " + QMimeDatabase().mimeTypeForFile(info).name().toLatin1() + "\r\n"
+              "Last-Modified: " + httpDate(modified) + "\r\n"
+              "Accept-Ranges: bytes\r\n";
+
+    if (!r.ifModifiedSince.isEmpty() && r.range.isEmpty())
+    {
+        QDateTime since = parseHttpDate(r.ifModifiedSince);
+        if (since.isValid() && (modified.toSecsSinceEpoch() <= since.toSecsSinceEpoch()))
+        {
+            socket->write(header("304 Not Modified", headers, 0, r.close));
+            if (r.close) closeClient(socket);
+            return false;
+        }
+    }
+
+    if (!r.range.isEmpty())
+    {
+        qint64 size = length;
+        int range = parseRange(r.range, size, &offset, &length);
+        if (range < 0)
+        {
+            socket->write(header("416 Range Not Satisfiable", "Content-Range: bytes */" + QByteArray::number(size) + "\r\n", 0, r.close));
+            if (r.close) closeClient(socket);
+            return false;
+        }
+        if (range > 0)
+        {
+            status = "206 Partial Content";
+            headers += "Content-Range: bytes " + QByteArray::number(offset) + "-" + QByteArray::number(offset + length - 1)
+                       + "/" + QByteArray::number(size) + "\r\n";
+        }
+    }
+
+    socket->write(header(status, headers, length, r.close));
+    if (r.head || (length == 0))
+    {
+        if (r.close) closeClient(socket);
+        return false;
+    }
+    client.stream = new ShareStream(path, offset, length);
+    client.closeAfterStream = r.close;
+    return true;
+}
+
+// The archive of a "?tar" request is listed: its size is known now
+void MiniWebServer::sendArchive(QTcpSocket *socket, ShareStream *archive, const QByteArray &headers, bool head, bool close)
+{
+    auto it = mClients.find(socket);
+    if (it == mClients.end())
+    {
+        delete archive;
+        return;
+    }
+    it->listing = false;
+    it->idle.restart();
+    socket->write(header("200 OK", headers, archive->size(), close));
+    if (head)
+    {
+        delete archive;
+        if (close)
+        {
+            closeClient(socket);
+            return;
+        }
+    }
+    else
+    {
+        it->stream = archive;
+        it->closeAfterStream = close;
+    }
+    processRequests(socket, *it);
+}
+
+// Writes the body being streamed as the socket drains, true once it's
+// complete and the connection is still open for more requests
+bool MiniWebServer::pumpStream(QTcpSocket *socket, Client &client)
+{
+    PooledBuffer buffer;
+    bool direct = (socket->bytesToWrite() == 0);
+    while (socket->bytesToWrite() < MAX_PENDING_OUTPUT)
+    {
+        // With nothing queued in between, the file goes straight to the
+        // socket; the block written after it keeps bytesWritten() coming
+        qint64 sent = 0;
+        if (direct)
+        {
+            direct = false;
+            sent = client.stream->send(socket->socketDescriptor(), SENDFILE_SIZE);
+        }
+
+        qint64 n = (sent < 0) ? -1 : client.stream->read(buffer.data(), buffer.size());
+        if (n < 0)
+        {
+            // The length was promised, the client has to see the failure
+            delete client.stream;
+            client.stream = NULL;
+            socket->abort();
+            return false;
+        }
+        if (n == 0)
+        {
+            delete client.stream;
+            client.stream = NULL;
+            if (!client.closeAfterStream) return true;
+            closeClient(socket);
+            return false;
+        }
+        socket->write(buffer.data(), n);
+        if (sent > 0) return false;
+    }
+    return false;
+}
+
+// POST /upload (multipart, from the form) or PUT /upload/<name> (raw).
+// True if the body is left to receive, otherwise the client may be gone.
+bool MiniWebServer::startUpload(QTcpSocket *socket, Client &client, const Request &r)
+{
+    // The end of the body has to be known
+    if (!r.chunked && (r.contentLength < 0))
+    {
+        respond(socket, serialize("411 Length Required", QByteArray(), QByteArray()), false, true);
+        return false;
+    }
+
+    QByteArray type = r.contentType;
+    QString name;
+    if (r.method == "PUT")
+    {
+        type.clear();
+        name = QUrl::fromPercentEncoding(r.path.mid(8));
+    }
+    else if (!type.toLower().startsWith("multipart/form-data"))
+    {
+        respond(socket, serialize("415 Unsupported Media Type", QByteArray(), QByteArray()), false, true);
+        return false;
+    }
+
+    // A few uploads at a time from the same address
+    QHostAddress from = socket->peerAddress();
+    int uploads = 0;
+    for (auto it = mClients.cbegin(); it != mClients.cend(); ++it)
+        if (it->upload && (it.key()->peerAddress() == from)) uploads++;
+    if (uploads >= MAX_UPLOADS_PER_CLIENT)
+    {
+        respond(socket, serialize("429 Too Many Requests", "Retry-After: 10\r\n", QByteArray()), false, true);
+        return false;
+    }
+
+    // Bounded, and never filling the disk (chunked bodies are stopped
+    // when they get there)
+    qint64 allowed = MAX_UPLOAD_SIZE;
+    QStorageInfo storage(QDir::currentPath());
+    if (storage.isValid())
+        allowed = qMin(allowed, storage.bytesAvailable() - FREE_SPACE_MARGIN);
+    if (!r.chunked && (r.contentLength > MAX_UPLOAD_SIZE))
+    {
+        respond(socket, serialize("413 Content Too Large", QByteArray(), QByteArray()), false, true);
+        return false;
+    }
+    if ((allowed <= 0) || (!r.chunked && (r.contentLength > allowed)))
+    {
+        respond(socket, serialize("507 Insufficient Storage", QByteArray(), QByteArray()), false, true);
+        return false;
+    }
+
+    if (r.expectContinue) socket->write("HTTP/1.1 100 Continue\r\n\r\n");
+    client.upload = new UploadReceiver(type, r.chunked ? -1 : r.contentLength, name, allowed);
+    client.closeAfterUpload = r.close;
+    return true;
+}
+
+// Writes the upload body received so far, true once it's complete and
+// the connection is still open for more requests
+bool MiniWebServer::receiveUpload(QTcpSocket *socket, Client &client)
+{
+    UploadReceiver::Status status = client.upload->feed(client.input);
+    if (status == UploadReceiver::NeedMore) return false;
+
+    UploadReceiver *upload = client.upload;
+    client.upload = NULL;
+    bool close = client.closeAfterUpload;
+    if (status == UploadReceiver::Failed)
+    {
+        // The rest of the body can't be skipped reliably
+        QByteArray status = upload->tooLarge() ? "413 Content Too Large" : "500 Internal Server Error";
+        delete upload;
+        respond(socket, serialize(status, QByteArray(), QByteArray()), false, true);
+        return false;
+    }
+
+    bool ok;
+    QHostAddress from = socket->peerAddress();
+    quint32 ipv4 = from.toIPv4Address(&ok);
+    if (ok) from = QHostAddress(ipv4);
+    emit uploadComplete(upload->files(), upload->size(), from.toString());
+
+    QString items;
+    foreach (const QString &file, upload->files())
+        items += "<li>" + file.toHtmlEscaped() + "</li>";
+    items += "<li><a href=\"/\">" + tr("Back") + "</a></li>";
+    delete upload;
+    respond(socket, serialize("200 OK", "Content-Type: text/html; charset=utf-8\r\n", page(tr("Received"), items)), false, close);
+    return !close;
+}
+
+QByteArray MiniWebServer::page(const QString &title, const QString &items)
+{
+    return ("<!DOCTYPE html><html><head><meta charset=\"utf-8\">"
+            "<meta name=\"viewport\" content=\"width=device-width\">"
+            "<title>" + title.toHtmlEscaped() + "</title></head>"
+            "<body><h1>" + title.toHtmlEscaped() + "</h1><ul>" + items + "</ul></body></html>").toUtf8();
+}
+
 void MiniWebServer::discardClient()
 {
     QTcpSocket* socket = (QTcpSocket*)sender();
+    auto it = mClients.find(socket);
+    if (it != mClients.end())
+    {
+        delete it->stream;
+        delete it->upload;
+        mClients.erase(it);
+    }
     socket->deleteLater();
+    if (mClients.isEmpty()) mIdleTimer.stop();
+}
+
+// Keep-alive connections unused for a while are closed
+void MiniWebServer::closeIdleClients()
+{
+    // Collected first, disconnectFromHost() may remove the client right away
+    QList<QTcpSocket*> idle;
+    for (auto it = mClients.cbegin(); it != mClients.cend(); ++it)
+        if (!it->listing && (it->idle.elapsed() > KEEP_ALIVE_TIMEOUT))
+            idle.append(it.key());
+    for (QTcpSocket *s : std::as_const(idle))
+        s->disconnectFromHost();
 }
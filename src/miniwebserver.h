@@ -2,26 +2,129 @@
 #define MINIWEBSERVER_H
 
 #include <QTcpServer>
+#include <QHash>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QStringList>
+
+class QTcpSocket;
+class ShareStream;
+class UploadReceiver;
 
 // FROM: http://doc.qt.nokia.com/solutions/4/qtservice/qtservice-example-server.html
+//
+// HTTP/1.1 server for the avatar. Requests are parsed as their bytes
+// arrive, connections are kept alive (pipelined requests are answered in
+// order) and the responses are serialized once, headers and body in a
+// single buffer.
+//
+// In share mode (opt-in, see setShares()) it also lists the shared files
+// and folders to browsers and serves them, with ranges, and folders as tar
+// archives. With uploads enabled, browsers (form on "/") and HTTP clients
+// (PUT /upload/<name>) can also send files to the destination folder,
+// a few at a time per address and never filling the disk.
 
 class MiniWebServer : public QTcpServer
 {
     Q_OBJECT
 
 public:
+    static const int MAX_CLIENTS = 64;              // Connections beyond are refused
+    static const int MAX_REQUEST_SIZE = 8192;       // Request line and headers
+    static const int MAX_REQUESTS = 1000;           // Per connection
+    static const int KEEP_ALIVE_TIMEOUT = 15000;    // ms an idle connection is kept
+    static const int MAX_PENDING_OUTPUT = 262144;   // Bytes queued before reading more requests
+    static const int SENDFILE_SIZE = 1048576;       // Bytes per sendfile() call
+    static const qint64 MAX_UPLOAD_SIZE = Q_INT64_C(17179869184);   // Bytes per upload request
+    static const qint64 FREE_SPACE_MARGIN = 536870912;  // Bytes uploads leave free on the disk
+    static const int MAX_UPLOADS_PER_CLIENT = 2;    // Uploads at the same time from an address
+
     MiniWebServer(int port);
 
+    // Off the calling thread, avatarReady() once done
+    void loadAvatar();
+    QByteArray avatarHash();
+
+    // Files and folders served to browsers, none to disable share mode
+    void setShares(const QStringList &paths);
+    inline const QStringList& shares() const { return mShares; }
+
+    // Uploads to the current folder
+    void setUploads(bool enabled);
+    inline bool uploads() const { return mUploads; }
+
+signals:
+    void avatarReady();
+    void uploadComplete(const QStringList &files, qint64 size, const QString &from);
+
 protected:
     virtual void incomingConnection(qintptr handle);
 
 private slots:
     void readClient();
     void discardClient();
+    void closeIdleClients();
 
 private:
-    QByteArray mAvatarData;
+    struct Client {
+        QByteArray input;
+        int requests;
+        QElapsedTimer idle;
+        ShareStream *stream;    // Body being sent, if any
+        bool listing;           // Archive being listed, nothing else until it's sent
+        bool closeAfterStream;
+        UploadReceiver *upload; // Body being received, if any
+        bool closeAfterUpload;
+    };
+
+    struct Request {
+        QByteArray method;
+        QByteArray path;
+        QByteArray query;
+        QByteArray ifNoneMatch;
+        QByteArray ifModifiedSince;
+        QByteArray range;
+        QByteArray contentType;
+        qint64 contentLength;   // -1 if chunked or no body
+        bool chunked;
+        bool expectContinue;
+        bool head;
+        bool close;
+    };
+
+    // Pre-serialized response, the body follows the headers
+    struct Response {
+        QByteArray keepAlive;
+        QByteArray close;
+        int bodySize;           // Left out for HEAD requests
+    };
 
+    void processRequests(QTcpSocket *socket, Client &client);
+    void respond(QTcpSocket *socket, const Response &response, bool head, bool close);
+    void closeClient(QTcpSocket *socket);
+    bool serveShare(QTcpSocket *socket, Client &client, const Request &request);
+    void sendArchive(QTcpSocket *socket, ShareStream *archive, const QByteArray &headers, bool head, bool close);
+    bool pumpStream(QTcpSocket *socket, Client &client);
+    bool startUpload(QTcpSocket *socket, Client &client, const Request &request);
+    bool receiveUpload(QTcpSocket *socket, Client &client);
+    void setAvatar(const QByteArray &data);
+    void updateListening();
+    static QByteArray page(const QString &title, const QString &items);
+    static QByteArray header(const QByteArray &status, const QByteArray &headers, qint64 length, bool close);
+    static Response serialize(const QByteArray &status, const QByteArray &headers, const QByteArray &body);
+
+    int mPort;
+    QStringList mShares;
+    bool mUploads;
+    QByteArray mAvatarData;
+    QByteArray mAvatarETag;
+    Response mAvatarResponse;
+    Response mNotModifiedResponse;
+    Response mNotFoundResponse;
+    Response mBadRequestResponse;
+    Response mUnavailableResponse;
+    QHash<QTcpSocket*, Client> mClients;
+    QTimer mIdleTimer;
 };
 
 #endif // MINIWEBSERVER_H
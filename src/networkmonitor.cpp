@@ -0,0 +1,215 @@
+#include "networkmonitor.h"
+
+#include <QCoreApplication>
+#include <QNetworkInterface>
+#include <QSocketNotifier>
+#include <QtEndian>
+
+#if defined(Q_OS_LINUX)
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+NetworkMonitor* NetworkMonitor::instance()
+{
+    // Owned by the application, so that it goes away with the event loop
+    static NetworkMonitor *instance = new NetworkMonitor(QCoreApplication::instance());
+    return instance;
+}
+
+NetworkMonitor::NetworkMonitor(QObject *parent) :
+    QObject(parent), mNetlinkSocket(-1), mNotifier(NULL)
+{
+    // Subscribe before the first enumeration, so that no change gets lost
+    openNetlink();
+    refresh();
+}
+
+NetworkMonitor::~NetworkMonitor()
+{
+    delete mNotifier;
+#if defined(Q_OS_LINUX)
+    if (mNetlinkSocket >= 0) ::close(mNetlinkSocket);
+#endif
+}
+
+// Subscribes to the link and IPv4 address notifications of the kernel
+void NetworkMonitor::openNetlink()
+{
+#if defined(Q_OS_LINUX)
+    int fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) return;
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (::bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+    {
+        // Not allowed everywhere (e.g. recent Android versions)
+        ::close(fd);
+        return;
+    }
+
+    mNetlinkSocket = fd;
+    mNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+    connect(mNotifier, &QSocketNotifier::activated, this, &NetworkMonitor::readNetlink);
+#endif
+}
+
+// Rebuilds the whole table from a full enumeration of the interfaces
+void NetworkMonitor::refresh()
+{
+    mInterfaces.clear();
+    mAddresses.clear();
+
+    QList<QNetworkInterface> ifaces = QNetworkInterface::allInterfaces();
+    for (const QNetworkInterface &iface : ifaces)
+    {
+        Interface i;
+        i.name = iface.name();
+        i.up = iface.flags() & QNetworkInterface::IsUp;
+        i.running = iface.flags() & QNetworkInterface::IsRunning;
+        i.loopback = iface.flags() & QNetworkInterface::IsLoopBack;
+        mInterfaces.insert(iface.index(), i);
+
+        QList<QNetworkAddressEntry> entries = iface.addressEntries();
+        for (const QNetworkAddressEntry &entry : entries)
+            if (entry.ip().protocol() == QAbstractSocket::IPv4Protocol)
+                setAddress(iface.index(), entry.ip(), entry.broadcast(), true);
+    }
+
+    update();
+}
+
+// Applies the pending kernel notifications to the table
+void NetworkMonitor::readNetlink()
+{
+#if defined(Q_OS_LINUX)
+    alignas(struct nlmsghdr) char buffer[8192];
+    bool lost = false;
+
+    while (true)
+    {
+        ssize_t len = ::recv(mNetlinkSocket, buffer, sizeof(buffer), 0);
+        if ((len < 0) && (errno == ENOBUFS))
+        {
+            // The kernel dropped some notifications
+            lost = true;
+            continue;
+        }
+        if (len <= 0) break;
+
+        int left = len;
+        for (struct nlmsghdr *h = (struct nlmsghdr*) buffer; NLMSG_OK(h, left); h = NLMSG_NEXT(h, left))
+        {
+            // Interface state
+            if ((h->nlmsg_type == RTM_NEWLINK) || (h->nlmsg_type == RTM_DELLINK))
+            {
+                struct ifinfomsg *ifi = (struct ifinfomsg*) NLMSG_DATA(h);
+                if (h->nlmsg_type == RTM_DELLINK)
+                {
+                    mInterfaces.remove(ifi->ifi_index);
+                    for (int i = mAddresses.size() - 1; i >= 0; i--)
+                        if (mAddresses.at(i).index == ifi->ifi_index) mAddresses.removeAt(i);
+                    continue;
+                }
+
+                Interface &iface = mInterfaces[ifi->ifi_index];
+                iface.up = ifi->ifi_flags & IFF_UP;
+                iface.running = ifi->ifi_flags & IFF_RUNNING;
+                iface.loopback = ifi->ifi_flags & IFF_LOOPBACK;
+                int attrLen = IFLA_PAYLOAD(h);
+                for (struct rtattr *a = IFLA_RTA(ifi); RTA_OK(a, attrLen); a = RTA_NEXT(a, attrLen))
+                    if (a->rta_type == IFLA_IFNAME) iface.name = QString::fromUtf8((const char*) RTA_DATA(a));
+            }
+
+            // IPv4 addresses
+            else if ((h->nlmsg_type == RTM_NEWADDR) || (h->nlmsg_type == RTM_DELADDR))
+            {
+                struct ifaddrmsg *ifa = (struct ifaddrmsg*) NLMSG_DATA(h);
+                if (ifa->ifa_family != AF_INET) continue;
+
+                QHostAddress local, address, broadcast;
+                int attrLen = IFA_PAYLOAD(h);
+                for (struct rtattr *a = IFA_RTA(ifa); RTA_OK(a, attrLen); a = RTA_NEXT(a, attrLen))
+                {
+                    if (RTA_PAYLOAD(a) < sizeof(quint32)) continue;
+                    QHostAddress ip(qFromBigEndian<quint32>(RTA_DATA(a)));
+                    if (a->rta_type == IFA_LOCAL) local = ip;
+                    else if (a->rta_type == IFA_ADDRESS) address = ip;
+                    else if (a->rta_type == IFA_BROADCAST) broadcast = ip;
+                }
+
+                // IFA_ADDRESS is the remote end on point-to-point links
+                setAddress(ifa->ifa_index, local.isNull() ? address : local, broadcast, h->nlmsg_type == RTM_NEWADDR);
+            }
+        }
+    }
+
+    if (lost)
+        refresh();
+    else
+        update();
+#endif
+}
+
+void NetworkMonitor::setAddress(int index, const QHostAddress &ip, const QHostAddress &broadcast, bool present)
+{
+    for (int i = mAddresses.size() - 1; i >= 0; i--)
+        if ((mAddresses.at(i).index == index) && (mAddresses.at(i).ip == ip)) mAddresses.removeAt(i);
+    if (!present || ip.isNull()) return;
+
+    Address a;
+    a.index = index;
+    a.ip = ip;
+    a.broadcast = broadcast;
+    mAddresses.append(a);
+}
+
+// Updates the lists derived from the table and notifies the differences
+void NetworkMonitor::update()
+{
+    QList<QHostAddress> broadcasts;
+    QList<QHostAddress> locals;
+    QStringList active;
+    QSet<QString> withIPv4;
+    for (auto it = mInterfaces.constBegin(); it != mInterfaces.constEnd(); ++it)
+        if (it->up && it->running && !it->loopback && !it->name.isEmpty())
+            active.append(it->name);
+    for (const Address &a : mAddresses)
+    {
+        const Interface iface = mInterfaces.value(a.index);
+        if (!iface.up || !iface.running) continue;
+        withIPv4.insert(iface.name);
+        if (!a.broadcast.isNull() && !broadcasts.contains(a.broadcast))
+            broadcasts.append(a.broadcast);
+        if (!iface.loopback && !a.ip.isLoopback() && !locals.contains(a.ip))
+            locals.append(a.ip);
+    }
+
+    QList<QHostAddress> oldBroadcasts = mBroadcastAddresses;
+    QList<QHostAddress> oldLocals = mLocalAddresses;
+    mBroadcastAddresses = broadcasts;
+    mLocalAddresses = locals;
+
+    for (const QHostAddress &ip : oldLocals)
+        if (!locals.contains(ip)) emit localAddressRemoved(ip);
+    for (const QHostAddress &ip : locals)
+        if (!oldLocals.contains(ip)) emit localAddressAdded(ip);
+    for (const QHostAddress &ip : broadcasts)
+        if (!oldBroadcasts.contains(ip)) emit broadcastAddressAdded(ip);
+
+    active.sort();
+    if ((active != mActiveInterfaces) || (withIPv4 != mIPv4Interfaces))
+    {
+        mActiveInterfaces = active;
+        mIPv4Interfaces = withIPv4;
+        emit activeInterfacesChanged();
+    }
+}
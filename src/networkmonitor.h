@@ -0,0 +1,80 @@
+#ifndef NETWORKMONITOR_H
+#define NETWORKMONITOR_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QHostAddress>
+#include <QStringList>
+#include <QSet>
+
+class QSocketNotifier;
+
+// Cached table of the IPv4 addresses of the local interfaces, shared by
+// discovery and the IP address list. On Linux it's kept up to date from
+// rtnetlink notifications; elsewhere refresh() enumerates the interfaces
+// again. Changes are notified as differences.
+class NetworkMonitor : public QObject
+{
+    Q_OBJECT
+
+public:
+    static NetworkMonitor* instance();
+
+    // Broadcast addresses to send discovery messages to
+    inline const QList<QHostAddress>& broadcastAddresses() const { return mBroadcastAddresses; }
+
+    // Addresses of this host on active, non-loopback interfaces
+    inline const QList<QHostAddress>& localAddresses() const { return mLocalAddresses; }
+
+    // Names of the active, non-loopback interfaces
+    inline const QStringList& activeInterfaces() const { return mActiveInterfaces; }
+    inline bool hasIPv4Address(const QString &interface) const { return mIPv4Interfaces.contains(interface); }
+
+    // True when changes are notified by the system
+    inline bool isWatching() const { return mNotifier != NULL; }
+
+public slots:
+    void refresh();
+
+signals:
+    void broadcastAddressAdded(QHostAddress address);
+    void localAddressAdded(QHostAddress address);
+    void localAddressRemoved(QHostAddress address);
+    void activeInterfacesChanged();
+
+private slots:
+    void readNetlink();
+
+private:
+    struct Interface {
+        Interface() : up(false), running(false), loopback(false) { }
+        QString name;
+        bool up;
+        bool running;
+        bool loopback;
+    };
+
+    struct Address {
+        int index;              // Interface index
+        QHostAddress ip;
+        QHostAddress broadcast;
+    };
+
+    explicit NetworkMonitor(QObject *parent);
+    ~NetworkMonitor();
+    void openNetlink();
+    void setAddress(int index, const QHostAddress &ip, const QHostAddress &broadcast, bool present);
+    void update();
+
+    QHash<int, Interface> mInterfaces;
+    QList<Address> mAddresses;
+    QList<QHostAddress> mBroadcastAddresses;
+    QList<QHostAddress> mLocalAddresses;
+    QStringList mActiveInterfaces;
+    QSet<QString> mIPv4Interfaces;
+    int mNetlinkSocket;
+    QSocketNotifier *mNotifier;
+};
+
+#endif // NETWORKMONITOR_H
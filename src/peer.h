@@ -6,11 +6,23 @@
 class Peer
 {
 public:
-    Peer() { }
-    inline Peer(QHostAddress a, QString n, qint16 p) { address = a; name = n; port = p; }
+    Peer() : port(0), features(0), tcpPort(0), avatarPort(0), provisional(false) { }
+    inline Peer(QHostAddress a, QString n, qint16 p) { address = a; name = n; port = p; features = 0; tcpPort = 0; avatarPort = 0; provisional = false; }
     QHostAddress address;
     QString name;
     qint16 port;
+    quint32 features;   // DuktoProtocol::Feature flags advertised by the peer
+    QString username;   // Parts of the name ("username at system (platform)")
+    QString system;
+    QString platform;
+
+    // Only from peers sending HELLO v2 (identity in the HELLO extension)
+    QByteArray instanceId;  // Stable identifier of the installation
+    qint16 tcpPort;
+    qint16 avatarPort;      // 0 when there's no avatar
+    QByteArray avatarHash;  // SHA-1 of the avatar image
+
+    bool provisional;       // Loaded from the cache, not confirmed yet
 };
 
 #endif // PEER_H
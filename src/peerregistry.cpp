@@ -0,0 +1,303 @@
+#include "peerregistry.h"
+#include "idlescheduler.h"
+
+#include <QRegularExpression>
+#include <QDataStream>
+#include <QDateTime>
+#include <algorithm>
+
+#define CACHE_VERSION 1
+
+PeerRegistry::PeerRegistry(QObject *parent) :
+    QObject(parent), mCurrentSlot(0), mTimeToLive(DEFAULT_TTL)
+{
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+        mWheel.append(QSet<QHostAddress>());
+
+    mClock.start();
+    mInterval = mTimeToLive / WHEEL_SLOTS;
+    mTask = IdleScheduler::instance()->add(this, SLOT(tick()), mInterval, mInterval / 4);
+}
+
+void PeerRegistry::setTimeToLive(int ms)
+{
+    mTimeToLive = ms;
+    mInterval = qMax(1, ms / WHEEL_SLOTS);
+    IdleScheduler::instance()->setInterval(mTask, mInterval, mInterval / 4);
+}
+
+void PeerRegistry::seen(const QHostAddress &address, const QString &name, qint16 port)
+{
+    qint64 now = mClock.elapsed();
+    auto it = mEntries.find(address);
+
+    // New peer
+    if (it == mEntries.end())
+    {
+        Entry e;
+        e.peer = Peer(address, name, port);
+        e.peer.features = mFeatures.value(address, 0);
+        e.lastSeen = now;
+        e.slot = schedule(address, now + mTimeToLive);
+        e.cachedSeen = 0;
+        parseName(e.peer);
+        mEntries.insert(address, e);
+        emit peerAdded(e.peer);
+        return;
+    }
+
+    // Known peer, the expiry is checked again when its slot comes
+    it->lastSeen = now;
+    bool confirmed = it->peer.provisional;
+    it->peer.provisional = false;
+    it->cachedSeen = 0;
+
+    // The details of HELLO v2 peers come from their extension
+    if (!it->peer.instanceId.isEmpty())
+    {
+        if (confirmed) emit peerChanged(it->peer);
+        return;
+    }
+    if (!confirmed && (it->peer.name == name) && (it->peer.port == port)) return;
+
+    it->peer.name = name;
+    it->peer.port = port;
+    parseName(it->peer);
+    emit peerChanged(it->peer);
+}
+
+void PeerRegistry::seen(const QHostAddress &address, const Peer &info)
+{
+    qint64 now = mClock.elapsed();
+    mFeatures.insert(address, info.features);
+    auto it = mEntries.find(address);
+
+    // New peer
+    if (it == mEntries.end())
+    {
+        Entry e;
+        e.peer = info;
+        e.peer.address = address;
+        e.lastSeen = now;
+        e.slot = schedule(address, now + mTimeToLive);
+        e.cachedSeen = 0;
+        mEntries.insert(address, e);
+        emit peerAdded(e.peer);
+        return;
+    }
+
+    it->lastSeen = now;
+    it->cachedSeen = 0;
+    if (sameDetails(it->peer, info)) return;
+    it->peer = info;
+    it->peer.address = address;
+    emit peerChanged(it->peer);
+}
+
+void PeerRegistry::setFeatures(const QHostAddress &address, quint32 features)
+{
+    auto f = mFeatures.constFind(address);
+    if ((f != mFeatures.constEnd()) && (*f == features)) return;
+    mFeatures.insert(address, features);
+
+    auto it = mEntries.find(address);
+    if (it == mEntries.end())
+    {
+        // Kept until the HELLO that follows, dropped by the wheel otherwise
+        schedule(address, mClock.elapsed() + mTimeToLive);
+        return;
+    }
+    it->peer.features = features;
+    emit peerChanged(it->peer);
+}
+
+void PeerRegistry::remove(const QHostAddress &address)
+{
+    mFeatures.remove(address);
+    auto it = mEntries.find(address);
+    if (it == mEntries.end()) return;
+
+    Peer peer = it->peer;
+    mEntries.erase(it);
+    emit peerRemoved(peer);
+}
+
+Peer PeerRegistry::peer(const QHostAddress &address) const
+{
+    return mEntries.value(address).peer;
+}
+
+QList<Peer> PeerRegistry::peers() const
+{
+    QList<Peer> list;
+    for (auto it = mEntries.constBegin(); it != mEntries.constEnd(); ++it)
+        list.append(it->peer);
+    return list;
+}
+
+quint32 PeerRegistry::features(const QHostAddress &address) const
+{
+    return mFeatures.value(address, 0);
+}
+
+// Most recently seen peers, with the wall clock time they were last seen
+QByteArray PeerRegistry::save() const
+{
+    struct Item { qint64 seen; Peer peer; };
+    QList<Item> items;
+    qint64 now = mClock.elapsed();
+    qint64 wallNow = QDateTime::currentMSecsSinceEpoch();
+    for (auto it = mEntries.constBegin(); it != mEntries.constEnd(); ++it)
+    {
+        Item i;
+        i.seen = (it->cachedSeen != 0) ? it->cachedSeen : wallNow - (now - it->lastSeen);
+        i.peer = it->peer;
+        items.append(i);
+    }
+    std::sort(items.begin(), items.end(), [](const Item &a, const Item &b) { return a.seen > b.seen; });
+
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out << (quint8) CACHE_VERSION << (quint32) qMin<qsizetype>(items.size(), (qsizetype) CACHE_MAX_PEERS);
+    for (int i = 0; (i < items.size()) && (i < CACHE_MAX_PEERS); i++)
+    {
+        const Peer &p = items.at(i).peer;
+        out << items.at(i).seen << p.address << p.name << p.port << p.features
+            << p.instanceId << p.tcpPort << p.avatarPort << p.avatarHash;
+    }
+    return data;
+}
+
+// Adds the cached peers as provisional entries, returns them so that
+// they can be probed. Peers already known or too old are skipped.
+QList<Peer> PeerRegistry::restore(const QByteArray &data)
+{
+    QList<Peer> restored;
+    QDataStream in(data);
+    quint8 version = 0;
+    quint32 count = 0;
+    in >> version >> count;
+    if ((in.status() != QDataStream::Ok) || (version != CACHE_VERSION)) return restored;
+
+    qint64 now = mClock.elapsed();
+    qint64 wallNow = QDateTime::currentMSecsSinceEpoch();
+    for (quint32 i = 0; (i < count) && (i < (quint32) CACHE_MAX_PEERS); i++)
+    {
+        qint64 seen;
+        Peer p;
+        in >> seen >> p.address >> p.name >> p.port >> p.features
+           >> p.instanceId >> p.tcpPort >> p.avatarPort >> p.avatarHash;
+        if (in.status() != QDataStream::Ok) break;
+        if ((wallNow - seen > CACHE_MAX_AGE) || p.address.isNull() || mEntries.contains(p.address)) continue;
+
+        Entry e;
+        e.peer = p;
+        e.peer.provisional = true;
+        parseName(e.peer);
+        e.lastSeen = now;
+        e.slot = schedule(p.address, now + mTimeToLive);
+        e.cachedSeen = seen;
+        mFeatures.insert(p.address, p.features);
+        mEntries.insert(p.address, e);
+        restored.append(e.peer);
+        emit peerAdded(e.peer);
+    }
+    return restored;
+}
+
+// Removes the cached peers which didn't answer
+void PeerRegistry::dropProvisional()
+{
+    for (auto it = mEntries.begin(); it != mEntries.end(); )
+    {
+        if (!it->peer.provisional)
+        {
+            ++it;
+            continue;
+        }
+        Peer peer = it->peer;
+        mFeatures.remove(it.key());
+        it = mEntries.erase(it);
+        emit peerRemoved(peer);
+    }
+}
+
+// Puts an address in the slot of the wheel matching its expiry time,
+// returns the slot
+int PeerRegistry::schedule(const QHostAddress &address, qint64 expiry)
+{
+    qint64 interval = mInterval;
+    qint64 ticks = (expiry - mClock.elapsed() + interval - 1) / interval;
+    ticks = qBound<qint64>(1, ticks, WHEEL_SLOTS - 1);
+    int slot = (mCurrentSlot + ticks) % WHEEL_SLOTS;
+    mWheel[slot].insert(address);
+
+    // The wheel stands still while empty
+    IdleScheduler *scheduler = IdleScheduler::instance();
+    if (!scheduler->isActive(mTask)) scheduler->start(mTask);
+    return slot;
+}
+
+// Checks the peers of the current slot: the expired ones are removed,
+// the others (seen again in the meantime) are moved forward
+void PeerRegistry::tick()
+{
+    mCurrentSlot = (mCurrentSlot + 1) % WHEEL_SLOTS;
+    QSet<QHostAddress> due;
+    due.swap(mWheel[mCurrentSlot]);
+
+    qint64 now = mClock.elapsed();
+    for (const QHostAddress &address : due)
+    {
+        auto it = mEntries.find(address);
+        if (it == mEntries.end())
+        {
+            // Features of a peer which never said hello
+            mFeatures.remove(address);
+            continue;
+        }
+
+        // Left behind by a peer that went away and came back
+        if (it->slot != mCurrentSlot) continue;
+
+        qint64 expiry = it->lastSeen + mTimeToLive;
+        if (expiry > now)
+        {
+            it->slot = schedule(address, expiry);
+            continue;
+        }
+
+        Peer peer = it->peer;
+        mEntries.erase(it);
+        mFeatures.remove(address);
+        emit peerRemoved(peer);
+    }
+
+    foreach (const QSet<QHostAddress> &slot, mWheel)
+        if (!slot.isEmpty()) return;
+    IdleScheduler::instance()->stop(mTask);
+}
+
+bool PeerRegistry::sameDetails(const Peer &a, const Peer &b)
+{
+    return (a.name == b.name) && (a.port == b.port) && (a.features == b.features)
+           && (a.provisional == b.provisional)
+           && (a.instanceId == b.instanceId) && (a.tcpPort == b.tcpPort)
+           && (a.avatarPort == b.avatarPort) && (a.avatarHash == b.avatarHash);
+}
+
+// Splits the signature ("user at host (platform)") once per change
+void PeerRegistry::parseName(Peer &peer)
+{
+    static const QRegularExpression rx("^(.*)\\sat\\s(.*)\\s\\((.*)\\)$");
+    QRegularExpressionMatch match = rx.match(peer.name);
+    if (match.hasMatch()) {
+        peer.username = match.captured(1);
+        peer.system = match.captured(2);
+        peer.platform = match.captured(3);
+    } else {
+        peer.username = peer.name;
+        peer.system = "";
+        peer.platform = "";
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef PEERREGISTRY_H
+#define PEERREGISTRY_H
+
+#include <QObject>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QElapsedTimer>
+
+#include "peer.h"
+
+// Peers found on the network, keyed by address. Peers not heard from
+// for a while are expired through a timer wheel, turned by the
+// IdleScheduler and only while there's something on it; notifications
+// are emitted only when something actually changes.
+class PeerRegistry : public QObject
+{
+    Q_OBJECT
+
+public:
+    static const int DEFAULT_TTL = 180000;  // ms, three missed periodic hellos
+    static const int WHEEL_SLOTS = 16;
+    static const int CACHE_MAX_PEERS = 64;
+    static const qint64 CACHE_MAX_AGE = 7 * 24 * 3600 * 1000LL;  // ms
+
+    explicit PeerRegistry(QObject *parent = NULL);
+
+    // A HELLO has been received
+    void seen(const QHostAddress &address, const QString &name, qint16 port);
+    // A HELLO v2 has been received (identity already split in fields)
+    void seen(const QHostAddress &address, const Peer &info);
+    // A HELLO extension has been received (before or after the HELLO)
+    void setFeatures(const QHostAddress &address, quint32 features);
+    // A GOODBYE has been received
+    void remove(const QHostAddress &address);
+
+    inline bool contains(const QHostAddress &address) const { return mEntries.contains(address); }
+    inline int count() const { return mEntries.size(); }
+    Peer peer(const QHostAddress &address) const;
+    QList<Peer> peers() const;
+    quint32 features(const QHostAddress &address) const;
+    void setTimeToLive(int ms);
+
+    // Cache of the peers, to show them at once on the next start
+    QByteArray save() const;
+    QList<Peer> restore(const QByteArray &data);
+    void dropProvisional();
+
+signals:
+    void peerAdded(Peer peer);
+    void peerChanged(Peer peer);
+    void peerRemoved(Peer peer);
+
+private slots:
+    void tick();
+
+private:
+    struct Entry {
+        Peer peer;
+        qint64 lastSeen;    // ms, from mClock
+        int slot;           // Slot of the wheel where the expiry is checked
+        qint64 cachedSeen;  // Last seen (ms since epoch) of provisional entries
+    };
+
+    int schedule(const QHostAddress &address, qint64 expiry);
+    static void parseName(Peer &peer);
+    static bool sameDetails(const Peer &a, const Peer &b);
+
+    QHash<QHostAddress, Entry> mEntries;
+    QHash<QHostAddress, quint32> mFeatures;     // Also for peers not (yet) seen
+    QList<QSet<QHostAddress> > mWheel;          // Addresses to check, by expiry slot
+    int mCurrentSlot;
+    int mTimeToLive;
+    int mTask;                                  // Turn of the wheel, in the IdleScheduler
+    int mInterval;                              // ms between turns
+    QElapsedTimer mClock;
+};
+
+#endif // PEERREGISTRY_H
@@ -0,0 +1,118 @@
+#include "pipesource.h"
+
+#include <QFile>
+#include <QSocketNotifier>
+
+#if defined(Q_OS_UNIX)
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+PipeSource::PipeSource(const QString &path, QObject *parent) :
+    QIODevice(parent), mPath(path), mFd(-1), mFifo(false), mWoken(false), mFinished(false), mNotifier(NULL)
+{
+}
+
+PipeSource::~PipeSource()
+{
+    close();
+}
+
+bool PipeSource::open(OpenMode mode)
+{
+#if defined(Q_OS_UNIX)
+    if (mode & WriteOnly) return false;
+
+    // Non-blocking, also so that opening a pipe doesn't wait for a writer
+    mFd = ::open(QFile::encodeName(mPath).constData(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (mFd < 0)
+    {
+        setErrorString(qt_error_string(errno));
+        return false;
+    }
+    struct stat st;
+    mFifo = (::fstat(mFd, &st) == 0) && S_ISFIFO(st.st_mode);
+    mWoken = false;
+    mFinished = false;
+
+    // Enabled only while the reader waits for data
+    mNotifier = new QSocketNotifier(mFd, QSocketNotifier::Read, this);
+    mNotifier->setEnabled(false);
+    connect(mNotifier, &QSocketNotifier::activated, this, &PipeSource::activated);
+    return QIODevice::open(mode | Unbuffered);
+#else
+    Q_UNUSED(mode);
+    setErrorString("Not supported on this platform");
+    return false;
+#endif
+}
+
+void PipeSource::close()
+{
+    if (!isOpen()) return;
+    QIODevice::close();
+
+    // Closed from a slot of readyRead() too
+    mNotifier->setEnabled(false);
+    mNotifier->deleteLater();
+    mNotifier = NULL;
+#if defined(Q_OS_UNIX)
+    ::close(mFd);
+#endif
+    mFd = -1;
+}
+
+qint64 PipeSource::readData(char *data, qint64 maxSize)
+{
+#if defined(Q_OS_UNIX)
+    if (mFinished) return -1;
+    qint64 r;
+    do
+        r = ::read(mFd, data, maxSize);
+    while ((r < 0) && (errno == EINTR));
+    if (r > 0)
+    {
+        mWoken = true;
+        return r;
+    }
+
+    // Nothing yet: a pipe also reads as ended before its writer opens it
+    if (((r < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) || ((r == 0) && mFifo && !mWoken))
+    {
+        mNotifier->setEnabled(true);
+        return 0;
+    }
+
+    if (r < 0) setErrorString(qt_error_string(errno));
+    finish();
+    return (r < 0) ? -1 : 0;
+#else
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+#endif
+}
+
+qint64 PipeSource::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
+
+// Readable, or hung up: the reader is told once, and reads again itself
+void PipeSource::activated()
+{
+    mNotifier->setEnabled(false);
+    mWoken = true;
+    emit readyRead();
+}
+
+void PipeSource::finish()
+{
+    mFinished = true;
+    mNotifier->setEnabled(false);
+    emit readChannelFinished();
+}
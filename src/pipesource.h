@@ -0,0 +1,44 @@
+#ifndef PIPESOURCE_H
+#define PIPESOURCE_H
+
+#include <QIODevice>
+#include <QString>
+
+class QSocketNotifier;
+
+// Named pipe or character device read without blocking the GUI thread:
+// readyRead() tells when the descriptor has data, readChannelFinished()
+// when all the writers are gone. read() returns 0 while there's nothing
+// yet. Unix only: elsewhere open() fails and such sources are read with
+// a plain QFile.
+class PipeSource : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    explicit PipeSource(const QString &path, QObject *parent = NULL);
+    ~PipeSource();
+
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override { return true; }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+private slots:
+    void activated();
+
+private:
+    void finish();
+
+    QString mPath;
+    int mFd;
+    bool mFifo;
+    bool mWoken;        // The descriptor has been readable (or hung up) once
+    bool mFinished;
+    QSocketNotifier *mNotifier;
+};
+
+#endif // PIPESOURCE_H
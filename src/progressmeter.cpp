@@ -0,0 +1,65 @@
+#include "progressmeter.h"
+
+#include <cmath>
+
+#include "duktoprotocol.h"
+
+ProgressMeter::ProgressMeter(DuktoProtocol *protocol, QObject *parent) :
+    QObject(parent), mProtocol(protocol), mLastTime(0), mLastTotal(0), mLastPartial(0), mLastUpdate(0),
+    mRate(0), mEta(-1), mSamples(0)
+{
+    mTimer.setInterval(INTERVAL);
+    mTimer.setTimerType(Qt::CoarseTimer);
+    connect(&mTimer, SIGNAL(timeout()), this, SLOT(sample()));
+}
+
+void ProgressMeter::start()
+{
+    mClock.start();
+    mLastTime = 0;
+    mLastTotal = 0;
+    mLastPartial = 0;
+    mLastUpdate = 0;
+    mRate = 0;
+    mEta = -1;
+    mTimer.start();
+}
+
+void ProgressMeter::sample()
+{
+    // Done: the UI gets the end of the transfer whatever the last sample was
+    // (the protocol doesn't report it anymore, the total may have been unknown)
+    if (!mProtocol->isBusy())
+    {
+        qint64 total = (mLastTotal > 0) ? mLastTotal : mLastPartial;
+        mEta = 0;
+        if (total > 0) emit progress(total, total);
+        mTimer.stop();
+        return;
+    }
+    mSamples++;
+
+    qint64 total, partial;
+    mProtocol->transferProgress(&total, &partial);
+    if (partial < mLastPartial) mLastPartial = partial;
+    qint64 now = mClock.elapsed();
+    qint64 elapsed = now - mLastTime;
+    if (elapsed <= 0) return;
+
+    // Average over the last seconds, whatever the sampling jitter
+    double instant = (partial - mLastPartial) * 1000.0 / elapsed;
+    if ((mRate == 0) && (partial > mLastPartial))
+        mRate = instant;
+    else
+        mRate += (1 - std::exp(-(double) elapsed / TIME_CONSTANT)) * (instant - mRate);
+    mEta = ((total > 0) && (mRate >= 1)) ? (qint64) std::ceil((total - partial) / mRate) : -1;
+
+    // Without progress, the rate and ETA are still updated now and then
+    bool moved = (partial != mLastPartial);
+    mLastTime = now;
+    mLastTotal = total;
+    mLastPartial = partial;
+    if (!moved && (now - mLastUpdate < STALL_UPDATE)) return;
+    mLastUpdate = now;
+    emit progress(total, partial);
+}
@@ -0,0 +1,52 @@
+#ifndef PROGRESSMETER_H
+#define PROGRESSMETER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+class DuktoProtocol;
+
+// Progress of the current transfer for the UI. The protocol only keeps
+// its counters up to date, they're sampled here INTERVAL ms apart while
+// it's busy, so the UI gets at most 20 updates a second whatever the
+// throughput. The rate is an exponentially weighted moving average of
+// the samples (TIME_CONSTANT ms), the ETA comes from it.
+class ProgressMeter : public QObject
+{
+    Q_OBJECT
+
+public:
+    static const int INTERVAL = 50;             // ms between samples
+    static const int TIME_CONSTANT = 3000;      // ms, of the rate average
+    static const int STALL_UPDATE = 1000;       // ms between updates without progress
+
+    explicit ProgressMeter(DuktoProtocol *protocol, QObject *parent = NULL);
+
+    // A transfer starts, sampled until the protocol is idle again
+    void start();
+
+    inline double rate() const { return mRate; }    // Bytes/s, 0 if unknown
+    inline qint64 eta() const { return mEta; }      // s, -1 if unknown
+    inline qint64 samples() const { return mSamples; }
+
+signals:
+    void progress(qint64 total, qint64 partial);
+
+private slots:
+    void sample();
+
+private:
+    DuktoProtocol *mProtocol;
+    QTimer mTimer;
+    QElapsedTimer mClock;
+    qint64 mLastTime;
+    qint64 mLastTotal;
+    qint64 mLastPartial;
+    qint64 mLastUpdate;
+    double mRate;
+    qint64 mEta;
+    qint64 mSamples;
+};
+
+#endif // PROGRESSMETER_H
@@ -14,6 +14,9 @@ Item {
         anchors.fill: parent
         visible: guiBehind.overlayState === "" && guiBehind.canAcceptDrop()
 
+        // Connect to the buddy while the files are being dragged
+        onEntered: guiBehind.prepareDrop()
+
         onDropped: function(drop) {
             if(guiBehind.canAcceptDrop()){
                 if (drop.hasUrls) {
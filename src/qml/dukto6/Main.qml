@@ -47,11 +47,6 @@ ApplicationWindow {
         source: "qrc:/src/assets//LiberationSans-Regular.ttf"
     }
 
-    FontLoader {
-        id: duktofonthappy
-        source: "qrc:/src/assets//KGLikeASkyscraper.ttf"
-    }
-
     DuktoInner {
         id: duktoInner
         anchors.fill: parent
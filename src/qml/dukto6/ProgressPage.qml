@@ -86,6 +86,28 @@ Rectangle {
                 color: theme.color6
                 width: parent.width * guiBehind.currentTransferProgress / 100;
             }
+
+            SText {
+                id: rateText
+                anchors.right: parent.right
+                anchors.verticalCenter: parent.verticalCenter
+                anchors.rightMargin: 10
+                font.pixelSize: 14
+                visible: guiBehind.currentTransferRate > 0
+                text: formatRate(guiBehind.currentTransferRate) + formatEta(guiBehind.currentTransferEta)
+
+                function formatRate(rate) {
+                    if (rate < 1024) return Math.round(rate) + " B/s";
+                    if (rate < 1048576) return (rate / 1024).toFixed(1) + " KB/s";
+                    return (rate / 1048576).toFixed(1) + " MB/s";
+                }
+
+                function formatEta(eta) {
+                    if (eta < 0) return "";
+                    var s = eta % 60;
+                    return " - " + Math.floor(eta / 60) + ":" + (s < 10 ? "0" : "") + s + qsTr(" left");
+                }
+            }
         }
 
         Button {
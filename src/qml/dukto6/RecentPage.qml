@@ -55,6 +55,8 @@ Item {
                     onClicked: {
                         if (type == "text")
                             guiBehind.showTextSnippet(value, sender);
+                        else if (type == "textfile")
+                            guiBehind.showTextFile(value, sender);
                         else if (type == "file")
                             guiBehind.openFile(value);
                     }
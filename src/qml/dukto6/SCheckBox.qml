@@ -0,0 +1,44 @@
+import QtQuick
+
+Item {
+    id: checkBox
+    width: box.width + 8 + textLabel.implicitWidth
+    height: 20
+
+    property bool checked: false
+    property alias label: textLabel.text
+    signal toggled(bool checked)
+
+    Rectangle {
+        id: box
+        width: 16
+        height: 16
+        anchors.verticalCenter: parent.verticalCenter
+        border.color: theme.color2
+        border.width: 2
+        color: checkArea.containsMouse ? theme.color8 : theme.color6
+
+        Rectangle {
+            anchors.fill: parent
+            anchors.margins: 4
+            color: theme.color2
+            visible: checkBox.checked
+        }
+    }
+
+    SText {
+        id: textLabel
+        anchors.left: box.right
+        anchors.leftMargin: 8
+        anchors.verticalCenter: parent.verticalCenter
+        color: theme.color5
+        font.pixelSize: 14
+    }
+
+    MouseArea {
+        id: checkArea
+        anchors.fill: parent
+        hoverEnabled: true
+        onClicked: checkBox.toggled(!checkBox.checked);
+    }
+}
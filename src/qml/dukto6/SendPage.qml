@@ -93,7 +93,7 @@ Rectangle {
         buddyOsLogo:destinationBuddy.osLogo
         buddyUsername: destinationBuddy.username
         buddySystem: destinationBuddy.system
-        buddyIpAddress: destinationBuddy.ip.substring(7)
+        buddyIpAddress: destinationBuddy.ip.substring(7) + (guiBehind.destinationReachable ? "" : qsTr(" (not reachable)"))
         buddyIp: "-"
     }
 
@@ -358,6 +358,120 @@ Rectangle {
         }
     }
 
+    SText {
+        id: labelNetwork
+        anchors {
+            left: labelPath.left
+            top: rectColorHexCode.bottom
+            topMargin: 25
+        }
+        font.pixelSize: 16
+        text: qsTr("Network:")
+        color: theme.color5
+    }
+
+    SCheckBox {
+        id: checkMulticast
+        anchors {
+            left: labelNetwork.left
+            top: labelNetwork.bottom
+            topMargin: 8
+        }
+        label: qsTr("Find buddies with multicast (less broadcast traffic)")
+        checked: guiBehind.multicastDiscovery
+        onToggled: checked => { guiBehind.multicastDiscovery = checked }
+    }
+
+    SText {
+        id: labelShares
+        anchors {
+            left: labelPath.left
+            top: checkMulticast.bottom
+            topMargin: 15
+        }
+        font.pixelSize: 16
+        text: qsTr("Share with browsers:")
+        color: theme.color5
+    }
+
+    Rectangle {
+        id: textShares
+        anchors {
+            left: parent.left
+            right: parent.right
+            top: labelShares.bottom
+            leftMargin: 17
+            rightMargin: 17
+            topMargin: 8
+        }
+        height: 30
+        color: theme.color2
+        clip: true
+
+        Image {
+            anchors {
+                top: parent.top
+                left: parent.left
+            }
+            source: "qrc:/src/assets/PanelGradient.png"
+        }
+
+        SText {
+            anchors.leftMargin: 5
+            anchors.rightMargin: 5
+            anchors.fill: parent
+            horizontalAlignment: "AlignLeft"
+            verticalAlignment: "AlignVCenter"
+            elide: "ElideMiddle"
+            font.pixelSize: 12
+            text: guiBehind.sharedPaths.length > 0 ? guiBehind.sharedPaths.map(constructCurrentPath).join("; ") : qsTr("Nothing shared")
+        }
+    }
+
+    ButtonDark {
+        id: buttonShareAdd
+        anchors.right: parent.right
+        anchors.rightMargin: 17
+        anchors.top: textShares.bottom
+        anchors.topMargin: 10
+        label: qsTr("Share folder")
+        enabled: Qt.platform.os !== "android"
+        opacity: Qt.platform.os === "android" ? 0.5 : 1.0
+        onClicked: shareDialog.open()
+    }
+
+    ButtonDark {
+        id: buttonShareClear
+        anchors.right: buttonShareAdd.left
+        anchors.rightMargin: 10
+        anchors.top: buttonShareAdd.top
+        label: qsTr("Stop sharing")
+        buttonEnabled: guiBehind.sharedPaths.length > 0
+        onClicked: guiBehind.sharedPaths = []
+    }
+
+    SCheckBox {
+        id: checkUploads
+        anchors {
+            left: labelShares.left
+            top: buttonShareAdd.bottom
+            topMargin: 10
+        }
+        label: qsTr("Accept files sent from browsers")
+        checked: guiBehind.acceptUploads
+        onToggled: checked => { guiBehind.acceptUploads = checked }
+    }
+
+    FolderDialog {
+        id: shareDialog
+        title: qsTr("Share Folder")
+        options: FolderDialog.ShowDirsOnly
+        currentFolder: guiBehind.currentPath
+        onAccepted: {
+            guiBehind.sharedPaths = guiBehind.sharedPaths.concat([shareDialog.selectedFolder.toString()]);
+        }
+    }
+
     FileFolderDialog {
         id: fileFolderDialog
         anchors.centerIn: parent
@@ -2,9 +2,42 @@
 
 #include <QDateTime>
 #include <QLocale>
+#include <QStandardPaths>
 
-RecentListItemModel::RecentListItemModel() :
-    QStandardItemModel(NULL)
+static QString typeName(HistoryLog::Kind kind)
+{
+    if (kind == HistoryLog::Text) return "text";
+    if (kind == HistoryLog::File) return "file";
+    if (kind == HistoryLog::TextFile) return "textfile";
+    return "misc";
+}
+
+static HistoryLog::Kind kindFromType(const QString &type)
+{
+    if (type == "text") return HistoryLog::Text;
+    if (type == "file") return HistoryLog::File;
+    if (type == "textfile") return HistoryLog::TextFile;
+    return HistoryLog::Misc;
+}
+
+static QString formatSize(qint64 size)
+{
+    if (size < 1024)
+        return QString::number(size) + " B";
+    else if (size < 1048576)
+        return QString::number(size * 1.0 / 1024, 'f', 1) + " KB";
+    else
+        return QString::number(size * 1.0 / 1048576, 'f', 1) + " MB";
+}
+
+RecentListItemModel::RecentListItemModel(const QString &folder) :
+    QAbstractListModel(NULL), mFiltering(false), mFilterHash(0), mFilterKind(-1), mLoaded(0), mPages(MAX_PAGES)
+{
+    mLog.open(folder.isEmpty() ? QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) : folder);
+    mLoaded = qMin(available(), FETCH_SIZE);
+}
+
+QHash<int, QByteArray> RecentListItemModel::roleNames() const
 {
     QHash<int, QByteArray> roleNames;
     roleNames[Name] = "name";
@@ -14,42 +47,131 @@ RecentListItemModel::RecentListItemModel() :
     roleNames[DateTime] = "dateTime";
     roleNames[Sender] = "sender";
     roleNames[Size] = "size";
-    setItemRoleNames(roleNames);
+    return roleNames;
+}
+
+// Rows there are, shown or not yet
+int RecentListItemModel::available() const
+{
+    return mFiltering ? mFiltered.size() : mLog.count();
+}
+
+// Entry of the log shown at row, newest first
+int RecentListItemModel::entryAt(int row) const
+{
+    if (mFiltering) return mFiltered.at(mFiltered.size() - 1 - row);
+    return mLog.count() - 1 - row;
+}
+
+bool RecentListItemModel::matches(int entry) const
+{
+    if ((mFilterKind >= 0) && (mLog.kindAt(entry) != mFilterKind)) return false;
+    if (mFilterSender.isEmpty()) return true;
+
+    // The record is only read when the hash matches
+    return (mLog.senderHashAt(entry) == mFilterHash)
+           && (mLog.entry(entry).sender == mFilterSender);
+}
+
+int RecentListItemModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : mLoaded;
+}
+
+bool RecentListItemModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && (mLoaded < available());
+}
+
+void RecentListItemModel::fetchMore(const QModelIndex &parent)
+{
+    if (parent.isValid()) return;
+    int n = qMin(FETCH_SIZE, available() - mLoaded);
+    if (n <= 0) return;
+    beginInsertRows(QModelIndex(), mLoaded, mLoaded + n - 1);
+    mLoaded += n;
+    endInsertRows();
+}
+
+QVariant RecentListItemModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || (index.row() >= mLoaded)) return QVariant();
+
+    // Page of the row, decoded if it isn't anymore
+    int page = index.row() / PAGE_SIZE;
+    QList<HistoryLog::Entry> *entries = mPages.object(page);
+    if (!entries)
+    {
+        entries = new QList<HistoryLog::Entry>();
+        int last = qMin(available(), (page + 1) * PAGE_SIZE);
+        for (int row = page * PAGE_SIZE; row < last; row++)
+            entries->append(mLog.entry(entryAt(row)));
+        mPages.insert(page, entries);
+    }
+    const HistoryLog::Entry &e = entries->at(index.row() % PAGE_SIZE);
+
+    switch (role)
+    {
+    case Name:
+        if (e.kind == HistoryLog::Text) return e.name;
+        return e.name + " (" + formatSize(e.size) + ")";
+    case Value: return e.value;
+    case Type: return typeName(e.kind);
+    case TypeIcon:
+        if ((e.kind == HistoryLog::Text) || (e.kind == HistoryLog::TextFile)) return "qrc:/src/assets/RecentText.png";
+        if (e.kind == HistoryLog::File) return "qrc:/src/assets/RecentFile.png";
+        return "qrc:/src/assets/RecentFiles.png";
+    case DateTime: return QLocale().toString(QDateTime::fromMSecsSinceEpoch(e.time), QLocale::ShortFormat);
+    case Sender: return e.sender;
+    case Size: return formatSize(e.size);
+    }
+    return QVariant();
 }
 
 void RecentListItemModel::addRecent(QString name, QString value, QString type, QString sender, qint64 size)
 {
-    QStandardItem* it = new QStandardItem();
+    HistoryLog::Entry e;
+    e.time = QDateTime::currentMSecsSinceEpoch();
+    e.size = size;
+    e.kind = kindFromType(type);
+    e.name = name;
+    e.value = value;
+    e.sender = sender;
 
-    // Format timestamp using QLocale
-    QDateTime now = QDateTime::currentDateTime();
-    QString datetime = QLocale().toString(now, QLocale::ShortFormat);
+    // Compacted past the cap, the rows are different then
+    int count = mLog.count();
+    if (!mLog.append(e)) return;
+    if (mLog.count() != count + 1)
+    {
+        setFilter(mFiltering ? mFilterSender : QString(), (mFilterKind < 0) ? QString() : typeName(static_cast<HistoryLog::Kind>(mFilterKind)));
+        return;
+    }
 
-    // Convert size data
-    QString sizeFormatted;
-    if (size < 1024)
-        sizeFormatted = QString::number(size) + " B";
-    else if (size < 1048576)
-        sizeFormatted = QString::number(size * 1.0 / 1024, 'f', 1) + " KB";
-    else
-        sizeFormatted = QString::number(size * 1.0 / 1048576, 'f', 1) + " MB";
+    if (mFiltering)
+    {
+        if (!matches(mLog.count() - 1)) return;
+        mFiltered.append(mLog.count() - 1);
+    }
 
-    // Icon
-    if (type == "text")
-        it->setData("qrc:/src/assets/RecentText.png", RecentListItemModel::TypeIcon);
-    else if (type == "file")
-        it->setData("qrc:/src/assets/RecentFile.png", RecentListItemModel::TypeIcon);
-    else
-        it->setData("qrc:/src/assets/RecentFiles.png", RecentListItemModel::TypeIcon);
+    // New first row, the pages start one row later
+    beginInsertRows(QModelIndex(), 0, 0);
+    mPages.clear();
+    mLoaded++;
+    endInsertRows();
+}
 
-    if (type == "text")
-        it->setData(name, RecentListItemModel::Name);
-    else
-        it->setData(name + " (" + sizeFormatted + ")", RecentListItemModel::Name);
-    it->setData(value, RecentListItemModel::Value);
-    it->setData(type, RecentListItemModel::Type);
-    it->setData(datetime, RecentListItemModel::DateTime);
-    it->setData(sender, RecentListItemModel::Sender);
-    it->setData(sizeFormatted, RecentListItemModel::Size);
-    insertRow(0, it);
+void RecentListItemModel::setFilter(const QString &sender, const QString &type)
+{
+    beginResetModel();
+    mFilterSender = sender;
+    mFilterHash = HistoryLog::senderHash(sender);
+    mFilterKind = type.isEmpty() ? -1 : kindFromType(type);
+    mFiltering = !sender.isEmpty() || !type.isEmpty();
+    mFiltered.clear();
+    if (mFiltering)
+        for (int i = 0; i < mLog.count(); i++)
+            if (matches(i)) mFiltered.append(i);
+    mPages.clear();
+    mLoaded = qMin(available(), FETCH_SIZE);
+    endResetModel();
 }
@@ -1,15 +1,32 @@
 #ifndef RECENTLISTITEMMODEL_H
 #define RECENTLISTITEMMODEL_H
 
-#include <QStandardItemModel>
+#include <QAbstractListModel>
+#include <QCache>
+#include <QList>
 
-class RecentListItemModel : public QStandardItemModel
+#include "historylog.h"
+
+// Transfers received, newest first, from the history log. Rows are made
+// available as the list scrolls (fetchMore()) and decoded by pages, of
+// which only MAX_PAGES are kept, so the memory used doesn't depend on the
+// length of the history. A filter (sender, type) is applied on the index.
+class RecentListItemModel : public QAbstractListModel
 {
     Q_OBJECT
 public:
-    explicit RecentListItemModel();
+    static const int PAGE_SIZE = 64;        // Rows decoded at once
+    static const int MAX_PAGES = 16;        // Kept decoded
+    static const int FETCH_SIZE = 256;      // Rows added by fetchMore()
+
+    // History in folder, the application data folder if empty
+    explicit RecentListItemModel(const QString &folder = QString());
     void addRecent(QString name, QString value, QString type, QString sender, qint64 size);
 
+    // Only the transfers from sender and of type ("text", "textfile",
+    // "file", "misc"), empty for any
+    Q_INVOKABLE void setFilter(const QString &sender, const QString &type);
+
     enum RecentRoles {
         Name = Qt::UserRole + 1,
         Value,
@@ -20,10 +37,29 @@ public:
         Size
     };
 
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
+
 signals:
 
 public slots:
 
+private:
+    int available() const;
+    int entryAt(int row) const;
+    bool matches(int entry) const;
+
+    HistoryLog mLog;
+    bool mFiltering;
+    QString mFilterSender;
+    quint32 mFilterHash;
+    int mFilterKind;                // -1 for any
+    QList<int> mFiltered;           // Entries matching, oldest first
+    int mLoaded;                    // Rows shown so far
+    mutable QCache<int, QList<HistoryLog::Entry> > mPages;
 };
 
 #endif // RECENTLISTITEMMODEL_H
@@ -3,6 +3,7 @@
 
 #include <QSettings>
 #include <QDir>
+#include <QUuid>
 #include "theme.h"
 
 #include <QDebug>
@@ -107,3 +108,73 @@ void Settings::saveBuddyName(QString name)
     // Update the static username when the buddyName is set
     Platform::updateUsername(name);
 }
+
+void Settings::saveLinkPolicy(int policy)
+{
+    mSettings.setValue("LinkPolicy", policy);
+    mSettings.sync();
+}
+
+int Settings::linkPolicy()
+{
+    // Links are sent as links by default (DuktoProtocol::LinksAsElements)
+    return mSettings.value("LinkPolicy", 0).toInt();
+}
+
+void Settings::saveDiscoveryMode(int mode)
+{
+    mSettings.setValue("DiscoveryMode", mode);
+    mSettings.sync();
+}
+
+int Settings::discoveryMode()
+{
+    // Broadcast by default (DuktoProtocol::BroadcastDiscovery)
+    return mSettings.value("DiscoveryMode", 0).toInt();
+}
+
+QByteArray Settings::instanceId()
+{
+    // Generated on first use, then kept
+    QByteArray id = QByteArray::fromHex(mSettings.value("InstanceId", "").toByteArray());
+    if (id.size() != 16) {
+        id = QUuid::createUuid().toRfc4122();
+        mSettings.setValue("InstanceId", id.toHex());
+        mSettings.sync();
+    }
+    return id;
+}
+
+void Settings::savePeerCache(QByteArray cache)
+{
+    mSettings.setValue("PeerCache", cache);
+    mSettings.sync();
+}
+
+QByteArray Settings::peerCache()
+{
+    return mSettings.value("PeerCache").toByteArray();
+}
+
+void Settings::saveSharedPaths(QStringList paths)
+{
+    mSettings.setValue("SharedPaths", paths);
+    mSettings.sync();
+}
+
+QStringList Settings::sharedPaths()
+{
+    // Share mode is off by default
+    return mSettings.value("SharedPaths").toStringList();
+}
+
+void Settings::saveAcceptUploads(bool accept)
+{
+    mSettings.setValue("AcceptUploads", accept);
+    mSettings.sync();
+}
+
+bool Settings::acceptUploads()
+{
+    return mSettings.value("AcceptUploads", false).toBool();
+}
@@ -4,6 +4,7 @@
 #include <QObject>
 #include <QSettings>
 #include <QRect>
+#include <QStringList>
 
 class Settings : public QObject
 {
@@ -22,6 +23,17 @@ public:
     bool showTermsOnStart();
     void saveBuddyName(QString name);
     QString buddyName();
+    void saveLinkPolicy(int policy);
+    int linkPolicy();
+    void saveDiscoveryMode(int mode);
+    int discoveryMode();
+    QByteArray instanceId();
+    void savePeerCache(QByteArray cache);
+    QByteArray peerCache();
+    void saveSharedPaths(QStringList paths);
+    QStringList sharedPaths();
+    void saveAcceptUploads(bool accept);
+    bool acceptUploads();
 
 signals:
 
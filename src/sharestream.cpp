@@ -0,0 +1,214 @@
+#include "sharestream.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QDateTime>
+#include <string.h>
+
+#if defined(Q_OS_LINUX)
+#include <sys/sendfile.h>
+#include <errno.h>
+#endif
+
+#define TAR_BLOCK 512
+
+ShareStream::ShareStream(const QString &path, qint64 offset, qint64 length) :
+    mCurrent(0), mPosition(0), mSize(length), mArchive(false)
+{
+    Entry e;
+    e.path = path;
+    e.offset = offset;
+    e.size = length;
+    e.padding = 0;
+    mEntries.append(e);
+}
+
+ShareStream::ShareStream(const QString &folder) :
+    mFolder(folder), mCurrent(0), mPosition(0), mSize(0), mArchive(true)
+{
+}
+
+void ShareStream::list()
+{
+    QString folder = mFolder;
+    QFileInfo root(folder);
+    QString base = root.fileName();
+    QDir dir(folder);
+    addTarEntry(folder, base, true, 0, root.lastModified().toSecsSinceEpoch());
+
+    QDirIterator it(folder, QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden | QDir::NoSymLinks,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext())
+    {
+        QString path = it.next();
+        QFileInfo info = it.fileInfo();
+        if (!info.isDir() && !info.isReadable()) continue;
+        addTarEntry(path, base + "/" + dir.relativeFilePath(path), info.isDir(),
+                    info.isDir() ? 0 : info.size(), info.lastModified().toSecsSinceEpoch());
+    }
+
+    // End of archive, two empty blocks
+    Entry e;
+    e.header = QByteArray(2 * TAR_BLOCK, '\0');
+    e.offset = 0;
+    e.size = 0;
+    e.padding = 0;
+    mEntries.append(e);
+    mSize += e.header.size();
+}
+
+void ShareStream::addTarEntry(const QString &path, const QString &name, bool folder, qint64 size, qint64 mtime)
+{
+    Entry e;
+    e.header = tarHeader(folder ? (name + "/").toUtf8() : name.toUtf8(), folder ? '5' : '0', size, mtime);
+    e.path = path;
+    e.offset = 0;
+    e.size = size;
+    e.padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    mEntries.append(e);
+    mSize += e.header.size() + e.size + e.padding;
+}
+
+// ustar header, preceded by a GNU long name entry if the name doesn't fit
+QByteArray ShareStream::tarHeader(const QByteArray &name, char type, qint64 size, qint64 mtime)
+{
+    QByteArray result;
+    QByteArray header(TAR_BLOCK, '\0');
+    char *h = header.data();
+
+    // Name, split between prefix (155) and name (100) if needed
+    if (name.size() <= 100)
+        memcpy(h, name.constData(), name.size());
+    else
+    {
+        qsizetype slash = name.lastIndexOf('/', 155);
+        qsizetype rest = name.size() - slash - 1;
+        if ((slash > 0) && (rest > 0) && (rest <= 100))
+        {
+            memcpy(h + 345, name.constData(), slash);
+            memcpy(h, name.constData() + slash + 1, rest);
+        }
+        else
+        {
+            QByteArray link = name + '\0';
+            result = tarHeader("././@LongLink", 'L', link.size(), 0) + link;
+            result.append(QByteArray((TAR_BLOCK - link.size() % TAR_BLOCK) % TAR_BLOCK, '\0'));
+            memcpy(h, name.constData(), 100);
+        }
+    }
+
+    memcpy(h + 100, (type == '5') ? "0000755" : "0000644", 8);
+    memcpy(h + 108, "0000000", 8);
+    memcpy(h + 116, "0000000", 8);
+
+    // Sizes from 8 GB are in base-256 (GNU extension)
+    if (size < (Q_INT64_C(1) << 33))
+        memcpy(h + 124, QByteArray::number(size, 8).rightJustified(11, '0').constData(), 11);
+    else
+    {
+        h[124] = (char) 0x80;
+        for (int i = 0; i < 8; i++)
+            h[135 - i] = (char) ((size >> (8 * i)) & 0xff);
+    }
+    memcpy(h + 136, QByteArray::number(mtime, 8).rightJustified(11, '0').constData(), 11);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    // Checksum, computed with its own field as spaces
+    memset(h + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char) h[i];
+    memcpy(h + 148, QByteArray::number(sum, 8).rightJustified(6, '0').constData(), 6);
+    h[154] = '\0';
+
+    return result + header;
+}
+
+qint64 ShareStream::read(char *data, qint64 max)
+{
+    qint64 done = 0;
+    while ((done < max) && (mCurrent < mEntries.size()))
+    {
+        const Entry &e = mEntries.at(mCurrent);
+        qint64 headerEnd = e.header.size();
+        qint64 dataEnd = headerEnd + e.size;
+        qint64 n;
+
+        if (mPosition < headerEnd)
+        {
+            n = qMin(max - done, headerEnd - mPosition);
+            memcpy(data + done, e.header.constData() + mPosition, n);
+        }
+        else if (mPosition < dataEnd)
+        {
+            if (!mFile.isOpen())
+            {
+                mFile.setFileName(e.path);
+                mFile.open(QIODevice::ReadOnly);
+            }
+
+            // send() doesn't move the file position
+            if (mFile.isOpen() && (mFile.pos() != e.offset + mPosition - headerEnd))
+                mFile.seek(e.offset + mPosition - headerEnd);
+            n = mFile.isOpen() ? mFile.read(data + done, qMin(max - done, dataEnd - mPosition)) : -1;
+            if (n <= 0)
+            {
+                if (!mArchive) return -1;
+
+                // Shrunk or gone, the size in the header still holds
+                n = qMin(max - done, dataEnd - mPosition);
+                memset(data + done, 0, n);
+            }
+        }
+        else if (mPosition < dataEnd + e.padding)
+        {
+            n = qMin(max - done, dataEnd + e.padding - mPosition);
+            memset(data + done, 0, n);
+        }
+        else
+        {
+            mFile.close();
+            mCurrent++;
+            mPosition = 0;
+            continue;
+        }
+
+        done += n;
+        mPosition += n;
+    }
+    return done;
+}
+
+qint64 ShareStream::send(qintptr socket, qint64 max)
+{
+#if defined(Q_OS_LINUX)
+    if (mArchive || (mCurrent >= mEntries.size())) return 0;
+    const Entry &e = mEntries.at(mCurrent);
+    if (mPosition >= e.size) return 0;
+    if (!mFile.isOpen())
+    {
+        mFile.setFileName(e.path);
+        if (!mFile.open(QIODevice::ReadOnly)) return -1;
+    }
+
+    off_t offset = e.offset + mPosition;
+    ssize_t n;
+    do
+        n = ::sendfile(socket, mFile.handle(), &offset, qMin(max, e.size - mPosition));
+    while ((n < 0) && (errno == EINTR));
+    // Socket full, or sendfile() not possible here: read() does it then
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINVAL) || (errno == ENOSYS))) return 0;
+
+    // Shrunk, or not readable
+    if (n <= 0) return -1;
+    mPosition += n;
+    return n;
+#else
+    Q_UNUSED(socket);
+    Q_UNUSED(max);
+    return 0;
+#endif
+}
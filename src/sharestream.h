@@ -0,0 +1,62 @@
+#ifndef SHARESTREAM_H
+#define SHARESTREAM_H
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QFile>
+
+// Body of a share mode download: a part of a file, or a whole folder as
+// a tar archive built on the fly. The size is known in advance (the folder
+// is listed before the stream is sent) and the data is produced as the
+// connection asks for it, so the memory used doesn't depend on the size.
+class ShareStream
+{
+public:
+    // Bytes [offset, offset + length) of a file
+    ShareStream(const QString &path, qint64 offset, qint64 length);
+
+    // Folder and its content (symbolic links left out) as a ustar archive,
+    // once listed by list()
+    explicit ShareStream(const QString &folder);
+
+    // Walks the folder, the only call allowed on another thread
+    void list();
+
+    inline qint64 size() const { return mSize; }
+
+    // Next bytes of the stream, 0 at the end and -1 if the file can't be
+    // read. Files of the archive that shrink are padded with zeros.
+    qint64 read(char *data, qint64 max);
+
+    // Next bytes of a file stream written by the kernel straight to the
+    // socket (sendfile(), Linux only): 0 if the socket is full or if it
+    // can't be done, -1 if the file can't be read. Mixed freely with read().
+    qint64 send(qintptr socket, qint64 max);
+
+private:
+    ShareStream(const ShareStream&) = delete;
+    ShareStream& operator=(const ShareStream&) = delete;
+
+    // Header bytes, then size bytes of the file from offset, then padding
+    struct Entry {
+        QByteArray header;
+        QString path;
+        qint64 offset;
+        qint64 size;
+        qint64 padding;
+    };
+
+    void addTarEntry(const QString &path, const QString &name, bool folder, qint64 size, qint64 mtime);
+    static QByteArray tarHeader(const QByteArray &name, char type, qint64 size, qint64 mtime);
+
+    QString mFolder;
+    QList<Entry> mEntries;
+    int mCurrent;
+    qint64 mPosition;       // In the current entry
+    qint64 mSize;
+    bool mArchive;
+    QFile mFile;
+};
+
+#endif // SHARESTREAM_H
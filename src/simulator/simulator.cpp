@@ -0,0 +1,958 @@
+// Discovery and transfer load simulator.
+//
+// Runs many virtual peers on loopback addresses (127.0.0.2, 127.0.0.3...)
+// against a Dukto instance, either created in this process (default,
+// headless, with the buddy list model attached) or already running
+// (--target). Reports the traffic, CPU time, peer list and model updates
+// and the latency of the transfers. With --http-clients the avatar web
+// server is loaded too, over keep-alive connections, and with
+// --upload-size a large file is uploaded to it while the memory used by
+// the process is watched. The progress updates the GUI would get for the
+// transfers are counted too. With --extended the virtual peers speak the
+// HELLO extension and hello each other, as a network of current clients.
+//
+// The benchmark modes (--model-bench...) only time a part of the
+// application. With --budget they fail (exit code 1) when an operation
+// costs more than allowed, e.g. --budget "insert=20,*=50" (us each, "*"
+// for the operations not listed); ctest runs them that way.
+//
+// Linux routes the whole 127.0.0.0/8 to the loopback interface; other
+// systems need the addresses as aliases (e.g. "ifconfig lo0 alias
+// 127.0.0.2" on macOS).
+
+#include <QCoreApplication>
+#include <QAbstractEventDispatcher>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTemporaryDir>
+#include <QRandomGenerator>
+#include <QTimer>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#include <QtNetwork/QUdpSocket>
+#include <QtEndian>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QUuid>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <cstdio>
+#include <ctime>
+
+#if defined(Q_OS_UNIX)
+#include <sys/resource.h>
+#endif
+
+#include "virtualpeer.h"
+#include "duktoprotocol.h"
+#include "buddylistitemmodel.h"
+#include "recentlistitemmodel.h"
+#include "historylog.h"
+#include "controlchannel.h"
+#include "miniwebserver.h"
+#include "progressmeter.h"
+#include "idlescheduler.h"
+#include "peer.h"
+#include "bufferpool.h"
+
+#if defined(__GLIBC__)
+// Heap allocations of the whole process, Qt included, counted by
+// interposing the allocator of the C library
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+static std::atomic<qint64> heapAllocations(0);
+extern "C" void *malloc(size_t size) noexcept { heapAllocations++; return __libc_malloc(size); }
+extern "C" void *calloc(size_t n, size_t size) noexcept { heapAllocations++; return __libc_calloc(n, size); }
+extern "C" void *realloc(void *p, size_t size) noexcept { heapAllocations++; return __libc_realloc(p, size); }
+#else
+static qint64 heapAllocations = -1;
+#endif
+
+struct Stats {
+    qint64 peersAdded = 0;
+    qint64 peersChanged = 0;
+    qint64 peersRemoved = 0;
+    qint64 rowsInserted = 0;
+    qint64 rowsRemoved = 0;
+    qint64 dataChanged = 0;
+    qint64 progressUpdates = 0;
+    qint64 replies = 0;
+    QList<qint64> transferLatency;  // us
+    QList<qint64> messageLatency;   // us
+    qint64 transferErrors = 0;
+    qint64 messageErrors = 0;
+    QList<qint64> httpLatency;      // us
+    qint64 httpErrors = 0;
+    qint64 uploadTime = -1;         // ms
+    qint64 rssStart = 0;            // KB
+    qint64 rssPeak = 0;
+};
+
+// Budgets of the benchmark modes, by operation ("*" for the others)
+static QHash<QByteArray, double> budgets;
+static bool overBudget = false;
+
+static void parseBudgets(const QString &spec)
+{
+    foreach (const QString &item, spec.split(',', Qt::SkipEmptyParts))
+    {
+        QString key = item.section('=', 0, 0).trimmed();
+        QString value = item.section('=', 1).trimmed();
+        if (value.isEmpty())
+        {
+            value = key;
+            key = "*";
+        }
+        budgets.insert(key.toUtf8(), value.toDouble());
+    }
+}
+
+// The measure of an operation, against its budget if any
+static void checkBudget(const char *what, double value)
+{
+    double budget = budgets.value(what, budgets.value("*", -1));
+    if ((budget < 0) || (value <= budget)) return;
+    printf("%-19s over budget: %.2f > %.2f\n", what, value, budget);
+    overBudget = true;
+}
+
+// Resident memory of the process (KB), Linux only
+static qint64 residentMemory()
+{
+    QFile status("/proc/self/status");
+    if (!status.open(QIODevice::ReadOnly)) return 0;
+    foreach (const QByteArray &line, status.readAll().split('\n'))
+        if (line.startsWith("VmRSS:"))
+            return line.mid(6).trimmed().split(' ').at(0).toLongLong();
+    return 0;
+}
+
+// Keep-alive client of the avatar web server
+struct HttpClient {
+    QTcpSocket socket;
+    QByteArray input;
+    qint64 start = 0;
+};
+
+static qint64 percentile(QList<qint64> values, double p)
+{
+    if (values.isEmpty()) return 0;
+    std::sort(values.begin(), values.end());
+    int i = qBound<int>(0, (int) (p * values.size()), values.size() - 1);
+    return values.at(i);
+}
+
+static QString latency(const QList<qint64> &values)
+{
+    if (values.isEmpty()) return "-";
+    return QString("n=%1 p50=%2ms p99=%3ms max=%4ms")
+        .arg(values.size())
+        .arg(percentile(values, 0.5) / 1000.0, 0, 'f', 2)
+        .arg(percentile(values, 0.99) / 1000.0, 0, 'f', 2)
+        .arg(*std::max_element(values.begin(), values.end()) / 1000.0, 0, 'f', 2);
+}
+
+// Text transfer with the legacy session layout, from the address of a peer
+static QByteArray textTransfer(const QByteArray &text)
+{
+    QByteArray data;
+    qint64 v = 1;
+    data.append((const char*) &v, sizeof(v));           // Elements
+    v = text.size();
+    data.append((const char*) &v, sizeof(v));           // Total size
+    data.append("___DUKTO___TEXT___");
+    data.append('\0');
+    data.append((const char*) &v, sizeof(v));           // Element size
+    data.append(text);
+    return data;
+}
+
+// Buddy list model alone, with n buddies: cost of the operations the
+// discovery drives, in us each
+static void modelBenchmark(int n)
+{
+    BuddyListItemModel model;
+    qint64 changes = 0;
+    QObject::connect(&model, &QAbstractItemModel::dataChanged, [&]() { changes++; });
+    model.addMeElement();
+    model.addIpElement();
+
+    QList<Peer> peers;
+    for (int i = 0; i < n; i++)
+    {
+        Peer p(QHostAddress((127u << 24) + 2 + i), QString(), 4644);
+        p.username = "peer" + QString::number(i);
+        p.system = "simulator";
+        p.platform = (i % 2) ? "Linux" : "Android";
+        peers.append(p);
+    }
+
+    QElapsedTimer timer;
+    auto report = [&](const char *what, int count) {
+        double us = timer.nsecsElapsed() / 1000.0 / qMax(1, count);
+        printf("%-19s %.2f us, %lld data changes\n", what, us, changes);
+        checkBudget(what, us);
+        changes = 0;
+        timer.start();
+    };
+
+    timer.start();
+    for (int i = 0; i < n; i++) model.addBuddy(peers[i]);
+    report("insert", n);
+    for (int i = 0; i < n; i++) model.addBuddy(peers[i]);
+    qint64 unchanged = changes;
+    report("same hello", n);
+    checkBudget("same hello changes", unchanged);
+    for (int i = 0; i < n; i++)
+    {
+        peers[i].username += "'";
+        model.addBuddy(peers[i]);
+    }
+    report("renamed", n);
+    for (int i = 0; i < n; i++) model.showSingleBack(QRandomGenerator::global()->bounded(model.rowCount()));
+    report("show back", n);
+    for (int i = 0; i < n; i++) model.data(model.index(i + 2), BuddyListItemModel::OsLogo);
+    report("read role", n);
+    for (int i = n - 1; i >= 0; i--) model.removeBuddy(peers.at(i).address.toString());
+    report("remove (last)", n);
+    fflush(stdout);
+}
+
+// History of n transfers in a temporary folder: cost of writing it, of
+// opening it again, of scrolling through it and of filtering it, and the
+// memory used
+static void historyBenchmark(int n)
+{
+    QTemporaryDir folder;
+    QElapsedTimer timer;
+    qint64 rss = residentMemory();
+    auto report = [&](const char *what, int count) {
+        double us = timer.nsecsElapsed() / 1000.0 / qMax(1, count);
+        printf("%-19s %.2f us, %lld MB resident\n", what, us, (residentMemory() - rss) / 1024);
+        checkBudget(what, us);
+        timer.start();
+    };
+
+    {
+        RecentListItemModel model(folder.path());
+        timer.start();
+        for (int i = 0; i < n; i++)
+            model.addRecent("file" + QString::number(i) + ".txt", "/tmp/file" + QString::number(i) + ".txt",
+                            (i % 10) ? "file" : "text", "peer" + QString::number(i % 100), 1000 + i);
+        report("append", n);
+    }
+
+    timer.start();
+    RecentListItemModel model(folder.path());
+    report("open", 1);
+
+    // Down the whole list, as a ListView asks for rows
+    int rows = 0;
+    while (model.canFetchMore(QModelIndex())) model.fetchMore(QModelIndex());
+    for (int i = 0; i < model.rowCount(); i++, rows++) model.data(model.index(i), RecentListItemModel::Name);
+    report("scroll per row", rows);
+
+    // Every entry is still there, or the newest ones past the compaction
+    int expected = (n <= HistoryLog::MAX_ENTRIES) ? n : HistoryLog::MAX_ENTRIES / 4 * 3;
+    printf("%-19s %d of %d\n", "rows", rows, expected);
+    checkBudget("missing rows", qMax(0, expected - rows));
+    for (int i = 0; i < 10000; i++)
+        model.data(model.index(QRandomGenerator::global()->bounded(model.rowCount())), RecentListItemModel::Name);
+    report("random row", 10000);
+
+    model.setFilter("peer42", QString());
+    report("filter by peer", 1);
+    model.setFilter(QString(), "text");
+    report("filter by type", 1);
+    fflush(stdout);
+}
+
+// Folder of n 1 KB files sent to a sink that discards them, with the
+// elements batched into large writes and without: time of each (ms), and
+// heap allocations per file and pool blocks allocated by the batched one
+static void sendBenchmark(int n)
+{
+    QTemporaryDir folder;
+    QDir root(folder.path());
+    root.mkdir("files");
+    QByteArray content(1024, 'f');
+    for (int i = 0; i < n; i++)
+    {
+        QFile file(root.filePath("files/file" + QString::number(i)));
+        if (file.open(QIODevice::WriteOnly)) file.write(content);
+    }
+
+    QTcpServer sink;
+    sink.listen(QHostAddress::LocalHost);
+    QObject::connect(&sink, &QTcpServer::newConnection, [&]() {
+        while (QTcpSocket *s = sink.nextPendingConnection())
+        {
+            QObject::connect(s, &QTcpSocket::readyRead, [s]() { s->readAll(); });
+            QObject::connect(s, &QTcpSocket::disconnected, s, &QObject::deleteLater);
+        }
+    });
+
+    double ms[2];
+    for (int batching = 1; batching >= 0; batching--)
+    {
+        DuktoProtocol sender;
+        sender.setSendBatching(batching);
+        QEventLoop loop;
+        bool failed = false;
+        QObject::connect(&sender, &DuktoProtocol::sendFileComplete, &loop, &QEventLoop::quit);
+        QObject::connect(&sender, &DuktoProtocol::sendFileError, [&]() { failed = true; loop.quit(); });
+        QElapsedTimer timer;
+        BufferPool::instance().resetCounters();
+        qint64 heap = heapAllocations;
+        timer.start();
+        sender.sendFile("127.0.0.1", sink.serverPort(), QStringList(root.filePath("files")));
+        loop.exec();
+        ms[batching] = timer.nsecsElapsed() / 1000000.0;
+        double perFile = (double) (heapAllocations - heap) / n;
+        printf("%-19s %.0f ms, %.2f us per file, %.1f heap allocations per file, %lld pool blocks allocated%s\n",
+               batching ? "batched" : "unbatched", ms[batching], ms[batching] * 1000 / n, perFile,
+               BufferPool::instance().allocations(), failed ? " (failed)" : "");
+        if (failed) overBudget = true;
+        if (!batching) continue;
+        if (heap >= 0) checkBudget("heap per file", perFile);
+        checkBudget("pool blocks", BufferPool::instance().allocations());
+    }
+
+    // Time of the batched sending for each ms of the other one, 0.1 for 10x
+    double ratio = ms[1] / qMax(0.001, ms[0]);
+    printf("%-19s %.3f (%.1fx faster)\n", "ratio", ratio, 1 / qMax(0.001, ratio));
+    checkBudget("ratio", ratio);
+    fflush(stdout);
+}
+
+// A file of mb MB sent from one instance to another on the port, the
+// receiving one updating a GUI as GuiBehind does (without QML): once per
+// chunk read, as the protocol used to signal, then as the ProgressMeter
+// samples it. Updates, time spent in them and CPU time of each run.
+static void progressBenchmark(int mb, qint16 port)
+{
+    QTemporaryDir folder;
+    QDir root(folder.path());
+    root.mkdir("in");
+    QString source = root.filePath("progress.bin");
+    {
+        QFile file(source);
+        QByteArray block(1048576, 'p');
+        if (file.open(QIODevice::WriteOnly))
+            for (int i = 0; i < mb; i++) file.write(block);
+    }
+
+    // Received files go to the current folder
+    QString previous = QDir::currentPath();
+    QDir::setCurrent(root.filePath("in"));
+
+    DuktoProtocol receiver;
+    receiver.setPorts(port, port);
+    receiver.initialize();
+    ProgressMeter meter(&receiver);
+    QObject::connect(&receiver, &DuktoProtocol::receiveFileStart, &meter, &ProgressMeter::start);
+
+    // What GuiBehind::transferStatusUpdate() formats for each update
+    bool perChunk = true;
+    QString stats;
+    qint64 updates = 0;
+    qint64 updateTime = 0;          // ns
+    auto update = [&](qint64 total, qint64 partial) {
+        QElapsedTimer timer;
+        timer.start();
+        stats = QString::number(partial * 1.0 / 1048576, 'f', 1) + " MB of "
+                + QString::number(total * 1.0 / 1048576, 'f', 1) + " MB, "
+                + QString::number(partial * 100.0 / qMax<qint64>(1, total), 'f', 0) + "%";
+        updates++;
+        updateTime += timer.nsecsElapsed();
+    };
+    QObject::connect(&meter, &ProgressMeter::progress, [&](qint64 total, qint64 partial) {
+        if (!perChunk) update(total, partial);
+    });
+
+    // A chunk is a wakeup of the event loop after which more bytes are in
+    qint64 chunks = 0;
+    qint64 lastPartial = 0;
+    QObject::connect(QAbstractEventDispatcher::instance(), &QAbstractEventDispatcher::awake, &receiver, [&]() {
+        qint64 total, partial;
+        receiver.transferProgress(&total, &partial);
+        if (partial <= lastPartial) return;
+        lastPartial = partial;
+        chunks++;
+        if (perChunk) update(total, partial);
+    });
+
+    qint64 counts[2];
+    double ms[2];
+    for (int run = 0; run < 2; run++)
+    {
+        perChunk = (run == 0);
+        updates = 0;
+        updateTime = 0;
+        chunks = 0;
+        lastPartial = 0;
+
+        DuktoProtocol sender;
+        QEventLoop loop;
+        bool failed = false;
+        QObject::connect(&receiver, &DuktoProtocol::receiveFileComplete, &loop, &QEventLoop::quit);
+        QObject::connect(&receiver, &DuktoProtocol::receiveFileCancelled, &loop, [&]() { failed = true; loop.quit(); });
+        QObject::connect(&sender, &DuktoProtocol::sendFileError, &loop, [&]() { failed = true; loop.quit(); });
+        std::clock_t cpu = std::clock();
+        sender.sendFile("127.0.0.1", port, QStringList(source));
+        loop.exec();
+        double cpuMs = (std::clock() - cpu) * 1000.0 / CLOCKS_PER_SEC;
+
+        counts[run] = updates;
+        ms[run] = updateTime / 1000000.0;
+        printf("%-19s %lld chunks, %lld updates, %.2f ms in updates, %.0f ms cpu%s\n", perChunk ? "per chunk" : "sampled",
+               chunks, updates, ms[run], cpuMs, failed ? " (failed)" : "");
+        if (failed) overBudget = true;
+        foreach (const QString &name, QDir().entryList(QDir::Files)) QFile::remove(name);
+    }
+    QDir::setCurrent(previous);
+
+    // Updates and time in them with the meter, for each one per chunk
+    double updateRatio = (double) counts[1] / qMax<qint64>(1, counts[0]);
+    double timeRatio = ms[1] / qMax(0.001, ms[0]);
+    printf("%-19s %.4f\n", "update ratio", updateRatio);
+    printf("%-19s %.4f (%.2f ms saved)\n", "update time ratio", timeRatio, ms[0] - ms[1]);
+    checkBudget("update ratio", updateRatio);
+    checkBudget("update time ratio", timeRatio);
+    fflush(stdout);
+}
+
+// n unicast hellos from peers loopback addresses to an instance on the
+// port, each peer known already: time and heap allocations for each,
+// datagrams lost. Hellos are sent in bursts that fit in the socket buffer.
+// With more than 100 peers the same is timed from 100 of them first, the
+// "growth" is the cost with all of them against that.
+static void helloBenchmark(int n, int peers, qint16 port)
+{
+    DuktoProtocol protocol;
+    protocol.setPorts(port, port);
+    protocol.initialize();
+
+    QList<QUdpSocket*> senders;
+    QList<QByteArray> hellos;
+    for (int i = 0; i < peers; i++)
+    {
+        QUdpSocket *socket = new QUdpSocket();
+        if (!socket->bind(QHostAddress((127u << 24) + 2 + i), 0))
+        {
+            printf("can't bind %s, are the loopback addresses available?\n",
+                   qPrintable(QHostAddress((127u << 24) + 2 + i).toString()));
+            overBudget = true;
+            qDeleteAll(senders);
+            delete socket;
+            return;
+        }
+        senders.append(socket);
+        QByteArray hello;
+        hello.append(0x05);             // 0x05 -> HELLO MESSAGE (unicast) with PORT
+        hello.append((const char*) &port, sizeof(port));
+        hello.append("bench" + QByteArray::number(i) + " at benchhost" + QByteArray::number(i) + " (Simulator)");
+        hellos.append(hello);
+    }
+
+    // count hellos, from the first "from" peers in turn: us per hello
+    qint64 lost = 0;
+    auto run = [&](int count, int from) {
+        QElapsedTimer timer;
+        QElapsedTimer idle;
+        qint64 start = protocol.datagramsHandled();
+        int sent = 0;
+        timer.start();
+        idle.start();
+        while (protocol.datagramsHandled() - start < sent || sent < count)
+        {
+            qint64 handled = protocol.datagramsHandled() - start;
+            for (; (sent < count) && (sent - handled < 128); sent++)
+                senders.at(sent % from)->writeDatagram(hellos.at(sent % from), QHostAddress((127u << 24) + 1), port);
+            QCoreApplication::processEvents();
+            if (protocol.datagramsHandled() - start != handled) idle.start();
+            else if (idle.elapsed() > 1000) break;      // Lost, not coming anymore
+        }
+        qint64 handled = protocol.datagramsHandled() - start;
+        lost += sent - handled;
+        return timer.nsecsElapsed() / 1000.0 / qMax<qint64>(1, handled);
+    };
+
+    // Every peer added first, the hellos timed are the repeated ones
+    run(peers, peers);
+    printf("%-19s %d of %d listed\n", "peers", protocol.getPeers().count(), peers);
+    checkBudget("unlisted", peers - protocol.getPeers().count());
+    lost = 0;
+    double few = (peers > 100) ? run(n, 100) : 0;
+
+    qint64 heap = heapAllocations;
+    qint64 start = protocol.datagramsHandled();
+    double us = run(n, peers);
+    double perHello = (double) (heapAllocations - heap) / qMax<qint64>(1, protocol.datagramsHandled() - start);
+
+    printf("%-19s %.2f us, %.0f hellos/s, %lld lost\n", "hello", us, 1000000 / qMax(0.001, us), lost);
+    if (heap >= 0) printf("%-19s %.1f\n", "heap per hello", perHello);
+    checkBudget("hello", us);
+    if (heap >= 0) checkBudget("heap per hello", perHello);
+    checkBudget("lost", lost);
+    if (few > 0)
+    {
+        printf("%-19s %.2f (%.2f us with 100 peers)\n", "growth", us / few, few);
+        checkBudget("growth", us / few);
+    }
+    fflush(stdout);
+    qDeleteAll(senders);
+}
+
+// Two instances sharing the instance ID (an installation cloned with its
+// settings) on ports port and port + 10 of this host hello each other:
+// each must list the other, and not itself. Exit code 1 otherwise.
+static int cloneTest(qint16 port)
+{
+    QByteArray id = QUuid::createUuid().toRfc4122();
+    DuktoProtocol a, b;
+    a.setPorts(port, port);
+    b.setPorts(port + 10, port + 10);
+    a.setInstanceId(id);
+    b.setInstanceId(id);
+    a.initialize();
+    b.initialize();
+
+    QHostAddress local((127u << 24) + 1);
+    QElapsedTimer timer;
+    timer.start();
+    while ((timer.elapsed() < 3000) && ((a.getPeers().count() == 0) || (b.getPeers().count() == 0)))
+    {
+        // Also to itself, which must be recognized
+        a.sayHello(local, port + 10);
+        b.sayHello(local, port);
+        a.sayHello(local, port);
+        QElapsedTimer wait;
+        wait.start();
+        while (wait.elapsed() < 100) QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+
+    bool ok = a.getPeers().contains(local) && (a.getPeers().count() == 1) && (b.getPeers().count() == 1)
+              && (a.getPeers().peer(local).port == port + 10) && (b.getPeers().peer(local).port == port);
+    printf("%-19s %s (%d and %d listed)\n", "cloned instances", ok ? "see each other" : "FAILED",
+           a.getPeers().count(), b.getPeers().count());
+    fflush(stdout);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("dukto-simulator");
+
+#if defined(Q_OS_UNIX)
+    // A socket per virtual peer, thousands of them
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+#endif
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Dukto discovery and transfer load simulator");
+    parser.addHelpOption();
+    QCommandLineOption peersOpt("peers", "Number of virtual peers.", "n", "200");
+    QCommandLineOption durationOpt("duration", "Length of the run (s).", "s", "30");
+    QCommandLineOption helloOpt("hello-interval", "Periodic hello of each peer (ms).", "ms", "10000");
+    QCommandLineOption churnOpt("churn", "Peers leaving and coming back each second.", "n", "0");
+    QCommandLineOption transferOpt("transfer-interval", "Pause between text transfers (ms, 0 = none).", "ms", "500");
+    QCommandLineOption messageOpt("message-interval", "Pause between control channel messages (ms, 0 = none).", "ms", "100");
+    QCommandLineOption sizeOpt("message-size", "Size of transfers and messages (bytes).", "bytes", "1024");
+    QCommandLineOption portOpt("port", "Port of the instance under test.", "port", "14644");
+    QCommandLineOption targetOpt("target", "Address of a running instance (none: one is created here).", "ip");
+    QCommandLineOption httpOpt("http-clients", "Keep-alive clients requesting the avatar (0 = none).", "n", "0");
+    QCommandLineOption uploadOpt("upload-size", "File uploaded to the web server (MB, 0 = none).", "MB", "0");
+    QCommandLineOption expectOpt("expect-all", "Exit with an error if not all the online peers are listed at the end, or on errors.");
+    QCommandLineOption modelOpt("model-bench", "Only time the buddy list model with n buddies.", "n");
+    QCommandLineOption historyOpt("history-bench", "Only time the transfer history with n entries.", "n");
+    QCommandLineOption sendOpt("send-bench", "Only time the sending of a folder of n 1 KB files.", "n");
+    QCommandLineOption helloBenchOpt("hello-bench", "Only time the handling of n hellos (from --peers addresses) by an instance on the port.", "n");
+    QCommandLineOption progressOpt("progress-bench", "Only compare the progress updates of a transfer of n MB, per chunk and sampled.", "MB");
+    QCommandLineOption cloneOpt("clone-test", "Only check that two instances with the same instance ID see each other.");
+    QCommandLineOption budgetOpt("budget", "Fail the benchmark modes beyond these costs (op=value,...; * for all).", "spec");
+    QCommandLineOption extendedOpt("extended", "Peers send the HELLO extension, and hello and answer each other.");
+    parser.addOptions({ peersOpt, durationOpt, helloOpt, churnOpt, transferOpt, messageOpt, sizeOpt, portOpt, targetOpt, httpOpt, uploadOpt, expectOpt, modelOpt, historyOpt,
+                        sendOpt, helloBenchOpt, progressOpt, cloneOpt, budgetOpt, extendedOpt });
+    parser.process(app);
+    parseBudgets(parser.value(budgetOpt));
+
+    if (parser.isSet(modelOpt))
+    {
+        modelBenchmark(qMax(1, parser.value(modelOpt).toInt()));
+        return overBudget ? 1 : 0;
+    }
+    if (parser.isSet(historyOpt))
+    {
+        historyBenchmark(qMax(1, parser.value(historyOpt).toInt()));
+        return overBudget ? 1 : 0;
+    }
+    if (parser.isSet(sendOpt))
+    {
+        sendBenchmark(qMax(1, parser.value(sendOpt).toInt()));
+        return overBudget ? 1 : 0;
+    }
+    if (parser.isSet(progressOpt))
+    {
+        progressBenchmark(qMax(1, parser.value(progressOpt).toInt()), parser.value(portOpt).toInt());
+        return overBudget ? 1 : 0;
+    }
+    if (parser.isSet(cloneOpt))
+        return cloneTest(parser.value(portOpt).toInt());
+    if (parser.isSet(helloBenchOpt))
+    {
+        helloBenchmark(qMax(1, parser.value(helloBenchOpt).toInt()), qMax(1, parser.value(peersOpt).toInt()),
+                       parser.value(portOpt).toInt());
+        return overBudget ? 1 : 0;
+    }
+
+    int peerCount = qMax(1, parser.value(peersOpt).toInt());
+    int duration = parser.value(durationOpt).toInt();
+    int helloInterval = qMax(100, parser.value(helloOpt).toInt());
+    int churn = parser.value(churnOpt).toInt();
+    int transferInterval = parser.value(transferOpt).toInt();
+    int messageInterval = parser.value(messageOpt).toInt();
+    int messageSize = qMax(16, parser.value(sizeOpt).toInt());
+    qint16 port = parser.value(portOpt).toInt();
+    int httpCount = parser.value(httpOpt).toInt();
+    qint64 uploadSize = parser.value(uploadOpt).toLongLong() * 1048576;
+    bool external = parser.isSet(targetOpt);
+    QHostAddress target(external ? parser.value(targetOpt) : "127.0.0.1");
+
+    Stats stats;
+    QElapsedTimer clock;
+    clock.start();
+
+    // Instance under test, with the buddy list as the GUI has it
+    DuktoProtocol *protocol = NULL;
+    BuddyListItemModel *model = NULL;
+    ProgressMeter *meter = NULL;
+    if (!external)
+    {
+        protocol = new DuktoProtocol();
+        model = new BuddyListItemModel();
+        protocol->setPorts(port, port);
+        protocol->setInstanceId(QUuid::createUuid().toRfc4122());
+        protocol->initialize();
+
+        QObject::connect(protocol, &DuktoProtocol::peerListAdded, [&](Peer peer) { stats.peersAdded++; model->addBuddy(peer); });
+        QObject::connect(protocol, &DuktoProtocol::peerListChanged, [&](Peer peer) { stats.peersChanged++; model->addBuddy(peer); });
+        QObject::connect(protocol, &DuktoProtocol::peerListRemoved, [&](Peer peer) {
+            stats.peersRemoved++;
+            model->removeBuddy(peer.address.toString());
+        });
+        QObject::connect(model, &QAbstractItemModel::rowsInserted, [&]() { stats.rowsInserted++; });
+        QObject::connect(model, &QAbstractItemModel::rowsRemoved, [&]() { stats.rowsRemoved++; });
+        QObject::connect(model, &QAbstractItemModel::dataChanged, [&]() { stats.dataChanged++; });
+
+        // Progress as the GUI samples it, whatever the number of chunks
+        meter = new ProgressMeter(protocol);
+        QObject::connect(protocol, &DuktoProtocol::receiveFileStart, meter, &ProgressMeter::start);
+        QObject::connect(meter, &ProgressMeter::progress, [&]() { stats.progressUpdates++; });
+    }
+
+    // Avatar web server, listening if there's an avatar to serve or
+    // uploads to receive (in the current folder, removed once complete)
+    MiniWebServer *web = NULL;
+    if (!external && ((httpCount > 0) || (uploadSize > 0)))
+    {
+        web = new MiniWebServer(port + 1);
+        web->setUploads(uploadSize > 0);
+
+        // The avatar is loaded off this thread, the clients wait for it
+        QEventLoop loading;
+        QObject::connect(web, &MiniWebServer::avatarReady, &loading, &QEventLoop::quit);
+        web->loadAvatar();
+        loading.exec();
+        if (!web->isListening()) qWarning("No avatar, the web server isn't running");
+        QObject::connect(web, &MiniWebServer::uploadComplete, [](const QStringList &files) {
+            for (const QString &file : files) QFile::remove(file);
+        });
+    }
+
+    // Virtual peers, one loopback address each
+    bool extended = parser.isSet(extendedOpt);
+    QList<QHostAddress> addresses;
+    for (int i = 0; i < peerCount; i++)
+        addresses.append(QHostAddress((127u << 24) + 2 + i));
+    QList<VirtualPeer*> peers;
+    for (int i = 0; i < peerCount; i++)
+    {
+        quint32 ip = (127u << 24) + 2 + i;
+        VirtualPeer *p = new VirtualPeer(i, QHostAddress(ip), port + 1);
+        if (!p->bind())
+        {
+            qCritical("Can't bind %s, are the loopback addresses available?", qPrintable(p->address().toString()));
+            return 2;
+        }
+        p->setTarget(target, port);
+        p->setExtended(extended, DuktoProtocol::FeatureChunkedElements | DuktoProtocol::FeatureLinkElements
+                                 | DuktoProtocol::FeatureSparseElements | DuktoProtocol::FeaturePreconnect
+                                 | DuktoProtocol::FeatureControlChannel);
+        if (extended) p->setNeighbours(addresses);
+        QObject::connect(p, &VirtualPeer::helloReceived, [&]() { stats.replies++; });
+        peers.append(p);
+    }
+
+    // Hellos: all the peers at start (in bursts), then periodic with jitter
+    for (VirtualPeer *p : std::as_const(peers))
+    {
+        QTimer::singleShot(p->index() / 50, p, [p]() { p->sayHello(); });
+        QTimer *t = new QTimer(p);
+        QObject::connect(t, &QTimer::timeout, p, [p, t, helloInterval]() {
+            if (p->isOnline()) p->sayHello();
+            t->setInterval(helloInterval * 9 / 10 + QRandomGenerator::global()->bounded(helloInterval / 5 + 1));
+        });
+        t->start(helloInterval);
+    }
+
+    // Churn: some peers leave, and come back two seconds later
+    QTimer churnTimer;
+    if (churn > 0)
+    {
+        QObject::connect(&churnTimer, &QTimer::timeout, [&]() {
+            for (int i = 0; i < churn; i++)
+            {
+                VirtualPeer *p = peers.at(QRandomGenerator::global()->bounded(peers.size()));
+                if (!p->isOnline()) continue;
+                p->sayGoodbye();
+                QTimer::singleShot(2000, p, [p]() { p->sayHello(); });
+            }
+        });
+        churnTimer.start(1000);
+    }
+
+    // Text transfers, one at a time (the instance takes one transfer at a
+    // time), each from a random peer address. Completed when the instance
+    // reports the text, or the connection is closed on an external target.
+    QByteArray payload(messageSize, 'x');
+    QTcpSocket *transfer = NULL;
+    qint64 transferStart = 0;
+    std::function<void()> startTransfer = [&]() {
+        VirtualPeer *p = peers.at(QRandomGenerator::global()->bounded(peers.size()));
+        transfer = new QTcpSocket();
+        transfer->bind(p->address());
+        transferStart = clock.nsecsElapsed() / 1000;
+        QObject::connect(transfer, &QTcpSocket::connected, [&]() { transfer->write(textTransfer(payload)); });
+        QObject::connect(transfer, &QTcpSocket::errorOccurred, [&](QAbstractSocket::SocketError e) {
+            QTcpSocket *s = transfer;
+            transfer = NULL;
+            s->deleteLater();
+            if (external && (e == QAbstractSocket::RemoteHostClosedError))
+                stats.transferLatency.append(clock.nsecsElapsed() / 1000 - transferStart);
+            else
+                stats.transferErrors++;
+            QTimer::singleShot(transferInterval, startTransfer);
+        });
+        transfer->connectToHost(target, port);
+    };
+    auto transferDone = [&]() {
+        stats.transferLatency.append(clock.nsecsElapsed() / 1000 - transferStart);
+        transfer->disconnect();
+        transfer->deleteLater();
+        transfer = NULL;
+        QTimer::singleShot(transferInterval, startTransfer);
+    };
+    if (protocol)
+    {
+        QObject::connect(protocol, &DuktoProtocol::receiveTextComplete, [&](QString *text, qint64) {
+            if (!transfer || (text->size() != payload.size())) return;
+            transferDone();
+        });
+
+        // Large texts are received into files (in the current folder)
+        QObject::connect(protocol, &DuktoProtocol::receiveTextFileComplete, [&](QString path, qint64 size) {
+            QFile::remove(path);
+            if (!transfer || (size != payload.size())) return;
+            transferDone();
+        });
+    }
+    if (transferInterval > 0) QTimer::singleShot(1000, startTransfer);
+
+    // Clipboard-sized messages on the control channel, one at a time
+    ControlChannel channel;
+    QByteArray message(messageSize / 2, 'm');
+    quint32 messageId = 0;
+    qint64 messageStart = 0;
+    std::function<void()> sendMessage = [&]() {
+        messageStart = clock.nsecsElapsed() / 1000;
+        messageId = channel.sendText(target.toString(), port, QString::fromLatin1(message));
+    };
+    QObject::connect(&channel, &ControlChannel::messageDelivered, [&](quint32 id) {
+        if (id != messageId) return;
+        stats.messageLatency.append(clock.nsecsElapsed() / 1000 - messageStart);
+        QTimer::singleShot(messageInterval, sendMessage);
+    });
+    QObject::connect(&channel, &ControlChannel::messageFailed, [&](quint32 id) {
+        if (id != messageId) return;
+        stats.messageErrors++;
+        QTimer::singleShot(messageInterval, sendMessage);
+    });
+    if (messageInterval > 0) QTimer::singleShot(1000, sendMessage);
+
+    // Avatar requests, each client sending the next one as soon as the
+    // previous response is complete. Connections closed by the server
+    // (request limit, too many clients) are opened again.
+    QByteArray httpRequest = "GET /dukto/avatar HTTP/1.1\r\nHost: dukto\r\n\r\n";
+    QList<HttpClient*> http;
+    qint64 httpStart = 0;
+    for (int i = 0; i < httpCount; i++)
+    {
+        HttpClient *c = new HttpClient();
+        auto request = [&, c]() {
+            c->start = clock.nsecsElapsed() / 1000;
+            c->socket.write(httpRequest);
+        };
+        QObject::connect(&c->socket, &QTcpSocket::connected, request);
+        QObject::connect(&c->socket, &QTcpSocket::readyRead, [&, c, request]() {
+            c->input.append(c->socket.readAll());
+            qsizetype end = c->input.indexOf("\r\n\r\n");
+            if (end < 0) return;
+            qint64 length = 0;
+            QList<QByteArray> lines = c->input.left(end).split('\n');
+            for (const QByteArray &line : std::as_const(lines))
+                if (line.toLower().startsWith("content-length:"))
+                    length = line.mid(15).trimmed().toLongLong();
+            if (c->input.size() < end + 4 + length) return;
+
+            if (lines.at(0).startsWith("HTTP/1.1 200"))
+                stats.httpLatency.append(clock.nsecsElapsed() / 1000 - c->start);
+            else
+                stats.httpErrors++;
+            c->input.remove(0, end + 4 + length);
+            if (c->socket.state() == QAbstractSocket::ConnectedState) request();
+        });
+        QObject::connect(&c->socket, &QTcpSocket::errorOccurred, [&, c](QAbstractSocket::SocketError e) {
+            if (e != QAbstractSocket::RemoteHostClosedError) stats.httpErrors++;
+            c->input.clear();
+            c->socket.abort();
+            QTimer::singleShot(100, [&, c]() { c->socket.connectToHost(target, port + 1); });
+        });
+        http.append(c);
+    }
+    if (httpCount > 0)
+        QTimer::singleShot(1000, [&]() {
+            httpStart = clock.elapsed();
+            for (HttpClient *c : std::as_const(http))
+                c->socket.connectToHost(target, port + 1);
+        });
+
+    // Upload of a large file, raw (PUT), with at most 1 MB queued here so
+    // that the memory growth is the server's
+    QTcpSocket upload;
+    qint64 uploadSent = 0;
+    qint64 uploadStart = 0;
+    QByteArray uploadBlock(65536, 'u');
+    QTimer rssTimer;
+    auto feedUpload = [&]() {
+        while ((uploadSent < uploadSize) && (upload.bytesToWrite() < 1048576))
+        {
+            qint64 n = qMin<qint64>(uploadBlock.size(), uploadSize - uploadSent);
+            upload.write(uploadBlock.constData(), n);
+            uploadSent += n;
+        }
+    };
+    QObject::connect(&upload, &QTcpSocket::connected, [&]() {
+        upload.write("PUT /upload/dukto-simulator-upload.bin HTTP/1.1\r\nHost: dukto\r\n"
+                     "Content-Length: " + QByteArray::number(uploadSize) + "\r\n\r\n");
+        feedUpload();
+    });
+    QObject::connect(&upload, &QTcpSocket::bytesWritten, feedUpload);
+    QObject::connect(&upload, &QTcpSocket::readyRead, [&]() {
+        if (upload.readAll().startsWith("HTTP/1.1 200")) stats.uploadTime = clock.elapsed() - uploadStart;
+        upload.disconnectFromHost();
+        rssTimer.stop();
+    });
+    QObject::connect(&rssTimer, &QTimer::timeout, [&]() { stats.rssPeak = qMax(stats.rssPeak, residentMemory()); });
+    if (uploadSize > 0)
+        QTimer::singleShot(1000, [&]() {
+            stats.rssStart = residentMemory();
+            stats.rssPeak = stats.rssStart;
+            uploadStart = clock.elapsed();
+            rssTimer.start(50);
+            upload.connectToHost(target, port + 1);
+        });
+
+    // Report
+    int exitCode = 0;
+    QTimer::singleShot(duration * 1000, [&]() {
+        double cpu = (double) std::clock() / CLOCKS_PER_SEC;
+        double wall = clock.elapsed() / 1000.0;
+        qint64 sent = 0, received = 0, replies = 0, skipped = 0, known = 0;
+        int online = 0;
+        for (const VirtualPeer *p : std::as_const(peers))
+        {
+            sent += p->datagramsSent();
+            received += p->datagramsReceived();
+            replies += p->repliesSent();
+            skipped += p->repliesSkipped();
+            known += p->knownPeers();
+            if (p->isOnline()) online++;
+        }
+
+        printf("peers               %d (%d online at the end)\n", peerCount, online);
+        printf("wall / cpu time     %.1f s / %.1f s (%.0f%%)\n", wall, cpu, 100.0 * cpu / wall);
+        printf("datagrams           %lld sent, %lld received (%lld hellos)\n", sent, received, stats.replies);
+        if (extended)
+            printf("between peers       %lld replies, %lld skipped (known), %.1f peers known each\n",
+                   replies, skipped, (double) known / peerCount);
+        printf("periodic work       %lld wakeups, %lld tasks run\n",
+               IdleScheduler::instance()->wakeups(), IdleScheduler::instance()->runs());
+        if (protocol)
+        {
+            int listed = protocol->getPeers().count();
+            printf("peer list           %d listed, %lld added, %lld changed, %lld removed\n",
+                   listed, stats.peersAdded, stats.peersChanged, stats.peersRemoved);
+            printf("buddy model         %lld inserts, %lld removals, %lld data changes\n",
+                   stats.rowsInserted, stats.rowsRemoved, stats.dataChanged);
+            if (parser.isSet(expectOpt) && (listed < online)) exitCode = 1;
+        }
+        printf("text transfers      %s, %lld errors\n", qPrintable(latency(stats.transferLatency)), stats.transferErrors);
+        if (parser.isSet(expectOpt) && (stats.transferErrors + stats.messageErrors + stats.httpErrors > 0)) exitCode = 1;
+
+        // Without churn, every extended peer knows the others and the instance
+        if (parser.isSet(expectOpt) && extended && (churn == 0) && (known < (qint64) online * online)) exitCode = 1;
+        if (meter)
+            printf("progress updates    %lld (%lld samples)\n", stats.progressUpdates, meter->samples());
+        printf("control messages    %s, %lld errors\n", qPrintable(latency(stats.messageLatency)), stats.messageErrors);
+        if (httpCount > 0)
+        {
+            double elapsed = qMax<qint64>(1, clock.elapsed() - httpStart) / 1000.0;
+            printf("avatar requests     %.0f req/s, %s, %lld errors\n",
+                   stats.httpLatency.size() / elapsed, qPrintable(latency(stats.httpLatency)), stats.httpErrors);
+        }
+        if (uploadSize > 0)
+        {
+            if (stats.uploadTime < 0)
+                printf("upload              incomplete, %lld of %lld MB sent\n", uploadSent / 1048576, uploadSize / 1048576);
+            else
+                printf("upload              %lld MB in %.1f s (%.0f MB/s)\n", uploadSize / 1048576, stats.uploadTime / 1000.0,
+                       uploadSize / 1048576.0 / qMax<qint64>(1, stats.uploadTime) * 1000);
+            printf("resident memory     %lld MB at start, %lld MB peak\n", stats.rssStart / 1024, stats.rssPeak / 1024);
+            checkBudget("rss growth", (stats.rssPeak - stats.rssStart) / 1024.0);
+            if (parser.isSet(expectOpt) && (stats.uploadTime < 0)) exitCode = 1;
+        }
+        fflush(stdout);
+
+        app.exit(exitCode);
+    });
+
+    int ret = app.exec();
+    qDeleteAll(http);
+    qDeleteAll(peers);
+    delete web;
+    delete meter;
+    delete protocol;
+    delete model;
+    return overBudget ? 1 : ret;
+}
@@ -0,0 +1,210 @@
+#include "virtualpeer.h"
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QtEndian>
+#include <string.h>
+
+#include "duktoprotocol.h"
+
+// Fields of the HELLO extension (see DuktoProtocol::helloExtension())
+#define EXT_FEATURES 0x01
+#define EXT_VERSION 0x03
+#define EXT_INSTANCE 0x04
+#define EXT_USER 0x05
+#define EXT_HOST 0x06
+#define EXT_PLATFORM 0x07
+#define EXT_PORTS 0x08
+#define EXT_KNOWN_IDS 0x0A
+
+static void appendField(QByteArray &packet, quint8 type, QByteArrayView value)
+{
+    quint16 length = qToLittleEndian<quint16>(value.size());
+    packet.append((char) type);
+    packet.append((const char*) &length, sizeof(length));
+    packet.append(value);
+}
+
+VirtualPeer::VirtualPeer(int index, const QHostAddress &address, qint16 port, QObject *parent) :
+    QObject(parent), mIndex(index), mAddress(address), mPort(port), mTargetPort(0),
+    mOnline(false), mExtended(false), mFeatures(0), mSent(0), mReceived(0), mReplies(0), mSkipped(0)
+{
+    mSignature = "sim" + QString::number(index) + " at simhost" + QString::number(index) + " (Simulator)";
+    mInstanceId = QByteArray(16, 0);
+    qToLittleEndian<quint32>(index + 1, mInstanceId.data());
+    connect(&mSocket, &QUdpSocket::readyRead, this, &VirtualPeer::readDatagrams);
+}
+
+bool VirtualPeer::bind()
+{
+    return mSocket.bind(mAddress, mPort);
+}
+
+void VirtualPeer::setTarget(const QHostAddress &address, qint16 port)
+{
+    mTarget = address;
+    mTargetPort = port;
+}
+
+void VirtualPeer::setExtended(bool extended, quint32 features)
+{
+    mExtended = extended;
+    mFeatures = features;
+}
+
+// 0x04/0x05 -> HELLO MESSAGE (broadcast/unicast) with PORT
+QByteArray VirtualPeer::hello(bool broadcast)
+{
+    QByteArray packet;
+    packet.append(broadcast ? 0x04 : 0x05);
+    packet.append((const char*) &mPort, sizeof(qint16));
+    packet.append(mSignature.toUtf8());
+    return packet;
+}
+
+QByteArray VirtualPeer::extension(bool broadcast)
+{
+    QByteArray packet;
+    packet.append(0x06);
+    quint32 features = qToLittleEndian<quint32>(mFeatures);
+    appendField(packet, EXT_FEATURES, QByteArrayView((const char*) &features, sizeof(features)));
+
+    quint8 version = 2;
+    appendField(packet, EXT_VERSION, QByteArrayView((const char*) &version, sizeof(version)));
+    appendField(packet, EXT_INSTANCE, mInstanceId);
+    appendField(packet, EXT_USER, "sim" + QByteArray::number(mIndex));
+    appendField(packet, EXT_HOST, "simhost" + QByteArray::number(mIndex));
+    appendField(packet, EXT_PLATFORM, "Simulator");
+    quint16 ports[3];
+    ports[0] = qToLittleEndian<quint16>(mPort);
+    ports[1] = qToLittleEndian<quint16>(mPort);
+    ports[2] = 0;
+    appendField(packet, EXT_PORTS, QByteArrayView((const char*) ports, sizeof(ports)));
+
+    if (broadcast && !mKnown.isEmpty())
+    {
+        QByteArray digests;
+        for (auto it = mKnown.constBegin(); it != mKnown.constEnd(); ++it)
+        {
+            quint32 digest = qToLittleEndian<quint32>(DuktoProtocol::peerDigest(it.value()));
+            digests.append((const char*) &digest, sizeof(digest));
+        }
+        appendField(packet, EXT_KNOWN_IDS, digests);
+    }
+    return packet;
+}
+
+void VirtualPeer::send(const QByteArray &extension, const QByteArray &hello, const QHostAddress &to, qint16 port)
+{
+    if (!extension.isEmpty())
+    {
+        mSocket.writeDatagram(extension, to, port);
+        mSent++;
+    }
+    mSocket.writeDatagram(hello, to, port);
+    mSent++;
+}
+
+void VirtualPeer::sayHello()
+{
+    QByteArray ext = mExtended ? extension(true) : QByteArray();
+    QByteArray packet = hello(true);
+    send(ext, packet, mTarget, mTargetPort);
+    if (mExtended)
+        for (const QHostAddress &n : std::as_const(mNeighbours))
+            if (n != mAddress) send(ext, packet, n, mPort);
+    mOnline = true;
+}
+
+void VirtualPeer::sayGoodbye()
+{
+    QByteArray packet;
+    packet.append(0x03);            // 0x03 -> GOODBYE
+    packet.append("Bye Bye");
+    mSocket.writeDatagram(packet, mTarget, mTargetPort);
+    mSent++;
+    if (mExtended)
+        for (const QHostAddress &n : std::as_const(mNeighbours))
+            if (n != mAddress)
+            {
+                mSocket.writeDatagram(packet, n, mPort);
+                mSent++;
+            }
+    mOnline = false;
+}
+
+// Instance ID of the sender, and known peers it lists: does it know us already?
+void VirtualPeer::handleExtension(const QByteArray &data, const QHostAddress &sender)
+{
+    QByteArrayView fields = QByteArrayView(data).sliced(1);
+    quint32 own = DuktoProtocol::peerDigest(mInstanceId);
+    bool knowsUs = false;
+    while (fields.size() >= 3)
+    {
+        quint8 type = fields.at(0);
+        quint16 length = qFromLittleEndian<quint16>(fields.data() + 1);
+        if (fields.size() < 3 + length) break;
+        QByteArrayView value = fields.sliced(3, length);
+        fields = fields.sliced(3 + length);
+        if ((type == EXT_INSTANCE) && !value.isEmpty())
+            mInstanceIds.insert(sender, value.toByteArray());
+        else if (type == EXT_KNOWN_IDS)
+            for (qsizetype i = 0; i + 3 < value.size(); i += 4)
+                if (qFromLittleEndian<quint32>(value.data() + i) == own) knowsUs = true;
+    }
+    if (knowsUs)
+        mKnownBy.insert(sender);
+    else
+        mKnownBy.remove(sender);
+}
+
+// Hellos and replies of the target and of the other peers
+void VirtualPeer::readDatagrams()
+{
+    while (mSocket.hasPendingDatagrams())
+    {
+        QByteArray data(mSocket.pendingDatagramSize(), 0);
+        QHostAddress sender;
+        quint16 senderPort;
+        mSocket.readDatagram(data.data(), data.size(), &sender, &senderPort);
+        mReceived++;
+        if (data.isEmpty()) continue;
+        char type = data.at(0);
+
+        if (type == 0x06)
+        {
+            if (mExtended) handleExtension(data, sender);
+            continue;
+        }
+        if (type == 0x03)
+        {
+            mKnown.remove(sender);
+            mInstanceIds.remove(sender);
+            continue;
+        }
+        if ((type != 0x01) && (type != 0x02) && (type != 0x04) && (type != 0x05)) continue;
+        if (sender == mTarget) emit helloReceived(mIndex);
+        if (!mExtended) continue;
+
+        // Signature after the type, and the port for 0x04/0x05
+        qint16 port = 4644;
+        int offset = 1;
+        if ((type == 0x04) || (type == 0x05))
+        {
+            if (data.size() < 3) continue;
+            memcpy(&port, data.constData() + 1, sizeof(port));
+            offset = 3;
+        }
+        mKnown.insert(sender, mInstanceIds.value(sender, data.mid(offset)));
+
+        // Broadcast hellos get a reply, unless the sender knows us
+        if ((type != 0x01) && (type != 0x04)) continue;
+        if (mKnownBy.remove(sender))
+        {
+            mSkipped++;
+            continue;
+        }
+        send(extension(false), hello(false), sender, port);
+        mReplies++;
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef VIRTUALPEER_H
+#define VIRTUALPEER_H
+
+#include <QObject>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QtNetwork/QUdpSocket>
+#include <QtNetwork/QHostAddress>
+
+// A peer of the simulator: speaks the discovery side of the Dukto
+// protocol from its own loopback address, so that the instance under
+// test sees it as a separate host.
+//
+// Legacy peers only send hellos to the target. Extended peers send the
+// HELLO extension first (features, v2 identity, digests of the peers
+// they know), "broadcast" their hellos to the target and to the other
+// extended peers (loopback has no broadcast), and answer the broadcast
+// hellos they get unless the sender already knows them, as the real
+// client does.
+class VirtualPeer : public QObject
+{
+    Q_OBJECT
+
+public:
+    VirtualPeer(int index, const QHostAddress &address, qint16 port, QObject *parent = NULL);
+
+    bool bind();
+    void setTarget(const QHostAddress &address, qint16 port);
+    void setExtended(bool extended, quint32 features);
+
+    // Addresses of the peers that get the "broadcast" hellos, besides the target
+    inline void setNeighbours(const QList<QHostAddress> &neighbours) { mNeighbours = neighbours; }
+
+    // HELLO of the broadcast type (asks for a reply)
+    void sayHello();
+    void sayGoodbye();
+
+    inline int index() const { return mIndex; }
+    inline const QHostAddress& address() const { return mAddress; }
+    inline bool isOnline() const { return mOnline; }
+    inline QString signature() const { return mSignature; }
+    inline qint64 datagramsSent() const { return mSent; }
+    inline qint64 datagramsReceived() const { return mReceived; }
+    inline qint64 repliesSent() const { return mReplies; }
+    inline qint64 repliesSkipped() const { return mSkipped; }
+    inline int knownPeers() const { return mKnown.size(); }
+
+signals:
+    void helloReceived(int index);
+
+private slots:
+    void readDatagrams();
+
+private:
+    QByteArray hello(bool broadcast);
+    QByteArray extension(bool broadcast);
+    void send(const QByteArray &extension, const QByteArray &hello, const QHostAddress &to, qint16 port);
+    void handleExtension(const QByteArray &data, const QHostAddress &sender);
+
+    int mIndex;
+    QHostAddress mAddress;
+    qint16 mPort;
+    QHostAddress mTarget;
+    qint16 mTargetPort;
+    QList<QHostAddress> mNeighbours;
+    QString mSignature;
+    QByteArray mInstanceId;
+    QUdpSocket mSocket;
+    bool mOnline;
+    bool mExtended;
+    quint32 mFeatures;
+    QHash<QHostAddress, QByteArray> mKnown;     // Peers heard from -> identity used for their digest
+    QHash<QHostAddress, QByteArray> mInstanceIds;   // Instance IDs of the extended peers
+    QSet<QHostAddress> mKnownBy;                // Peers whose last extension listed us
+    qint64 mSent;
+    qint64 mReceived;
+    qint64 mReplies;
+    qint64 mSkipped;
+};
+
+#endif // VIRTUALPEER_H
@@ -0,0 +1,84 @@
+#include "startuptrace.h"
+
+#include <QCoreApplication>
+#include <QFile>
+#include <cstdio>
+
+bool StartupTrace::sEnabled = false;
+bool StartupTrace::sFinished = false;
+QString StartupTrace::sFile;
+qint64 StartupTrace::sBudget = -1;
+qint64 StartupTrace::sFirstFrame = -1;
+QElapsedTimer StartupTrace::sClock;
+QList<QPair<QByteArray, qint64> > StartupTrace::sPhases;
+
+void StartupTrace::start(int argc, char *argv[])
+{
+    sClock.start();
+
+    // Parsed by hand, the application doesn't exist yet
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        QByteArray arg(argv[i]);
+        if (arg == "--startup-trace")
+            sFile = QString::fromLocal8Bit(argv[++i]);
+        else if (arg == "--startup-budget")
+            sBudget = QByteArray(argv[++i]).toLongLong();
+    }
+    if ((sBudget >= 0) && sFile.isEmpty()) sFile = "-";
+    sEnabled = !sFile.isEmpty();
+}
+
+void StartupTrace::mark(const char *phase)
+{
+    if (!sEnabled || sFinished) return;
+    sPhases.append(qMakePair(QByteArray(phase), sClock.nsecsElapsed()));
+}
+
+void StartupTrace::firstFrame()
+{
+    if (!sEnabled || (sFirstFrame >= 0)) return;
+    sFirstFrame = sClock.nsecsElapsed();
+    mark("first frame");
+}
+
+void StartupTrace::finish()
+{
+    if (!sEnabled || sFinished) return;
+    mark("deferred initialization done");
+    sFinished = true;
+
+    // Time since the start of main() and spent in the phase
+    QByteArray report = "# Dukto startup trace, ms\n";
+    qint64 previous = 0;
+    for (int i = 0; i < sPhases.size(); i++)
+    {
+        qint64 at = sPhases.at(i).second;
+        report += QByteArray::number(at / 1e6, 'f', 1).rightJustified(9) + " "
+                  + QByteArray::number((at - previous) / 1e6, 'f', 1).rightJustified(9) + "  "
+                  + sPhases.at(i).first + "\n";
+        previous = at;
+    }
+
+    bool exceeded = false;
+    if (sBudget >= 0)
+    {
+        exceeded = (sFirstFrame < 0) || (sFirstFrame / 1000000 > sBudget);
+        report += "budget " + QByteArray::number(sBudget) + " ms for the first frame: "
+                  + (exceeded ? "exceeded" : "ok") + "\n";
+    }
+
+    if (sFile == "-")
+        fputs(report.constData(), stderr);
+    else
+    {
+        QFile file(sFile);
+        if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            file.write(report);
+        else
+            fprintf(stderr, "Can't write the startup trace to %s\n", qPrintable(sFile));
+    }
+
+    // The measure was all that was asked for
+    if (sBudget >= 0) QCoreApplication::exit(exceeded ? 1 : 0);
+}
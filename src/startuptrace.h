@@ -0,0 +1,43 @@
+#ifndef STARTUPTRACE_H
+#define STARTUPTRACE_H
+
+#include <QElapsedTimer>
+#include <QByteArray>
+#include <QString>
+#include <QList>
+#include <QPair>
+
+// Time of each startup phase, from the start of main(), to see what keeps
+// the window from showing up. Off unless asked for on the command line:
+//
+//   --startup-trace <file>     report written there ("-" for stderr) once
+//                              the deferred initialization is done
+//   --startup-budget <ms>      quits at that point, exit code 1 if the
+//                              first frame took longer than the budget
+//
+// Used from the GUI thread only.
+class StartupTrace
+{
+public:
+    // Starts the clock, first thing in main()
+    static void start(int argc, char *argv[]);
+
+    static void mark(const char *phase);
+    static void firstFrame();
+
+    // Writes the report, and applies the budget if any
+    static void finish();
+
+    static inline bool enabled() { return sEnabled; }
+
+private:
+    static bool sEnabled;
+    static bool sFinished;
+    static QString sFile;
+    static qint64 sBudget;          // ms, -1 if none
+    static qint64 sFirstFrame;      // ns, -1 until shown
+    static QElapsedTimer sClock;
+    static QList<QPair<QByteArray, qint64> > sPhases;
+};
+
+#endif // STARTUPTRACE_H
@@ -0,0 +1,292 @@
+#include "uploadreceiver.h"
+
+#include <QFile>
+
+#include "duktoprotocol.h"
+
+#if defined(Q_OS_LINUX)
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+// Base name only (some browsers send the full path), nothing to climb with
+static QString safeName(const QString &name)
+{
+    QString n = name.section('/', -1).section('\\', -1).trimmed();
+    if ((n == ".") || (n == "..")) return QString();
+    return n;
+}
+
+// filename="..." of the Content-Disposition header of a part
+static QString partFileName(const QByteArray &headers)
+{
+    foreach (const QByteArray &line, headers.split('\n'))
+    {
+        QByteArray lower = line.trimmed().toLower();
+        if (!lower.startsWith("content-disposition:")) continue;
+        qsizetype at = lower.indexOf("filename=");
+        if (at < 0) return QString();
+        QByteArray value = line.trimmed().mid(at + 9).trimmed();
+        if (value.startsWith('"'))
+        {
+            value.remove(0, 1);
+            qsizetype quote = value.indexOf('"');
+            if (quote >= 0) value.truncate(quote);
+        }
+        else
+        {
+            qsizetype semicolon = value.indexOf(';');
+            if (semicolon >= 0) value.truncate(semicolon);
+        }
+        return QString::fromUtf8(value.trimmed());
+    }
+    return QString();
+}
+
+UploadReceiver::UploadReceiver(const QByteArray &contentType, qint64 length, const QString &name, qint64 maxSize) :
+    mRemaining(length), mChunked(length < 0), mChunkState(ChunkSize), mMultipart(false),
+    mPartState(Preamble), mFile(NULL), mWritten(0), mSize(0), mMaxSize(maxSize), mTooLarge(false), mFailed(false)
+{
+    if (contentType.toLower().startsWith("multipart/form-data"))
+    {
+        qsizetype at = contentType.toLower().indexOf("boundary=");
+        QByteArray boundary = (at < 0) ? QByteArray() : contentType.mid(at + 9);
+        qsizetype semicolon = boundary.indexOf(';');
+        if (semicolon >= 0) boundary.truncate(semicolon);
+        boundary = boundary.trimmed();
+        if (boundary.startsWith('"') && boundary.endsWith('"') && (boundary.size() > 1))
+            boundary = boundary.mid(1, boundary.size() - 2);
+        mMultipart = true;
+        mFailed = boundary.isEmpty();
+        mDelimiter = "\r\n--" + boundary;
+
+        // The first delimiter isn't preceded by a line break
+        mPending = "\r\n";
+    }
+    else
+        mFailed = !openFile(name, length);
+}
+
+UploadReceiver::~UploadReceiver()
+{
+    // Incomplete file
+    if (mFile)
+    {
+        mFile->close();
+        mFile->remove();
+        delete mFile;
+    }
+}
+
+UploadReceiver::Status UploadReceiver::feed(QByteArray &input)
+{
+    if (mFailed) return Failed;
+
+    qsizetype used = 0;
+    Status status = NeedMore;
+    if (!mChunked)
+    {
+        qint64 n = qMin<qint64>(mRemaining, input.size());
+        used = n;
+        if (!content(input.constData(), n))
+            status = Failed;
+        else if ((mRemaining -= n) == 0)
+            status = contentEnd() ? Finished : Failed;
+    }
+    else
+    {
+        bool progress = true;
+        while (progress && (status == NeedMore))
+        {
+            progress = false;
+            if (mChunkState == ChunkData)
+            {
+                qint64 n = qMin<qint64>(mRemaining, input.size() - used);
+                if (n == 0) break;
+                if (!content(input.constData() + used, n)) status = Failed;
+                used += n;
+                mRemaining -= n;
+                if (mRemaining == 0) mChunkState = ChunkDataEnd;
+                progress = true;
+                continue;
+            }
+
+            // Chunk size, end of chunk data and trailer are lines
+            qsizetype eol = input.indexOf("\r\n", used);
+            if (eol < 0)
+            {
+                if (input.size() - used > MAX_HEADERS_SIZE) status = Failed;
+                break;
+            }
+            QByteArray line = input.mid(used, eol - used);
+            used = eol + 2;
+            progress = true;
+
+            if (mChunkState == ChunkSize)
+            {
+                qsizetype semicolon = line.indexOf(';');
+                if (semicolon >= 0) line.truncate(semicolon);
+                bool ok;
+                mRemaining = line.trimmed().toLongLong(&ok, 16);
+                if (!ok || (mRemaining < 0)) status = Failed;
+                else mChunkState = (mRemaining == 0) ? ChunkTrailer : ChunkData;
+            }
+            else if (mChunkState == ChunkDataEnd)
+            {
+                if (!line.isEmpty()) status = Failed;
+                else mChunkState = ChunkSize;
+            }
+            else if (line.isEmpty())
+                status = contentEnd() ? Finished : Failed;
+        }
+    }
+
+    input.remove(0, used);
+    if (status == Failed) mFailed = true;
+    return status;
+}
+
+bool UploadReceiver::content(const char *data, qint64 size)
+{
+    if (!mMultipart) return write(data, size);
+    mPending.append(data, size);
+    return parts();
+}
+
+bool UploadReceiver::contentEnd()
+{
+    // Multipart bodies end with the last delimiter
+    if (mMultipart) return (mPartState == Epilogue) && !mFile;
+    return closeFile();
+}
+
+bool UploadReceiver::write(const char *data, qint64 size)
+{
+    if (size == 0) return true;
+    if (mSize + mWritten + size > mMaxSize)
+    {
+        mTooLarge = true;
+        return false;
+    }
+    if (mFile->write(data, size) != size) return false;
+    mWritten += size;
+    return true;
+}
+
+// Walks the multipart content received so far, writing the file parts
+bool UploadReceiver::parts()
+{
+    forever
+    {
+        switch (mPartState)
+        {
+        case Preamble:
+        case Data:
+        {
+            // The end might be the start of a delimiter, kept for later
+            qsizetype at = mPending.indexOf(mDelimiter);
+            qsizetype n = (at < 0) ? qMax<qsizetype>(0, mPending.size() - mDelimiter.size() + 1) : at;
+            if ((mPartState == Data) && mFile && !write(mPending.constData(), n)) return false;
+            if (at < 0)
+            {
+                mPending.remove(0, n);
+                return true;
+            }
+            mPending.remove(0, at + mDelimiter.size());
+            if ((mPartState == Data) && mFile && !closeFile()) return false;
+            mPartState = Delimiter;
+            break;
+        }
+
+        case Delimiter:
+        {
+            if (mPending.size() < 2) return true;
+            if (mPending.startsWith("--"))
+            {
+                mPartState = Epilogue;
+                break;
+            }
+            qsizetype eol = mPending.indexOf("\r\n");
+            if (eol < 0) return mPending.size() <= MAX_HEADERS_SIZE;
+            mPending.remove(0, eol + 2);
+            mPartState = Headers;
+            break;
+        }
+
+        case Headers:
+        {
+            QByteArray headers;
+            if (mPending.startsWith("\r\n"))
+                mPending.remove(0, 2);
+            else
+            {
+                qsizetype end = mPending.indexOf("\r\n\r\n");
+                if (end < 0) return mPending.size() <= MAX_HEADERS_SIZE;
+                headers = mPending.left(end);
+                mPending.remove(0, end + 4);
+            }
+
+            // Parts without a file name (form fields, no file chosen) are skipped
+            QString name = safeName(partFileName(headers));
+            if (!name.isEmpty() && !openFile(name, mChunked ? -1 : mRemaining + mPending.size())) return false;
+            mPartState = Data;
+            break;
+        }
+
+        case Epilogue:
+            mPending.clear();
+            return true;
+        }
+    }
+}
+
+bool UploadReceiver::openFile(const QString &name, qint64 sizeHint)
+{
+    QString n = safeName(name);
+    if (n.isEmpty()) return false;
+
+    // Same rule as the transfers from other Dukto instances
+    mFile = new QFile(DuktoProtocol::availableName(n));
+    if (!mFile->open(QIODevice::WriteOnly))
+    {
+        delete mFile;
+        mFile = NULL;
+        return false;
+    }
+    mWritten = 0;
+
+    // Blocks reserved up front (the space left is checked at once), the
+    // file is truncated to its real size at the end
+    if ((sizeHint > 0) && (mSize + sizeHint <= mMaxSize))
+    {
+#if defined(Q_OS_LINUX)
+        if (posix_fallocate(mFile->handle(), 0, sizeHint) == ENOSPC)
+#else
+        if (!mFile->resize(sizeHint))
+#endif
+        {
+            mFile->close();
+            mFile->remove();
+            delete mFile;
+            mFile = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool UploadReceiver::closeFile()
+{
+    bool ok = mFile->flush() && mFile->resize(mWritten);
+    mFile->close();
+    if (ok)
+    {
+        mFiles.append(mFile->fileName());
+        mSize += mWritten;
+    }
+    else
+        mFile->remove();
+    delete mFile;
+    mFile = NULL;
+    return ok;
+}
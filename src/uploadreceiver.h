@@ -0,0 +1,86 @@
+#ifndef UPLOADRECEIVER_H
+#define UPLOADRECEIVER_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+
+class QFile;
+
+// Body of an HTTP upload, written to the current (destination) folder as
+// it arrives: multipart/form-data (browser forms, one file per part) or
+// any other type as a single file. The body is either Content-Length
+// bytes or chunked. Only the bytes that can't be written yet (a possible
+// part delimiter, an incomplete chunk size line...) are kept in memory.
+class UploadReceiver
+{
+public:
+    static const int MAX_HEADERS_SIZE = 8192;   // Of a part
+
+    enum Status {
+        NeedMore,
+        Finished,
+        Failed
+    };
+
+    // length -1 for a chunked body, name of the file for a raw body,
+    // maxSize the bytes allowed on disk for all the files
+    UploadReceiver(const QByteArray &contentType, qint64 length, const QString &name, qint64 maxSize);
+    ~UploadReceiver();
+
+    // Consumes the bytes of the body found at the start of input
+    Status feed(QByteArray &input);
+
+    // Files completed, by name in the destination folder
+    inline const QStringList& files() const { return mFiles; }
+    inline qint64 size() const { return mSize; }
+
+    // Failed for going over maxSize
+    inline bool tooLarge() const { return mTooLarge; }
+
+private:
+    UploadReceiver(const UploadReceiver&) = delete;
+    UploadReceiver& operator=(const UploadReceiver&) = delete;
+
+    enum ChunkState {
+        ChunkSize,
+        ChunkData,
+        ChunkDataEnd,
+        ChunkTrailer
+    };
+
+    enum PartState {
+        Preamble,
+        Delimiter,
+        Headers,
+        Data,
+        Epilogue
+    };
+
+    bool content(const char *data, qint64 size);
+    bool write(const char *data, qint64 size);
+    bool contentEnd();
+    bool parts();
+    bool openFile(const QString &name, qint64 sizeHint);
+    bool closeFile();
+
+    // Framing
+    qint64 mRemaining;          // Body (or chunk) bytes still to come
+    bool mChunked;
+    ChunkState mChunkState;
+
+    // Content
+    bool mMultipart;
+    QByteArray mDelimiter;      // "\r\n--boundary"
+    PartState mPartState;
+    QByteArray mPending;        // Not handled yet, bounded
+    QFile *mFile;
+    qint64 mWritten;
+    QStringList mFiles;
+    qint64 mSize;
+    qint64 mMaxSize;
+    bool mTooLarge;
+    bool mFailed;
+};
+
+#endif // UPLOADRECEIVER_H
@@ -0,0 +1,106 @@
+#include "wakeupstats.h"
+
+#include <QCoreApplication>
+#include <QAbstractEventDispatcher>
+#include <QDateTime>
+#include <QEvent>
+#include <QFile>
+#include <algorithm>
+#include <cstdio>
+
+#include "idlescheduler.h"
+
+#define REPORT_INTERVAL 60000   // ms
+#define REPORT_TIMERS 5         // Busiest timers listed
+
+QString WakeupStats::sFile;
+WakeupStats *WakeupStats::sInstance = NULL;
+
+void WakeupStats::start(int argc, char *argv[])
+{
+    // Parsed by hand, the application doesn't exist yet
+    for (int i = 1; i + 1 < argc; i++)
+        if (QByteArray(argv[i]) == "--wakeup-stats")
+            sFile = QString::fromLocal8Bit(argv[++i]);
+}
+
+void WakeupStats::install()
+{
+    if (sFile.isEmpty() || sInstance) return;
+    sInstance = new WakeupStats(QCoreApplication::instance());
+}
+
+void WakeupStats::setIdle(bool idle)
+{
+    if (sInstance) sInstance->mIdle = idle;
+}
+
+WakeupStats::WakeupStats(QObject *parent) :
+    QObject(parent), mIdle(false), mWakeups(0), mTimerEvents(0), mSocketEvents(0),
+    mSchedulerWakeups(0)
+{
+    QCoreApplication::instance()->installEventFilter(this);
+    connect(QAbstractEventDispatcher::instance(), SIGNAL(awake()), this, SLOT(awake()));
+    connect(&mTimer, SIGNAL(timeout()), this, SLOT(report()));
+    mTimer.start(REPORT_INTERVAL);
+}
+
+void WakeupStats::awake()
+{
+    mWakeups++;
+}
+
+// Events of the GUI thread, counted and let through
+bool WakeupStats::eventFilter(QObject *watched, QEvent *event)
+{
+    if (event->type() == QEvent::Timer)
+    {
+        mTimerEvents++;
+
+        // Timers are members, or children, of what they're working for
+        QObject *owner = (watched->inherits("QTimer") && watched->parent()) ? watched->parent() : watched;
+        mTimers[owner->metaObject()->className()]++;
+    }
+    else if (event->type() == QEvent::SockAct)
+        mSocketEvents++;
+    return false;
+}
+
+void WakeupStats::report()
+{
+    qint64 scheduler = IdleScheduler::instance()->wakeups();
+
+    QList<QPair<qint64, QByteArray> > timers;
+    for (auto it = mTimers.constBegin(); it != mTimers.constEnd(); ++it)
+        timers.append(qMakePair(it.value(), it.key()));
+    std::sort(timers.begin(), timers.end(), [](const QPair<qint64, QByteArray> &a, const QPair<qint64, QByteArray> &b) {
+        return a.first > b.first;
+    });
+
+    QByteArray line = QDateTime::currentDateTime().toString(Qt::ISODate).toLatin1()
+                      + (mIdle ? " idle" : " active")
+                      + " wakeups " + QByteArray::number(mWakeups)
+                      + " timers " + QByteArray::number(mTimerEvents)
+                      + " sockets " + QByteArray::number(mSocketEvents)
+                      + " scheduler " + QByteArray::number(scheduler - mSchedulerWakeups);
+    for (int i = 0; (i < timers.size()) && (i < REPORT_TIMERS); i++)
+        line += " " + timers.at(i).second + ":" + QByteArray::number(timers.at(i).first);
+    line += "\n";
+
+    mWakeups = 0;
+    mTimerEvents = 0;
+    mSocketEvents = 0;
+    mSchedulerWakeups = scheduler;
+    mTimers.clear();
+
+    if (sFile == "-")
+    {
+        fputs(line.constData(), stderr);
+        return;
+    }
+    QFile file(sFile);
+    if (file.open(QIODevice::WriteOnly | QIODevice::Append))
+        file.write(line);
+    else
+        fprintf(stderr, "Can't write the wakeup stats to %s\n", qPrintable(sFile));
+}
@@ -0,0 +1,56 @@
+#ifndef WAKEUPSTATS_H
+#define WAKEUPSTATS_H
+
+#include <QObject>
+#include <QString>
+#include <QTimer>
+#include <QHash>
+#include <QList>
+#include <QPair>
+
+// Wakeups of the GUI thread per minute, to check what keeps the process
+// busy while nobody uses it. Off unless asked for on the command line:
+//
+//   --wakeup-stats <file>      a line per minute appended there ("-" for
+//                              stderr): wakeups of the event loop, timer
+//                              and socket events (busiest timers first),
+//                              runs of the IdleScheduler, idle or not
+//
+// The report itself wakes the process once a minute.
+class WakeupStats : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Reads the options, before the application is created
+    static void start(int argc, char *argv[]);
+
+    // Starts counting, once the application exists
+    static void install();
+
+    // Noted in the report
+    static void setIdle(bool idle);
+
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
+private slots:
+    void awake();
+    void report();
+
+private:
+    explicit WakeupStats(QObject *parent);
+
+    static QString sFile;
+    static WakeupStats *sInstance;
+
+    QTimer mTimer;
+    bool mIdle;
+    qint64 mWakeups;
+    qint64 mTimerEvents;
+    qint64 mSocketEvents;
+    qint64 mSchedulerWakeups;
+    QHash<QByteArray, qint64> mTimers;  // Events by class of the timer's owner
+};
+
+#endif // WAKEUPSTATS_H